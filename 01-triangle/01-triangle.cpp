@@ -1,5 +1,14 @@
 #include "../framework/vulkanRtApp.h"
 
+namespace
+{
+alignas(MAGMA_ALIGNMENT) const float vertices[3][3] = {
+    { 0.0f,-0.3f, 0.f},
+    {-0.6f, 0.3f, 0.f},
+    { 0.6f, 0.3f, 0.f}
+};
+}
+
 class TriangleApp : public VulkanRayTracingApp
 {
     struct TopLevelAccelerationStructureTable : magma::DescriptorSetTable
@@ -20,15 +29,14 @@ class TriangleApp : public VulkanRayTracingApp
 
 public:
     TriangleApp(const AppEntry& entry):
-        VulkanRayTracingApp(entry, TEXT("Hello, triangle!"), 512, 512)
+        VulkanRayTracingApp(entry, TEXT("Hello, triangle!"), 512, 512, true) // Accumulates samples
     {
         createGeometry();
         createAccelerationStructures();
         buildAccelerationStructures();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
     }
 
     void render(uint32_t bufferIndex) override
@@ -38,12 +46,7 @@ public:
 
     void createGeometry()
     {
-        alignas(MAGMA_ALIGNMENT) const magma::vt::Pos3f vertices[] = {
-            { 0.0f,-0.3f, 0.f},
-            {-0.6f, 0.3f, 0.f},
-            { 0.6f, 0.3f, 0.f}
-        };
-        vertexBuffer = std::make_unique<magma::AccelerationStructureInputBuffer>(cmdBufferCopy, sizeof(vertices), vertices);
+        vertexBuffer = std::make_unique<magma::AccelerationStructureInputBuffer>(cmdBufferCopy, sizeof(vertices), vertices, allocator);
         geometry = magma::AccelerationStructureGeometryTriangles(VK_FORMAT_R32G32B32_SFLOAT, vertexBuffer);
     }
 
@@ -52,36 +55,38 @@ public:
         bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(device,
             std::list<magma::AccelerationStructureGeometry>{geometry},
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+            allocator);
+        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1, allocator);
         geometryInstance = magma::AccelerationStructureGeometryInstances(instanceBuffer);
         instanceBuffer->getInstance(0).accelerationStructureReference = bottomLevel->getReference();
         topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device,
             geometryInstance,
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+            allocator);
     }
 
     void buildAccelerationStructures()
     {
-        const VkDeviceSize maxSize = std::max(bottomLevel->getBuildScratchSize(), topLevel->getBuildScratchSize());
-        scratchBuffer = allocateScratchBuffer(maxSize);
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
             instanceBuffer->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(bottomLevel, {geometry}, scratchBuffer);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, bottomLevel, {geometry});
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::accelerationStructureWriteRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, topLevel, {geometryInstance});
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Instance data is read by initial build, keep it until build is complete
+        scheduler->wait(submitComputeCommands());
     }
 
     void setupDescriptorSet()
@@ -101,30 +106,65 @@ public:
             {
                 descriptorSet->getLayout(),
                 swapchainDescriptorSets.front()->getLayout(),
+                accumulationDescriptorSet->getLayout(),
             }));
-        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout)));
-        shaderBindingTable.build(pipeline, commandBuffers[0]);
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout), pipelineCache));
+        shaderBindingTable.build(pipeline, commandBuffers[0], allocator);
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
+            // Previous frame may still accumulate samples
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
             cmdBuffer->bindPipeline(pipeline);
             cmdBuffer->bindDescriptorSets(pipeline, 0,
                 {
                     descriptorSet,
-                    swapchainDescriptorSets[index]
-                });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+                    swapchainDescriptorSets[index],
+                    accumulationDescriptorSet
+                },
+                {accumulationUniforms->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
+
+    bool renderReference(std::vector<uint32_t>& pixels) const override
+    {   // Same orthographic rays through pixel centers as trace.rgen
+        constexpr uint32_t red = 0xFF0000FF, gray = 0xFF808080; // RGBA8
+        auto edge = [](float x, float y, const float *v0, const float *v1)
+        {
+            return (v1[0] - v0[0]) * (y - v0[1]) - (v1[1] - v0[1]) * (x - v0[0]);
+        };
+        for (uint32_t y = 0; y < height; ++y)
+        {
+            for (uint32_t x = 0; x < width; ++x)
+            {
+                const float px = (x + 0.5f) / width * 2.f - 1.f;
+                const float py = (y + 0.5f) / height * 2.f - 1.f;
+                const float e0 = edge(px, py, vertices[0], vertices[1]);
+                const float e1 = edge(px, py, vertices[1], vertices[2]);
+                const float e2 = edge(px, py, vertices[2], vertices[0]);
+                const bool hit = ((e0 >= 0.f) && (e1 >= 0.f) && (e2 >= 0.f)) ||
+                    ((e0 <= 0.f) && (e1 <= 0.f) && (e2 <= 0.f));
+                pixels[y * width + x] = hit ? red : gray;
+            }
+        }
+        return true;
+    }
 };
 
 std::unique_ptr<IApplication> appFactory(const AppEntry& entry)
@@ -23,7 +23,7 @@ class ProceduralIntersectionApp : public VulkanRayTracingApp
 
 public:
     ProceduralIntersectionApp(const AppEntry& entry):
-        VulkanRayTracingApp(entry, TEXT("Procedural intersection"), 512, 512)
+        VulkanRayTracingApp(entry, TEXT("Procedural intersection"), 512, 512, true) // Accumulates samples
     {
         setupView();
         createBoundingBox();
@@ -31,8 +31,7 @@ public:
         buildAccelerationStructures();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
         timer->run();
     }
 
@@ -66,7 +65,7 @@ public:
             -1, -1, -1,
             1, 1, 1
         };
-        aabbBuffer = magma::helpers::makeInputBuffer(aabb, cmdBufferCopy);
+        aabbBuffer = magma::helpers::makeInputBuffer(aabb, cmdBufferCopy, allocator);
         aabbGeometry = magma::AccelerationStructureGeometryAabbs(aabbBuffer);
     }
 
@@ -75,36 +74,38 @@ public:
         bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(device,
             std::list<magma::AccelerationStructureGeometry>{aabbGeometry},
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+            allocator);
+        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1, allocator);
         geometryInstance = magma::AccelerationStructureGeometryInstances(instanceBuffer);
         instanceBuffer->getInstance(0).accelerationStructureReference = bottomLevel->getReference();
         topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device,
             geometryInstance,
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+            allocator);
     }
 
     void buildAccelerationStructures()
     {
-        const VkDeviceSize maxSize = std::max(bottomLevel->getBuildScratchSize(), topLevel->getBuildScratchSize());
-        scratchBuffer = allocateScratchBuffer(maxSize);
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
             instanceBuffer->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(bottomLevel, {aabbGeometry}, scratchBuffer);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, bottomLevel, {aabbGeometry});
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::accelerationStructureWriteRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, topLevel, {geometryInstance});
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Instance data is read by initial build, keep it until build is complete
+        scheduler->wait(submitComputeCommands());
     }
 
     void setupDescriptorSet()
@@ -125,28 +126,39 @@ public:
             {
                 descriptorSet->getLayout(),
                 swapchainDescriptorSets.front()->getLayout(),
+                accumulationDescriptorSet->getLayout(),
             }));
         constexpr uint32_t maxRecursionDepth = 1;
-        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"trace", "miss", "hit", "raySphere"}, shaderGroups, maxRecursionDepth, std::move(layout)));
-        shaderBindingTable.build(pipeline, cmdBufferCopy);
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "miss", "hit", "raySphere"}, shaderGroups, maxRecursionDepth, std::move(layout), pipelineCache));
+        shaderBindingTable.build(pipeline, cmdBufferCopy, allocator);
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
+            // Previous frame may still accumulate samples
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
             cmdBuffer->bindPipeline(pipeline);
             cmdBuffer->bindDescriptorSets(pipeline, 0,
                 {
                     descriptorSet,
-                    swapchainDescriptorSets[index]
-                });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+                    swapchainDescriptorSets[index],
+                    accumulationDescriptorSet
+                },
+                {accumulationUniforms->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
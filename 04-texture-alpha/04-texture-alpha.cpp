@@ -14,10 +14,10 @@ class TextureAlphaApp : public VulkanRayTracingApp
     } setTable;
 
     magma::AccelerationStructureGeometryTriangles geometry;
-    magma::AccelerationStructureGeometryInstances geometryInstance;
+    std::vector<magma::AccelerationStructureGeometryInstances> geometryInstances;
     std::unique_ptr<magma::AccelerationStructureInputBuffer> vertexBuffer;
     std::shared_ptr<magma::StorageBuffer> texCoordBuffer;
-    std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>> instanceBuffer;
+    std::vector<std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>> instanceBuffers;
     std::shared_ptr<magma::BottomLevelAccelerationStructure> bottomLevel;
     std::shared_ptr<magma::TopLevelAccelerationStructure> topLevel;
     std::shared_ptr<magma::ImageView> albedo;
@@ -37,8 +37,7 @@ public:
         buildAccelerationStructures();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
         timer->run();
     }
 
@@ -74,13 +73,13 @@ public:
         static float angle = 0.f;
         angle += step;
         const rapid::matrix world = rapid::rotationY(rapid::radians(angle));
-        auto& instance = instanceBuffer->getInstance(0);
+        auto& instance = instanceBuffers[frameInFlightIndex]->getInstance(0);
         world.store(instance.transform.matrix);
     }
 
     void loadTexture()
     {
-        albedo = loadImage("../assets/textures/leaf.png", cmdImageCopy);
+        albedo = loadImage("../assets/textures/leaf.png", cmdImageCopy, allocator);
         bilinearSampler = std::make_shared<magma::Sampler>(device, magma::sampler::magMinLinearMipNearestClampToEdge);
     }
 
@@ -103,8 +102,8 @@ public:
             {1, 0},
             {1, 1}
         };
-        vertexBuffer = magma::helpers::makeInputBuffer(vertices, cmdBufferCopy);
-        texCoordBuffer = magma::helpers::makeStorageBuffer(texCoords, cmdBufferCopy);
+        vertexBuffer = magma::helpers::makeInputBuffer(vertices, cmdBufferCopy, allocator);
+        texCoordBuffer = magma::helpers::makeStorageBuffer(texCoords, cmdBufferCopy, allocator);
         geometry = magma::AccelerationStructureGeometryTriangles(VK_FORMAT_R32G32_SFLOAT, vertexBuffer);
     }
 
@@ -113,36 +112,43 @@ public:
         bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(device,
             std::list<magma::AccelerationStructureGeometry>{geometry},
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1);
-        geometryInstance = magma::AccelerationStructureGeometryInstances(instanceBuffer);
-        instanceBuffer->getInstance(0).accelerationStructureReference = bottomLevel->getReference();
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+            allocator);
+        for (uint32_t i = 0; i < framesInFlight; ++i)
+        {   // Each frame in flight has its own copy of instance data
+            instanceBuffers.emplace_back(std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1, allocator));
+            instanceBuffers.back()->getInstance(0).accelerationStructureReference = bottomLevel->getReference();
+            geometryInstances.emplace_back(instanceBuffers.back());
+        }
         topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device,
-            geometryInstance,
+            geometryInstances.front(),
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+            allocator);
     }
 
     void buildAccelerationStructures()
     {
-        const VkDeviceSize maxSize = std::max(bottomLevel->getBuildScratchSize(), topLevel->getBuildScratchSize());
-        scratchBuffer = allocateScratchBuffer(maxSize);
+        // Top-level structure is updated every frame, so it owns scratch buffer
+        scratchBuffer = allocateScratchBuffer(topLevel->getBuildScratchSize());
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
-            instanceBuffer->updateModified(cmdCompute);
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
+            instanceBuffers.front()->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(bottomLevel, {geometry}, scratchBuffer);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, bottomLevel, {geometry});
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::accelerationStructureWriteRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            cmdCompute->buildAccelerationStructure(topLevel, geometryInstances.front(), scratchBuffer);
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Host writes instance data in render(), so initial copy must be complete
+        scheduler->wait(submitComputeCommands());
     }
 
     void setupDescriptorSet()
@@ -168,24 +174,32 @@ public:
                 swapchainDescriptorSets.front()->getLayout(),
             }));
         constexpr uint32_t maxRayRecursionDepth = 2;
-        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"trace", "hit", "miss"}, shaderGroups, maxRayRecursionDepth, std::move(layout)));
-        shaderBindingTable.build(pipeline, cmdBufferCopy);
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "hit", "miss"}, shaderGroups, maxRayRecursionDepth, std::move(layout), pipelineCache));
+        shaderBindingTable.build(pipeline, cmdBufferCopy, allocator);
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
-            instanceBuffer->updateWhole(cmdBuffer);
+            // Previous frame may still trace rays against top-level structure
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR));
+            instanceBuffers[frame]->updateWhole(cmdBuffer);
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdBuffer->updateAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "updateTopLevel");
+                cmdBuffer->updateAccelerationStructure(topLevel, geometryInstances[frame], scratchBuffer);
+            }
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
@@ -196,8 +210,11 @@ public:
                     descriptorSet,
                     swapchainDescriptorSets[index]
                 });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
@@ -2,6 +2,8 @@
 #include "../third-party/tinyobjloader/tiny_obj_loader.h"
 #include "../framework/vulkanRtApp.h"
 #include "../framework/rayTracingPipeline.h"
+#include "../framework/vertex.h"
+#include "../framework/packing.h"
 
 class MeshApp : public VulkanRayTracingApp
 {
@@ -9,18 +11,21 @@ class MeshApp : public VulkanRayTracingApp
     {
         magma::descriptor::UniformBuffer view = 0;
         magma::descriptor::AccelerationStructure topLevel = 1;
-        magma::descriptor::StorageBuffer vertices = 2;
-        magma::descriptor::UniformBuffer normalMatrix = 3;
-        MAGMA_REFLECT(view, topLevel, vertices, normalMatrix)
+        magma::descriptor::StorageBuffer bufferReferences = 2;
+        magma::descriptor::DynamicUniformBuffer normalMatrix = 3;
+        MAGMA_REFLECT(view, topLevel, bufferReferences, normalMatrix)
     } setTable;
 
     magma::AccelerationStructureGeometryTriangles geometry;
-    magma::AccelerationStructureGeometryInstances geometryInstance;
-    std::shared_ptr<magma::AccelerationStructureInputBuffer> vertexBuffer;
-    std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>> instanceBuffer;
+    std::vector<magma::AccelerationStructureGeometryInstances> geometryInstances;
+    std::shared_ptr<magma::AccelerationStructureInputBuffer> positionBuffer;
+    std::shared_ptr<magma::StorageBuffer> attributeBuffer;
+    std::shared_ptr<magma::AccelerationStructureInputBuffer> indexBuffer;
+    std::shared_ptr<magma::StorageBuffer> bufferReferences;
+    std::vector<std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>> instanceBuffers;
     std::shared_ptr<magma::BottomLevelAccelerationStructure> bottomLevel;
     std::shared_ptr<magma::TopLevelAccelerationStructure> topLevel;
-    std::shared_ptr<magma::UniformBuffer<rapid::matrix>> normalMatrix;
+    std::unique_ptr<FrameUniformBuffer<rapid::matrix>> normalMatrices;
     std::shared_ptr<magma::DescriptorSet> descriptorSet;
     std::shared_ptr<magma::RayTracingPipeline> pipeline;
     magma::ShaderBindingTable shaderBindingTable;
@@ -31,13 +36,13 @@ public:
     {
         setupView();
         loadMesh("rat.obj");
+        createReferenceBuffer();
         createAccelerationStructures();
         buildAccelerationStructures();
         createUniformBuffer();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
         timer->run();
     }
 
@@ -73,13 +78,10 @@ public:
         static float angle = 0.f;
         angle += step;
         const rapid::matrix world = rapid::rotationY(rapid::radians(angle));
-        auto& instance = instanceBuffer->getInstance(0);
+        auto& instance = instanceBuffers[frameInFlightIndex]->getInstance(0);
         world.store(instance.transform.matrix);
-        magma::helpers::mapScoped(normalMatrix,
-            [&world](rapid::matrix *normal)
-            {
-                *normal = rapid::transpose(rapid::inverse(world));
-            });
+        *normalMatrices->getFrameData(frameInFlightIndex) = rapid::transpose(rapid::inverse(world));
+        normalMatrices->flush(frameInFlightIndex);
     }
 
     void loadMesh(const std::string& fileName)
@@ -95,20 +97,50 @@ public:
             std::cout << warn;
         if (error.length())
             std::cerr << error;
-        std::vector<rapid::float4> vertices;
+        // Positions of .obj are already tightly packed, so they feed
+        // acceleration structure build and face normals as is
+        const uint32_t vertexCount = static_cast<uint32_t>(attrib.vertices.size() / 3);
         const tinyobj::mesh_t& mesh = shapes.front().mesh;
-        vertices.reserve(mesh.indices.size());
+        std::vector<uint32_t> indices;
+        indices.reserve(mesh.indices.size());
         for (const auto& index: mesh.indices)
+            indices.push_back(static_cast<uint32_t>(index.vertex_index));
+        // Flat shading fetches only color from attribute stream
+        const bool hasColors = (attrib.colors.size() == attrib.vertices.size());
+        std::vector<VertexAttributes> attributes(vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
         {
-            const int offset = index.vertex_index * 3;
-            vertices.emplace_back(
-                attrib.vertices[offset],
-                attrib.vertices[offset + 1],
-                attrib.vertices[offset + 2],
-                1.f);
+            VertexAttributes& a = attributes[i];
+            a.color[0] = hasColors ? packUnorm(attrib.colors[i * 3]) : 255;
+            a.color[1] = hasColors ? packUnorm(attrib.colors[i * 3 + 1]) : 255;
+            a.color[2] = hasColors ? packUnorm(attrib.colors[i * 3 + 2]) : 255;
+            a.color[3] = 255;
         }
-        vertexBuffer = magma::helpers::makeInputBuffer(vertices, cmdBufferCopy);
-        geometry = magma::AccelerationStructureGeometryTriangles(VK_FORMAT_R32G32B32A32_SFLOAT, vertexBuffer);
+        positionBuffer = magma::helpers::makeInputBuffer(attrib.vertices, cmdBufferCopy, allocator);
+        indexBuffer = magma::helpers::makeInputBuffer(indices, cmdBufferCopy, allocator);
+        // Attributes are read only through buffer reference
+        magma::Buffer::Initializer initializer;
+        initializer.deviceAddress = true;
+        attributeBuffer = std::make_shared<magma::StorageBuffer>(cmdBufferCopy,
+            attributes.size() * sizeof(VertexAttributes),
+            attributes.data(),
+            allocator,
+            initializer);
+        geometry = magma::AccelerationStructureGeometryTriangles(
+            VK_FORMAT_R32G32B32_SFLOAT, positionBuffer,
+            VK_INDEX_TYPE_UINT32, indexBuffer);
+        geometry.geometry.triangles.vertexStride = sizeof(rapid::float3);
+        geometry.geometry.triangles.maxVertex = vertexCount;
+    }
+
+    void createReferenceBuffer()
+    {   // Hit shader loads mesh data from these buffers
+        const std::vector<VkDeviceAddress> addresses = {
+            positionBuffer->getDeviceAddress(),
+            attributeBuffer->getDeviceAddress(),
+            indexBuffer->getDeviceAddress()
+        };
+        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy, allocator);
     }
 
     void createAccelerationStructures()
@@ -116,49 +148,56 @@ public:
         bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(device,
             std::list<magma::AccelerationStructureGeometry>{geometry},
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1);
-        geometryInstance = magma::AccelerationStructureGeometryInstances(instanceBuffer);
-        instanceBuffer->getInstance(0).accelerationStructureReference = bottomLevel->getReference();
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+            allocator);
+        for (uint32_t i = 0; i < framesInFlight; ++i)
+        {   // Each frame in flight has its own copy of instance data
+            instanceBuffers.emplace_back(std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1, allocator));
+            instanceBuffers.back()->getInstance(0).accelerationStructureReference = bottomLevel->getReference();
+            geometryInstances.emplace_back(instanceBuffers.back());
+        }
         topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device,
-            geometryInstance,
+            geometryInstances.front(),
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+            allocator);
     }
 
     void buildAccelerationStructures()
     {
-        const VkDeviceSize maxSize = std::max(bottomLevel->getBuildScratchSize(), topLevel->getBuildScratchSize());
-        scratchBuffer = allocateScratchBuffer(maxSize);
+        // Top-level structure is updated every frame, so it owns scratch buffer
+        scratchBuffer = allocateScratchBuffer(topLevel->getBuildScratchSize());
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
-            instanceBuffer->updateModified(cmdCompute);
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
+            instanceBuffers.front()->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(bottomLevel, {geometry}, scratchBuffer);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, bottomLevel, {geometry});
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::accelerationStructureWriteRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            cmdCompute->buildAccelerationStructure(topLevel, geometryInstances.front(), scratchBuffer);
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Host writes instance data in render(), so initial copy must be complete
+        scheduler->wait(submitComputeCommands());
     }
 
     void createUniformBuffer()
     {
-        normalMatrix = std::make_shared<magma::UniformBuffer<rapid::matrix>>(device);
+        normalMatrices = std::make_unique<FrameUniformBuffer<rapid::matrix>>(device, framesInFlight, allocator);
     }
 
     void setupDescriptorSet()
     {
         setTable.view = viewUniforms;
         setTable.topLevel = topLevel;
-        setTable.vertices = vertexBuffer;
-        setTable.normalMatrix = normalMatrix;
+        setTable.bufferReferences = bufferReferences;
+        setTable.normalMatrix = normalMatrices->getBuffer();
         descriptorSet = std::make_shared<magma::DescriptorSet>(descriptorPool, setTable,
             VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
     }
@@ -175,28 +214,36 @@ public:
                 descriptorSet->getLayout(),
                 swapchainDescriptorSets.front()->getLayout(),
             }));
-        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout)));
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout), pipelineCache));
         // Light pos
         shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1, rapid::float3(-100, 200, 100));
         // Background color
         shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_MISS_BIT_KHR, 2, rapid::float3(0.35f, 0.53f, 0.7f));
-        shaderBindingTable.build(pipeline, cmdBufferCopy);
+        shaderBindingTable.build(pipeline, cmdBufferCopy, allocator);
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
-            instanceBuffer->updateWhole(cmdBuffer);
+            // Previous frame may still trace rays against top-level structure
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR));
+            instanceBuffers[frame]->updateWhole(cmdBuffer);
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdBuffer->updateAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "updateTopLevel");
+                cmdBuffer->updateAccelerationStructure(topLevel, geometryInstances[frame], scratchBuffer);
+            }
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
@@ -206,9 +253,13 @@ public:
                 {
                     descriptorSet,
                     swapchainDescriptorSets[index]
-                });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+                },
+                {normalMatrices->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
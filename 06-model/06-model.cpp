@@ -9,16 +9,16 @@ class ModelApp : public VulkanRayTracingApp
         magma::descriptor::UniformBuffer view = 0;
         magma::descriptor::AccelerationStructure topLevel = 1;
         magma::descriptor::StorageBuffer bufferReferences = 2;
-        magma::descriptor::UniformBuffer normalMatrix = 3;
+        magma::descriptor::DynamicUniformBuffer normalMatrix = 3;
         MAGMA_REFLECT(view, topLevel, bufferReferences, normalMatrix)
     } setTable;
 
     std::unique_ptr<ObjModel> model;
-    std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>> instanceBuffer;
-    magma::AccelerationStructureGeometryInstances geometryInstance;
+    std::vector<std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>> instanceBuffers;
+    std::vector<magma::AccelerationStructureGeometryInstances> geometryInstances;
     std::shared_ptr<magma::TopLevelAccelerationStructure> topLevel;
     std::shared_ptr<magma::StorageBuffer> bufferReferences;
-    std::shared_ptr<magma::UniformBuffer<rapid::matrix>> normalMatrix;
+    std::unique_ptr<FrameUniformBuffer<rapid::matrix>> normalMatrices;
     std::shared_ptr<magma::DescriptorSet> descriptorSet;
     std::shared_ptr<magma::RayTracingPipeline> pipeline;
     magma::ShaderBindingTable shaderBindingTable;
@@ -35,8 +35,7 @@ public:
         createUniformBuffer();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
         timer->run();
     }
 
@@ -72,18 +71,19 @@ public:
         static float angle = 0.f;
         angle += step;
         const rapid::matrix world = rapid::rotationY(rapid::radians(angle));
-        auto& instance = instanceBuffer->getInstance(0);
+        auto& instance = instanceBuffers[frameInFlightIndex]->getInstance(0);
         world.store(instance.transform.matrix);
-        magma::helpers::mapScoped(normalMatrix,
-            [&world](rapid::matrix *normal)
-            {
-                *normal = rapid::transpose(rapid::inverse(world));
-            });
+        *normalMatrices->getFrameData(frameInFlightIndex) = rapid::transpose(rapid::inverse(world));
+        normalMatrices->flush(frameInFlightIndex);
     }
 
     void loadModel(const std::string& fileName, bool swapYZ)
     {
-        model = std::make_unique<ObjModel>(fileName, cmdCompute, false, swapYZ);
+        constexpr uint32_t lodCount = 1;
+        constexpr bool splitStreams = true; // Flat shading needs only positions and color
+        model = std::make_unique<ObjModel>(fileName, cmdCompute, allocator, *buildBatcher, false, swapYZ,
+            accelerationStructureCache.get(), lodCount, splitStreams);
+        buildBatcher->flush(cmdCompute);
     }
 
     void createReferenceBuffer()
@@ -92,41 +92,48 @@ public:
         for (auto const& mesh: model->getMeshes())
         {   // Hit shader loads mesh data from these buffers
             addresses.push_back(mesh.getVertexBuffer()->getDeviceAddress());
+            addresses.push_back(mesh.getAttributeBuffer()->getDeviceAddress());
             addresses.push_back(mesh.getIndexBuffer()->getDeviceAddress());
         }
-        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy);
+        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy, allocator);
     }
 
     void createInstanceBuffer()
     {
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1);
-        instanceBuffer->getInstance(0).accelerationStructureReference = model->getAccelerationStructure()->getReference();
-        geometryInstance = magma::AccelerationStructureGeometryInstances(instanceBuffer);
+        for (uint32_t i = 0; i < framesInFlight; ++i)
+        {   // Each frame in flight has its own copy of instance data
+            instanceBuffers.emplace_back(std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1, allocator));
+            instanceBuffers.back()->getInstance(0).accelerationStructureReference = model->getAccelerationStructure()->getReference();
+            geometryInstances.emplace_back(instanceBuffers.back());
+        }
     }
 
     void buildTopLevelAccelerationStructure()
     {
-        topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device, geometryInstance,
+        topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device, geometryInstances.front(),
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+            allocator);
         scratchBuffer = allocateScratchBuffer(topLevel->getBuildScratchSize());
         cmdCompute->reset();
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
-            instanceBuffer->updateModified(cmdCompute);
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
+            instanceBuffers.front()->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            cmdCompute->buildAccelerationStructure(topLevel, geometryInstances.front(), scratchBuffer);
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Host writes instance data in render(), so initial copy must be complete
+        scheduler->wait(submitComputeCommands());
     }
 
     void createUniformBuffer()
     {
-        normalMatrix = std::make_shared<magma::UniformBuffer<rapid::matrix>>(device);
+        normalMatrices = std::make_unique<FrameUniformBuffer<rapid::matrix>>(device, framesInFlight, allocator);
     }
 
     void setupDescriptorSet()
@@ -134,7 +141,7 @@ public:
         setTable.view = viewUniforms;
         setTable.topLevel = topLevel;
         setTable.bufferReferences = bufferReferences;
-        setTable.normalMatrix = normalMatrix;
+        setTable.normalMatrix = normalMatrices->getBuffer();
         descriptorSet = std::make_shared<magma::DescriptorSet>(descriptorPool, setTable,
             VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
     }
@@ -151,28 +158,36 @@ public:
                 descriptorSet->getLayout(),
                 swapchainDescriptorSets.front()->getLayout(),
             }));
-        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout)));
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout), pipelineCache));
         // Light pos
         shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1, rapid::float3(200, 1000, 1000));
         // Background color
         shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_MISS_BIT_KHR, 2, rapid::float3(0.85f, 0.67f, 0.78f));
-        shaderBindingTable.build(pipeline, cmdBufferCopy);
+        shaderBindingTable.build(pipeline, cmdBufferCopy, allocator);
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
-            instanceBuffer->updateWhole(cmdBuffer);
+            // Previous frame may still trace rays against top-level structure
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR));
+            instanceBuffers[frame]->updateWhole(cmdBuffer);
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdBuffer->updateAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "updateTopLevel");
+                cmdBuffer->updateAccelerationStructure(topLevel, geometryInstances[frame], scratchBuffer);
+            }
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
@@ -182,9 +197,13 @@ public:
                 {
                     descriptorSet,
                     swapchainDescriptorSets[index]
-                });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+                },
+                {normalMatrices->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
@@ -1,35 +1,43 @@
 #include "../framework/vulkanRtApp.h"
 #include "../framework/rayTracingPipeline.h"
 #include "../framework/objModel.h"
+#include "../framework/lodSelector.h"
 
 class TextureMappingApp : public VulkanRayTracingApp
 {
+    static constexpr uint32_t lodCount = 4;
+    static constexpr uint32_t instanceCount = 4;
+    static constexpr float fov = rapid::radians(45.f);
+
     struct DescriptorSetTable: magma::DescriptorSetTable
     {
         magma::descriptor::UniformBuffer view = 0;
         magma::descriptor::AccelerationStructure topLevel = 1;
         magma::descriptor::StorageBuffer bufferReferences = 2;
         magma::descriptor::CombinedImageImmutableSampler diffuseMap = 3;
-        magma::descriptor::UniformBuffer normalMatrix = 4;
+        magma::descriptor::DynamicUniformBuffer normalMatrix = 4;
         MAGMA_REFLECT(view, topLevel, bufferReferences, diffuseMap, normalMatrix)
     } setTable;
 
     std::unique_ptr<ObjModel> model;
-    std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>> instanceBuffer;
-    magma::AccelerationStructureGeometryInstances geometryInstance;
+    std::unique_ptr<LodSelector> lodSelector;
+    std::vector<std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>> instanceBuffers;
+    std::vector<magma::AccelerationStructureGeometryInstances> geometryInstances;
     std::shared_ptr<magma::TopLevelAccelerationStructure> topLevel;
     std::shared_ptr<magma::StorageBuffer> bufferReferences;
-    std::shared_ptr<magma::UniformBuffer<rapid::matrix>> normalMatrix;
+    std::unique_ptr<FrameUniformBuffer<rapid::matrix>> normalMatrices;
     std::shared_ptr<magma::Sampler> bilinearSampler;
     std::shared_ptr<magma::DescriptorSet> descriptorSet;
     std::shared_ptr<magma::RayTracingPipeline> pipeline;
     magma::ShaderBindingTable shaderBindingTable;
 
     float zDist = 20.f;
+    float modelRadius = 0.f;
+    uint32_t lods[instanceCount] = {};
 
 public:
     TextureMappingApp(const AppEntry& entry):
-        VulkanRayTracingApp(entry, TEXT("Texture mapping"), 512, 512)
+        VulkanRayTracingApp(entry, TEXT("Texture mapping"), 512, 512, true) // Accumulates samples
     {
         updateView();
         loadModel("12270_Frog_v1_L3.obj", true);
@@ -39,8 +47,7 @@ public:
         createUniformBuffer();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
         timer->run();
     }
 
@@ -55,6 +62,7 @@ public:
         zDist += delta;
         zDist = std::max(5.f, zDist);
         updateView();
+        resetAccumulation();
     }
 
     void updateView()
@@ -62,7 +70,6 @@ public:
         const rapid::vector3 eye(0.f, zDist * 0.5f, zDist);
         const rapid::vector3 center(0.f, 2.f, 0.f);
         const rapid::vector3 up(0.f, 1.f, 0.f);
-        constexpr float fov = rapid::radians(45.f);
         const float aspect = width/(float)height;
         constexpr float zn = 0.1f, zf = 1.f;
         const rapid::matrix view = rapid::lookAtRH(eye, center, up);
@@ -77,63 +84,114 @@ public:
     }
 
     void updateWorldTransform()
-    {
-        const rapid::matrix world = rapid::rotationY(rapid::radians(spinX/2.f));
-        auto& instance = instanceBuffer->getInstance(0);
-        world.store(instance.transform.matrix);
-        magma::helpers::mapScoped(normalMatrix,
-            [&world](rapid::matrix *normal)
-            {
-                *normal = rapid::transpose(rapid::inverse(world));
-            });
+    {   // Instances recede from the camera (offsets in model radii), so that each one uses different level of detail
+        constexpr rapid::float2 offsets[instanceCount] = {
+            {0.f, 0.f},
+            {-1.5f, -4.f},
+            {1.5f, -10.f},
+            {0.f, -24.f}
+        };
+        const float angle = rapid::radians(spinX/2.f);
+        const rapid::matrix rotation = rapid::rotationY(angle);
+        for (uint32_t i = 0; i < instanceCount; ++i)
+        {
+            const float x = offsets[i].x * modelRadius, z = offsets[i].y * modelRadius;
+            const rapid::matrix world = rotation * rapid::translation(x, 0.f, z);
+            auto& instance = instanceBuffers[frameInFlightIndex]->getInstance(i);
+            world.store(instance.transform.matrix);
+            selectLevelOfDetail(i, instance, angle, x, z);
+        }
+        // Instances differ by translation only, so they share normal matrix
+        *normalMatrices->getFrameData(frameInFlightIndex) = rapid::transpose(rapid::inverse(rotation));
+        normalMatrices->flush(frameInFlightIndex);
+    }
+
+    void selectLevelOfDetail(uint32_t i, magma::AccelerationStructureInstance& instance, float angle, float offsetX, float offsetZ)
+    {   // Bounding sphere of the model rotated around Y axis
+        const VkAabbPositionsKHR& bounds = model->getBounds();
+        const float cx = (bounds.minX + bounds.maxX) * 0.5f;
+        const float cy = (bounds.minY + bounds.maxY) * 0.5f;
+        const float cz = (bounds.minZ + bounds.maxZ) * 0.5f;
+        const float x = cx * std::cos(angle) + cz * std::sin(angle) + offsetX;
+        const float z = -cx * std::sin(angle) + cz * std::cos(angle) + offsetZ;
+        const float ex = -x, ey = zDist * 0.5f - cy, ez = zDist - z;
+        const float distance = std::sqrt(ex * ex + ey * ey + ez * ez);
+        const uint32_t level = lodSelector->select(modelRadius, distance, lods[i]);
+        if (level != lods[i])
+        {   // Switching BLAS is enough, top-level structure is refitted every frame anyway
+            lods[i] = level;
+            resetAccumulation();
+        }
+        instance.accelerationStructureReference = model->getAccelerationStructure(lods[i])->getReference();
+        // Hit shader selects index buffers of this level
+        instance.instanceCustomIndex = lods[i] * static_cast<uint32_t>(model->getMeshes().size());
     }
 
     void loadModel(const std::string& fileName, bool swapYZ)
     {
-        model = std::make_unique<ObjModel>(fileName, cmdCompute, false, swapYZ);
+        constexpr bool splitStreams = true; // Hit shader interpolates only attributes
+        model = std::make_unique<ObjModel>(fileName, cmdCompute, allocator, *buildBatcher, false, swapYZ,
+            accelerationStructureCache.get(), lodCount, splitStreams, lodCache.get());
+        buildBatcher->flush(cmdCompute);
+        lodSelector = std::make_unique<LodSelector>(model->getLodCount(), fov, height);
+        const VkAabbPositionsKHR& bounds = model->getBounds();
+        const float dx = (bounds.maxX - bounds.minX) * 0.5f;
+        const float dy = (bounds.maxY - bounds.minY) * 0.5f;
+        const float dz = (bounds.maxZ - bounds.minZ) * 0.5f;
+        modelRadius = std::sqrt(dx * dx + dy * dy + dz * dz);
     }
 
     void createReferenceBuffer()
     {
         std::vector<VkDeviceAddress> addresses;
-        for (auto const& mesh: model->getMeshes())
-        {   // Hit shader loads mesh data from these buffers
-            addresses.push_back(mesh.getVertexBuffer()->getDeviceAddress());
-            addresses.push_back(mesh.getIndexBuffer()->getDeviceAddress());
+        for (uint32_t level = 0; level < model->getLodCount(); ++level)
+        {
+            for (auto const& mesh: model->getMeshes())
+            {   // Hit shader loads mesh data from these buffers
+                addresses.push_back(mesh.getAttributeBuffer()->getDeviceAddress());
+                addresses.push_back(mesh.getIndexBuffer(level)->getDeviceAddress());
+            }
         }
-        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy);
+        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy, allocator);
     }
 
     void createInstanceBuffer()
     {
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 1);
-        instanceBuffer->getInstance(0).accelerationStructureReference = model->getAccelerationStructure()->getReference();
-        geometryInstance = magma::AccelerationStructureGeometryInstances(instanceBuffer);
+        for (uint32_t i = 0; i < framesInFlight; ++i)
+        {   // Each frame in flight has its own copy of instance data
+            instanceBuffers.emplace_back(std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, instanceCount, allocator));
+            for (uint32_t j = 0; j < instanceCount; ++j)
+                instanceBuffers.back()->getInstance(j).accelerationStructureReference = model->getAccelerationStructure()->getReference();
+            geometryInstances.emplace_back(instanceBuffers.back());
+        }
     }
 
     void buildTopLevelAccelerationStructure()
     {
-        topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device, geometryInstance,
+        topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device, geometryInstances.front(),
             VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+            allocator);
         scratchBuffer = allocateScratchBuffer(topLevel->getBuildScratchSize());
         cmdCompute->reset();
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
-            instanceBuffer->updateModified(cmdCompute);
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
+            instanceBuffers.front()->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            cmdCompute->buildAccelerationStructure(topLevel, geometryInstances.front(), scratchBuffer);
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Host writes instance data in render(), so initial copy must be complete
+        scheduler->wait(submitComputeCommands());
     }
 
     void createUniformBuffer()
     {
-        normalMatrix = std::make_shared<magma::UniformBuffer<rapid::matrix>>(device);
+        normalMatrices = std::make_unique<FrameUniformBuffer<rapid::matrix>>(device, framesInFlight, allocator);
     }
 
     void setupDescriptorSet()
@@ -143,7 +201,7 @@ public:
         setTable.topLevel = topLevel;
         setTable.bufferReferences = bufferReferences;
         setTable.diffuseMap = {model->getMaterials().front().diffuseMap, bilinearSampler}; // Take first material
-        setTable.normalMatrix = normalMatrix;
+        setTable.normalMatrix = normalMatrices->getBuffer();
         descriptorSet = std::make_shared<magma::DescriptorSet>(descriptorPool, setTable,
             VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
     }
@@ -159,29 +217,43 @@ public:
             {
                 descriptorSet->getLayout(),
                 swapchainDescriptorSets.front()->getLayout(),
+                accumulationDescriptorSet->getLayout(),
             }));
-        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout)));
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout), pipelineCache));
         const rapid::float3 lightPos(-50, 100, 50);
         const rapid::float3 backgroundColor(0.35f, 0.53f, 0.7f);
         shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1, lightPos);
         shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_MISS_BIT_KHR, 2, backgroundColor);
-        shaderBindingTable.build(pipeline, cmdBufferCopy);
+        shaderBindingTable.build(pipeline, cmdBufferCopy, allocator);
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
-            instanceBuffer->updateWhole(cmdBuffer);
+            // Previous frame may still accumulate samples
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
+            // Previous frame may still trace rays against top-level structure
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR));
+            instanceBuffers[frame]->updateWhole(cmdBuffer);
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdBuffer->updateAccelerationStructure(topLevel, geometryInstance, scratchBuffer);
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "updateTopLevel");
+                cmdBuffer->updateAccelerationStructure(topLevel, geometryInstances[frame], scratchBuffer);
+            }
             cmdBuffer->pipelineBarrier(
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
@@ -190,10 +262,15 @@ public:
             cmdBuffer->bindDescriptorSets(pipeline, 0,
                 {
                     descriptorSet,
-                    swapchainDescriptorSets[index]
-                });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+                    swapchainDescriptorSets[index],
+                    accumulationDescriptorSet
+                },
+                {normalMatrices->getDynamicOffset(frame), accumulationUniforms->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
@@ -1,66 +1,137 @@
+#include <algorithm>
 #include "../framework/vulkanRtApp.h"
 #include "../framework/rayTracingPipeline.h"
 #include "../framework/objModel.h"
+#include "../framework/frustumCuller.h"
+#include "../framework/shaderRecordTable.h"
 
 class ShaderBindingTableApp : public VulkanRayTracingApp
 {
+    static constexpr uint32_t instanceCount = 4;
+    static constexpr float sceneRadius = 50.f;
+
+    enum class Brdf : uint32_t
+    {
+        Normal, Lambert, Diffuse, Phong
+    };
+
+    struct MaterialRecord
+    {   // Inline data of hit group record
+        float shininess;
+        float ambient;
+    };
+
+    struct Material
+    {
+        Brdf brdf; // Specialization constant of hit shader
+        MaterialRecord record;
+    };
+
+    Material materials[instanceCount] = {
+        {Brdf::Normal, {0.f, 0.f}},
+        {Brdf::Lambert, {0.f, 0.f}},
+        {Brdf::Diffuse, {0.f, 0.f}},
+        {Brdf::Phong, {4.f, 0.1f}}
+    };
+
+    struct Transforms
+    {
+        rapid::matrix normalMatrices[instanceCount];
+    };
+
     struct DescriptorSetTable: magma::DescriptorSetTable
     {
         magma::descriptor::UniformBuffer view = 0;
         magma::descriptor::AccelerationStructure topLevel = 1;
         magma::descriptor::StorageBuffer bufferReferences = 2;
-        magma::descriptor::StorageBuffer normalMatrices = 3;
+        magma::descriptor::DynamicUniformBuffer transforms = 3;
         magma::descriptor::UniformBuffer lightSource = 4;
         magma::descriptor::CombinedImageImmutableSampler diffuseMap = 5;
-        MAGMA_REFLECT(view, topLevel, bufferReferences, normalMatrices, lightSource, diffuseMap)
-    } setTable;
+        MAGMA_REFLECT(view, topLevel, bufferReferences, transforms, lightSource, diffuseMap)
+    } setTables[maxFramesInFlight];
 
     std::unique_ptr<ObjModel> model;
-    std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>> instanceBuffer;
-    magma::AccelerationStructureGeometryInstances geometryInstances;
-    std::shared_ptr<magma::TopLevelAccelerationStructure> topLevel;
+    std::vector<std::unique_ptr<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>> instanceBuffers;
+    std::vector<magma::AccelerationStructureGeometryInstances> geometryInstances;
+    std::vector<InstanceTracker> instanceTrackers;
+    std::vector<uint32_t> visibleInstances[maxFramesInFlight];
+    std::unique_ptr<FrustumCuller> frustumCuller;
+    std::vector<FrustumCuller::Sphere> boundingSpheres;
+    FrustumCuller::Sphere modelSphere;
+    std::vector<std::shared_ptr<magma::TopLevelAccelerationStructure>> topLevels;
+    std::vector<std::shared_ptr<magma::Buffer>> scratchBuffers;
+    std::vector<std::shared_ptr<magma::CommandBuffer>> buildCommandBuffers;
     std::shared_ptr<magma::StorageBuffer> bufferReferences;
-    std::shared_ptr<magma::DynamicStorageBuffer> normalMatrices;
+    std::unique_ptr<FrameUniformBuffer<Transforms>> transforms;
     std::shared_ptr<magma::UniformBuffer<rapid::float4a>> lightPos;
     std::shared_ptr<magma::Sampler> bilinearSampler;
-    std::shared_ptr<magma::DescriptorSet> descriptorSet;
+    std::vector<std::shared_ptr<magma::DescriptorSet>> descriptorSets;
     std::shared_ptr<magma::RayTracingPipeline> pipeline;
-    magma::ShaderBindingTable shaderBindingTable;
+    std::unique_ptr<ShaderRecordTable> shaderRecordTable;
+    TimelineScheduler::SyncPoint tableUpdateSyncPoint;
 
 public:
     ShaderBindingTableApp(const AppEntry& entry):
-        VulkanRayTracingApp(entry, TEXT("Shader binding table"), 512, 512)
-    {
+        VulkanRayTracingApp(entry, TEXT("Shader binding table"), 512, 512, true) // Accumulates samples
+    {   // Instances slightly outside of view are kept for secondary rays
+        const CommandLine cmdLine(entry);
+        frustumCuller = std::make_unique<FrustumCuller>(cmdLine.getFloat("--guard-band", sceneRadius * 0.2f));
         setupView();
         loadModel("ball/10487_basketball_v1_3dmax2011_it2.obj", true);
         createReferenceBuffer();
         createInstanceBuffer();
-        buildTopLevelAccelerationStructure();
+        buildTopLevelAccelerationStructures();
+        createBuildCommandBuffers();
         createTransformBuffer();
         createUniformBuffer();
         setupDescriptorSet();
         setupPipeline();
-        recordCommandBuffer(Buffer::Front);
-        recordCommandBuffer(Buffer::Back);
+        recordCommandBuffers();
         timer->run();
     }
 
+    void onKeyDown(char key, int repeat, uint32_t flags) override
+    {
+        switch (key)
+        {
+        case '+': case '=':
+            changeShininess(2.f);
+            break;
+        case '-':
+            changeShininess(0.5f);
+            break;
+        default:
+            VulkanRayTracingApp::onKeyDown(key, repeat, flags);
+        }
+    }
+
     void render(uint32_t bufferIndex) override
     {
-        updateWorldTransforms();
+        const bool visibilityChanged = updateWorldTransforms();
+        InstanceTracker& instanceTracker = instanceTrackers[frameInFlightIndex];
+        if (visibilityChanged || instanceTracker.modified())
+        {   // Top-level structure of this frame is updated on compute queue
+            // while graphics queue still traces rays of the previous frame.
+            // Refit requires the same instances as the last build.
+            const bool rebuild = visibilityChanged || instanceTracker.rebuildRequired();
+            recordBuildCommandBuffer(frameInFlightIndex, rebuild);
+            instanceTracker.commit(rebuild);
+            submitComputeCommands(buildCommandBuffers[frameInFlightIndex]);
+        }
         submitCommandBuffer(bufferIndex);
     }
 
     void setupView()
     {
-        const rapid::vector3 eye(0.f, 0.f, 150.f);
-        const rapid::vector3 center(0.f, 0.f, 0.f);
-        const rapid::vector3 up(0.f, 1.f, 0.f);
+        constexpr rapid::float3 eye(0.f, 0.f, 150.f);
+        constexpr rapid::float3 center(0.f, 0.f, 0.f);
+        constexpr rapid::float3 up(0.f, 1.f, 0.f);
         constexpr float fov = rapid::radians(45.f);
         const float aspect = width/(float)height;
         constexpr float zn = 0.1f, zf = 1.f;
-        const rapid::matrix view = rapid::lookAtRH(eye, center, up);
+        const rapid::matrix view = rapid::lookAtRH(rapid::vector3(eye), rapid::vector3(center), rapid::vector3(up));
         const rapid::matrix proj = rapid::perspectiveFovRH(fov, aspect, zn, zf);
+        frustumCuller->setPerspective(eye, center, up, fov, aspect, zn);
         magma::helpers::mapScoped(viewUniforms,
             [&view, &proj](View *data)
             {
@@ -70,33 +141,72 @@ public:
             });
     }
 
-    void updateWorldTransforms()
+    bool updateWorldTransforms()
     {
         const rapid::matrix pitch = rapid::rotationX(rapid::radians(spinY/2.f));
         const rapid::matrix yaw = rapid::rotationY(rapid::radians(spinX/2.f));
         const rapid::matrix rotation = pitch * yaw;
-        magma::helpers::mapScoped<rapid::matrix>(normalMatrices,
-            [&rotation, this](rapid::matrix *normalMatrices)
+        const auto& instanceBuffer = instanceBuffers[frameInFlightIndex];
+        InstanceTracker& instanceTracker = instanceTrackers[frameInFlightIndex];
+        Transforms *frameTransforms = transforms->getFrameData(frameInFlightIndex);
+        VkTransformMatrixKHR worldTransforms[instanceCount];
+        constexpr rapid::float2 offsets[instanceCount] = {
+            {-30.f, 30.f},
+            {30.f, 30.f},
+            {-30.f, -30.f},
+            {30.f, -30.f}
+        };
+        for (uint32_t i = 0; i < instanceCount; ++i)
         {
-            constexpr rapid::float2 offsets[4] = {
-                {-30.f, 30.f},
-                {30.f, 30.f},
-                {-30.f, -30.f},
-                {30.f, -30.f}
-            };
-            for (uint32_t i = 0; i < instanceBuffer->getInstanceCount(); ++i)
-            {
-                const rapid::matrix translation = rapid::translation(offsets[i].x, offsets[i].y, 0.f);
-                const rapid::matrix world = rotation * translation;
-                world.store(instanceBuffer->getInstance(i).transform.matrix);
-                normalMatrices[i] = rapid::transpose(rapid::inverse(world));
+            const rapid::matrix translation = rapid::translation(offsets[i].x, offsets[i].y, 0.f);
+            const rapid::matrix world = rotation * translation;
+            world.store(worldTransforms[i].matrix);
+            // Transforms are rigid, so only center of bounding sphere moves
+            const float (*m)[4] = worldTransforms[i].matrix;
+            FrustumCuller::Sphere& sphere = boundingSpheres[i];
+            sphere.x = m[0][0] * modelSphere.x + m[0][1] * modelSphere.y + m[0][2] * modelSphere.z + m[0][3];
+            sphere.y = m[1][0] * modelSphere.x + m[1][1] * modelSphere.y + m[1][2] * modelSphere.z + m[1][3];
+            sphere.z = m[2][0] * modelSphere.x + m[2][1] * modelSphere.y + m[2][2] * modelSphere.z + m[2][3];
+            sphere.radius = modelSphere.radius;
+            frameTransforms->normalMatrices[i] = rapid::transpose(rapid::inverse(world));
+        }
+        transforms->flush(frameInFlightIndex);
+        // Instance buffer is compacted to visible instances
+        std::vector<uint32_t> visible;
+        frustumCuller->cull(boundingSpheres, visible);
+        const bool visibilityChanged = (visible != visibleInstances[frameInFlightIndex]);
+        visibleInstances[frameInFlightIndex].swap(visible);
+        const std::vector<uint32_t>& visibleIndices = visibleInstances[frameInFlightIndex];
+        for (uint32_t slot = 0; slot < static_cast<uint32_t>(visibleIndices.size()); ++slot)
+        {
+            const uint32_t i = visibleIndices[slot];
+            if (visibilityChanged)
+            {   // Custom index and SBT offset keep instance-to-material mapping
+                magma::AccelerationStructureInstance& instance = instanceBuffer->getInstance(slot);
+                instance.instanceCustomIndex = i;
+                instance.instanceShaderBindingTableRecordOffset = i;
+            }
+            if (instanceTracker.setTransform(slot, worldTransforms[i]))
+            {   // Only modified instances are uploaded
+                instanceBuffer->getInstance(slot).transform = worldTransforms[i];
             }
-        });
+        }
+        geometryInstances[frameInFlightIndex].primitiveCount = static_cast<uint32_t>(visibleIndices.size());
+        return visibilityChanged;
     }
 
     void loadModel(const std::string& fileName, bool swapYZ)
     {
-        model = std::make_unique<ObjModel>(fileName, cmdCompute, false, swapYZ);
+        model = std::make_unique<ObjModel>(fileName, cmdCompute, allocator, *buildBatcher, false, swapYZ,
+            accelerationStructureCache.get());
+        buildBatcher->flush(cmdCompute);
+        const VkAabbPositionsKHR& bounds = model->getBounds();
+        modelSphere.x = (bounds.minX + bounds.maxX) * 0.5f;
+        modelSphere.y = (bounds.minY + bounds.maxY) * 0.5f;
+        modelSphere.z = (bounds.minZ + bounds.maxZ) * 0.5f;
+        const float dx = bounds.maxX - modelSphere.x, dy = bounds.maxY - modelSphere.y, dz = bounds.maxZ - modelSphere.z;
+        modelSphere.radius = std::sqrt(dx * dx + dy * dy + dz * dz);
+        boundingSpheres.resize(instanceCount);
     }
 
     void createReferenceBuffer()
@@ -107,50 +217,103 @@ public:
             addresses.push_back(mesh.getVertexBuffer()->getDeviceAddress());
             addresses.push_back(mesh.getIndexBuffer()->getDeviceAddress());
         }
-        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy);
+        bufferReferences = magma::helpers::makeStorageBuffer(addresses, cmdBufferCopy, allocator);
     }
 
     void createInstanceBuffer()
     {
-        instanceBuffer = std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, 4);
-        for (uint32_t i = 0; i < instanceBuffer->getInstanceCount(); ++i)
-        {
-            magma::AccelerationStructureInstance& instance = instanceBuffer->getInstance(i);
-            instance.instanceShaderBindingTableRecordOffset = i; // Assign hit shader
-            instance.accelerationStructureReference = model->getAccelerationStructure()->getReference();
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+        {   // Each frame in flight has its own copy of instance data
+            instanceBuffers.emplace_back(std::make_unique<magma::AccelerationStructureInstanceBuffer<magma::AccelerationStructureInstance>>(device, instanceCount, allocator));
+            const auto& instanceBuffer = instanceBuffers.back();
+            for (uint32_t i = 0; i < instanceBuffer->getInstanceCount(); ++i)
+            {
+                magma::AccelerationStructureInstance& instance = instanceBuffer->getInstance(i);
+                instance.instanceCustomIndex = i; // Selects normal matrix
+                instance.instanceShaderBindingTableRecordOffset = i; // Assign hit shader
+                instance.accelerationStructureReference = model->getAccelerationStructure()->getReference();
+                visibleInstances[frame].push_back(i);
+            }
+            geometryInstances.emplace_back(instanceBuffer);
+            // Initial build has zero transforms, so the first update rebuilds
+            instanceTrackers.emplace_back(instanceCount, sceneRadius);
         }
-        geometryInstances = magma::AccelerationStructureGeometryInstances(instanceBuffer);
     }
 
-    void buildTopLevelAccelerationStructure()
-    {
-        topLevel = std::make_shared<magma::TopLevelAccelerationStructure>(device, geometryInstances,
-            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR);
-        scratchBuffer = allocateScratchBuffer(topLevel->getBuildScratchSize());
+    void buildTopLevelAccelerationStructures()
+    {   // Each frame in flight traces rays against its own top-level structure,
+        // so that it can be refitted while other frame is still in flight.
+        // Structure is built on compute queue and traced on graphics queue.
+        const magma::Sharing sharing = getComputeGraphicsSharing();
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+        {
+            topLevels.push_back(std::make_shared<magma::TopLevelAccelerationStructure>(device, geometryInstances[frame],
+                VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+                allocator, sharing));
+            scratchBuffers.push_back(allocateScratchBuffer(topLevels.back()->getBuildScratchSize()));
+        }
         cmdCompute->reset();
         cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
         {
-            instanceBuffer->updateModified(cmdCompute);
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildAccelerationStructures", GpuProfiler::Compute);
+            for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+                instanceBuffers[frame]->updateModified(cmdCompute);
             cmdCompute->pipelineBarrier(
                 VK_PIPELINE_STAGE_TRANSFER_BIT,
                 VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdCompute->buildAccelerationStructure(topLevel, geometryInstances, scratchBuffer);
+            for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+                cmdCompute->buildAccelerationStructure(topLevels[frame], geometryInstances[frame], scratchBuffers[frame]);
         }
         cmdCompute->end();
-        magma::finish(cmdCompute, computeQueue);
+        // Host writes instance data in render(), so initial copy must be complete
+        scheduler->wait(submitComputeCommands());
+    }
+
+    void createBuildCommandBuffers()
+    {
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+            buildCommandBuffers.push_back(std::make_shared<magma::PrimaryCommandBuffer>(commandPools[1]));
+    }
+
+    void recordBuildCommandBuffer(uint32_t frame, bool rebuild)
+    {   // Recorded every time, as modified instances differ from frame to frame
+        auto& cmdBuffer = buildCommandBuffers[frame];
+        cmdBuffer->reset();
+        cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        {   // Wait for previous build before instance data is overwritten
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                magma::barrier::memory::accelerationStructureWriteRead);
+            instanceBuffers[frame]->updateModified(cmdBuffer);
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                magma::barrier::memory::transferWriteAccelerationStructureRead);
+            if (rebuild)
+            {   // Instances moved too far for refit to keep tree quality
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "rebuildTopLevel", GpuProfiler::Compute);
+                cmdBuffer->buildAccelerationStructure(topLevels[frame], geometryInstances[frame], scratchBuffers[frame]);
+            }
+            else
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "updateTopLevel", GpuProfiler::Compute);
+                cmdBuffer->updateAccelerationStructure(topLevels[frame], geometryInstances[frame], scratchBuffers[frame]);
+            }
+        }
+        cmdBuffer->end();
     }
 
     void createTransformBuffer()
     {
-        normalMatrices = std::make_shared<magma::DynamicStorageBuffer>(device,
-            sizeof(rapid::matrix) * instanceBuffer->getInstanceCount(), true);
+        transforms = std::make_unique<FrameUniformBuffer<Transforms>>(device, framesInFlight, allocator);
     }
 
     void createUniformBuffer()
     {
-        lightPos = std::make_shared<magma::UniformBuffer<rapid::float4a>>(device);
+        lightPos = std::make_shared<magma::UniformBuffer<rapid::float4a>>(device, 1, allocator);
         magma::helpers::mapScoped(lightPos,
             [](rapid::float4a *lightPos)
             {
@@ -163,14 +326,18 @@ public:
     void setupDescriptorSet()
     {
         bilinearSampler = std::make_shared<magma::Sampler>(device, magma::sampler::magMinLinearMipNearestClampToEdge);
-        setTable.view = viewUniforms;
-        setTable.topLevel = topLevel;
-        setTable.bufferReferences = bufferReferences;
-        setTable.normalMatrices = normalMatrices;
-        setTable.lightSource = lightPos;
-        setTable.diffuseMap = {model->getMaterials().front().diffuseMap, bilinearSampler};
-        descriptorSet = std::make_shared<magma::DescriptorSet>(descriptorPool, setTable,
-            VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+        {   // Frame binds top-level structure that has been refitted for it
+            DescriptorSetTable& setTable = setTables[frame];
+            setTable.view = viewUniforms;
+            setTable.topLevel = topLevels[frame];
+            setTable.bufferReferences = bufferReferences;
+            setTable.transforms = transforms->getBuffer();
+            setTable.lightSource = lightPos;
+            setTable.diffuseMap = {model->getMaterials().front().diffuseMap, bilinearSampler};
+            descriptorSets.push_back(std::make_shared<magma::DescriptorSet>(descriptorPool, setTable,
+                VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR));
+        }
     }
 
     void setupPipeline()
@@ -185,41 +352,80 @@ public:
         };
         auto layout = std::shared_ptr<magma::PipelineLayout>(new magma::PipelineLayout(
             {
-                descriptorSet->getLayout(),
+                descriptorSets.front()->getLayout(),
                 swapchainDescriptorSets.front()->getLayout(),
+                accumulationDescriptorSet->getLayout(),
             }));
+        // Hit group of each material is the same module specialized with its constants
+        std::shared_ptr<magma::ShaderModule> material = RayTracingPipeline::loadShaderModule(*shaderReflectionFactory, "material");
+        std::vector<magma::PipelineShaderStage> shaderStages;
+        for (const Material& constants: materials)
+        {
+            auto specialization = std::make_shared<magma::Specialization>(constants,
+                magma::SpecializationEntry(0, &Material::brdf));
+            shaderStages.emplace_back(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, material, "main", std::move(specialization));
+        }
+        shaderStages.push_back(RayTracingPipeline::loadShader(*shaderReflectionFactory, "trace"));
+        shaderStages.push_back(RayTracingPipeline::loadShader(*shaderReflectionFactory, "miss"));
         pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device,
-            {"normal", "lambert", "diffuse", "phong", "trace", "miss"}, shaderGroups, 1, std::move(layout)));
+            shaderStages, shaderGroups, 1, std::move(layout), pipelineCache));
         constexpr rapid::float3 backgroundColor(0.5f, 0.5f, 0.5f);
-        shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_MISS_BIT_KHR, 5, backgroundColor);
-        shaderBindingTable.build(pipeline, cmdBufferCopy);
+        // Record index of each hit group is SBT offset of its instance
+        shaderRecordTable = std::make_unique<ShaderRecordTable>(device, allocator);
+        for (uint32_t i = 0; i < instanceCount; ++i)
+            shaderRecordTable->addRecord(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, i, materials[i].record);
+        shaderRecordTable->addRecord(VK_SHADER_STAGE_RAYGEN_BIT_KHR, 4);
+        shaderRecordTable->addRecord(VK_SHADER_STAGE_MISS_BIT_KHR, 5, backgroundColor);
+        shaderRecordTable->build(pipeline, cmdBufferCopy);
+    }
+
+    void changeShininess(float factor)
+    {   // Only records of modified materials are uploaded
+        for (uint32_t i = 0; i < instanceCount; ++i)
+        {
+            if (Brdf::Phong == materials[i].brdf)
+            {
+                MaterialRecord& record = materials[i].record;
+                record.shininess = std::min(std::max(record.shininess * factor, 1.f), 256.f);
+                shaderRecordTable->updateRecord(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, i, record);
+            }
+        }
+        // Update is ordered with frames in flight by barriers on graphics queue,
+        // so CPU only waits until command buffer of previous update is free
+        scheduler->wait(tableUpdateSyncPoint);
+        cmdImageCopy->reset();
+        cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        shaderRecordTable->update(cmdImageCopy);
+        cmdImageCopy->end();
+        tableUpdateSyncPoint = scheduler->submit(TimelineScheduler::Graphics, cmdImageCopy);
+        resetAccumulation();
     }
 
-    void recordCommandBuffer(uint32_t index)
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
     {
-        auto& cmdBuffer = commandBuffers[index];
+        auto& cmdBuffer = getCommandBuffer(frame, index);
         auto& backBuffer = swapchainImageViews[index]->getImage();
         cmdBuffer->begin();
         {
             backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
-            instanceBuffer->updateWhole(cmdBuffer);
+            // Previous frame may still accumulate samples
             cmdBuffer->pipelineBarrier(
-                VK_PIPELINE_STAGE_TRANSFER_BIT,
-                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                magma::barrier::memory::transferWriteAccelerationStructureRead);
-            cmdBuffer->updateAccelerationStructure(topLevel, geometryInstances, scratchBuffer);
-            cmdBuffer->pipelineBarrier(
-                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
                 VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
-                magma::barrier::memory::accelerationStructureWriteShaderRead);
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT));
             cmdBuffer->bindPipeline(pipeline);
             cmdBuffer->bindDescriptorSets(pipeline, 0,
                 {
-                    descriptorSet,
-                    swapchainDescriptorSets[index]
-                });
-            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
-            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdBuffer);
+                    descriptorSets[frame],
+                    swapchainDescriptorSets[index],
+                    accumulationDescriptorSet
+                },
+                {transforms->getDynamicOffset(frame), accumulationUniforms->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, *shaderRecordTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
         }
         cmdBuffer->end();
     }
@@ -17,8 +17,8 @@ layout(set = 0, binding = 0) uniform View {
 layout(set = 0, binding = 2) buffer readonly References {
     Mesh meshes[];
 };
-layout(set = 0, binding = 3) buffer readonly Transforms {
-    mat4 normalMatrices[];
+layout(set = 0, binding = 3) uniform Transforms {
+    mat4 normalMatrices[4];
 };
 layout(set = 0, binding = 4) uniform LightSource {
     vec3 lightPos;
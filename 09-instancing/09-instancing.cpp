@@ -0,0 +1,324 @@
+#include <cmath>
+#include <random>
+#include "../framework/vulkanRtApp.h"
+#include "../framework/rayTracingPipeline.h"
+#include "../framework/computePipeline.h"
+
+class InstancingApp : public VulkanRayTracingApp
+{
+    static constexpr uint32_t groupSize = 128; // Should match local size of compute shader
+    static constexpr float sceneRadius = 200.f;
+
+    struct InstanceParameters
+    {
+        rapid::float4 position; // w: uniform scale
+        rapid::float4 rotation; // xyz: axis, w: angular speed
+    };
+
+    struct Animation
+    {
+        VkDeviceAddress bottomLevelReference;
+        float time;
+        uint32_t instanceCount;
+    };
+
+    struct DescriptorSetTable: magma::DescriptorSetTable
+    {
+        magma::descriptor::UniformBuffer view = 0;
+        magma::descriptor::AccelerationStructure topLevel = 1;
+        magma::descriptor::StorageBuffer vertices = 2;
+        magma::descriptor::StorageBuffer normalMatrices = 3;
+        MAGMA_REFLECT(view, topLevel, vertices, normalMatrices)
+    } setTables[maxFramesInFlight];
+
+    struct GenerateSetTable: magma::DescriptorSetTable
+    {
+        magma::descriptor::StorageBuffer parameters = 0;
+        magma::descriptor::StorageBuffer instances = 1;
+        magma::descriptor::StorageBuffer normalMatrices = 2;
+        magma::descriptor::DynamicUniformBuffer animation = 3;
+        MAGMA_REFLECT(parameters, instances, normalMatrices, animation)
+    } generateSetTables[maxFramesInFlight];
+
+    uint32_t instanceCount;
+    float time;
+    magma::AccelerationStructureGeometryTriangles geometry;
+    std::vector<magma::AccelerationStructureGeometryInstances> geometryInstances;
+    std::shared_ptr<magma::AccelerationStructureInputBuffer> vertexBuffer;
+    std::shared_ptr<magma::StorageBuffer> parameterBuffer;
+    std::vector<std::shared_ptr<magma::AccelerationStructureInputBuffer>> instanceBuffers;
+    std::vector<std::shared_ptr<magma::StorageBuffer>> normalMatrices;
+    std::shared_ptr<magma::BottomLevelAccelerationStructure> bottomLevel;
+    std::vector<std::shared_ptr<magma::TopLevelAccelerationStructure>> topLevels;
+    std::vector<std::shared_ptr<magma::Buffer>> scratchBuffers;
+    std::unique_ptr<FrameUniformBuffer<Animation>> animation;
+    std::vector<std::shared_ptr<magma::DescriptorSet>> descriptorSets;
+    std::vector<std::shared_ptr<magma::DescriptorSet>> generateDescriptorSets;
+    std::shared_ptr<magma::RayTracingPipeline> pipeline;
+    std::shared_ptr<magma::ComputePipeline> generatePipeline;
+    magma::ShaderBindingTable shaderBindingTable;
+
+public:
+    InstancingApp(const AppEntry& entry):
+        VulkanRayTracingApp(entry, TEXT("Instancing"), 512, 512),
+        time(0.f)
+    {
+        const CommandLine cmdLine(entry);
+        // Instances are generated by single dispatch of one-dimensional groups
+        const uint32_t maxGroupCount = physicalDevice->getProperties().limits.maxComputeWorkGroupCount[0];
+        const uint32_t maxInstanceCount = static_cast<uint32_t>(std::min(uint64_t(maxGroupCount) * groupSize, uint64_t(UINT32_MAX)));
+        instanceCount = std::max(1U, std::min(cmdLine.getUint("--instances", 1000000), maxInstanceCount));
+        setupView();
+        createCube();
+        createInstanceParameters();
+        createInstanceBuffers();
+        createAccelerationStructures();
+        buildBottomLevel();
+        createUniformBuffer();
+        setupDescriptorSets();
+        setupPipelines();
+        recordCommandBuffers();
+        timer->run();
+    }
+
+    void render(uint32_t bufferIndex) override
+    {
+        updateAnimation();
+        submitCommandBuffer(bufferIndex);
+    }
+
+    void setupView()
+    {
+        const rapid::vector3 eye(0.f, 0.f, sceneRadius * 1.5f);
+        const rapid::vector3 center(0.f, 0.f, 0.f);
+        const rapid::vector3 up(0.f, 1.f, 0.f);
+        constexpr float fov = rapid::radians(60.f);
+        const float aspect = width/(float)height;
+        constexpr float zn = 0.1f, zf = 1.f;
+        const rapid::matrix view = rapid::lookAtRH(eye, center, up);
+        const rapid::matrix proj = rapid::perspectiveFovRH(fov, aspect, zn, zf);
+        magma::helpers::mapScoped(viewUniforms,
+            [&view, &proj](View *data)
+            {
+                data->viewInv = rapid::inverse(view);
+                data->projInv = rapid::inverse(rapid::negateY(proj));
+                data->viewProjInv = data->projInv * rapid::matrix3(data->viewInv);
+            });
+    }
+
+    void updateAnimation()
+    {
+        time += timer->millisecondsElapsed() * 0.001f;
+        Animation *data = animation->getFrameData(frameInFlightIndex);
+        data->bottomLevelReference = bottomLevel->getReference();
+        data->time = time;
+        data->instanceCount = instanceCount;
+        animation->flush(frameInFlightIndex);
+    }
+
+    void createCube()
+    {
+        constexpr rapid::float4 corners[8] = {
+            {-1.f, -1.f, -1.f, 1.f}, {1.f, -1.f, -1.f, 1.f},
+            {-1.f, 1.f, -1.f, 1.f}, {1.f, 1.f, -1.f, 1.f},
+            {-1.f, -1.f, 1.f, 1.f}, {1.f, -1.f, 1.f, 1.f},
+            {-1.f, 1.f, 1.f, 1.f}, {1.f, 1.f, 1.f, 1.f}
+        };
+        constexpr uint8_t indices[36] = {
+            0, 2, 1, 1, 2, 3, // -Z
+            4, 5, 6, 5, 7, 6, // +Z
+            0, 4, 2, 2, 4, 6, // -X
+            1, 3, 5, 3, 7, 5, // +X
+            0, 1, 4, 1, 5, 4, // -Y
+            2, 6, 3, 3, 6, 7  // +Y
+        };
+        // Hit shader computes face normal from non-indexed vertices
+        std::vector<rapid::float4> vertices;
+        for (uint8_t index: indices)
+            vertices.push_back(corners[index]);
+        vertexBuffer = magma::helpers::makeInputBuffer(vertices, cmdBufferCopy, allocator);
+        geometry = magma::AccelerationStructureGeometryTriangles(VK_FORMAT_R32G32B32A32_SFLOAT, vertexBuffer);
+    }
+
+    void createInstanceParameters()
+    {   // Only 32 bytes per instance are uploaded, records are generated on device
+        std::mt19937 rng(1234); // Fixed seed gives the same scene on every run
+        std::uniform_real_distribution<float> unorm(0.f, 1.f);
+        std::uniform_real_distribution<float> snorm(-1.f, 1.f);
+        std::vector<InstanceParameters> parameters(instanceCount);
+        // Keep average spacing between cubes regardless of instance count
+        const float scale = sceneRadius / std::cbrt(static_cast<float>(instanceCount)) * 0.3f;
+        for (InstanceParameters& instance: parameters)
+        {
+            float x, y, z, length;
+            do
+            {   // Uniform distribution inside of sphere
+                x = snorm(rng), y = snorm(rng), z = snorm(rng);
+                length = x * x + y * y + z * z;
+            } while (length > 1.f);
+            instance.position = rapid::float4(x * sceneRadius, y * sceneRadius, z * sceneRadius,
+                scale * (0.5f + unorm(rng)));
+            do
+            {   // Random rotation axis
+                x = snorm(rng), y = snorm(rng), z = snorm(rng);
+                length = std::sqrt(x * x + y * y + z * z);
+            } while (length < 0.001f);
+            instance.rotation = rapid::float4(x / length, y / length, z / length,
+                rapid::radians(30.f + 90.f * unorm(rng)));
+        }
+        parameterBuffer = magma::helpers::makeStorageBuffer(parameters, cmdBufferCopy, allocator);
+    }
+
+    void createInstanceBuffers()
+    {   // Written by compute shader and read by top-level build. Each frame in flight
+        // has its own copy, so that it is regenerated while other frame traces rays
+        constexpr VkDeviceSize normalMatrixSize = sizeof(rapid::float4) * 3; // std430 mat3
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+        {
+            instanceBuffers.push_back(std::make_shared<magma::AccelerationStructureInputBuffer>(device,
+                instanceCount * sizeof(VkAccelerationStructureInstanceKHR), allocator));
+            normalMatrices.push_back(std::make_shared<magma::StorageBuffer>(device, instanceCount * normalMatrixSize, allocator));
+            magma::AccelerationStructureGeometryInstances instances;
+            instances.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+            instances.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+            instances.geometry.instances.pNext = nullptr;
+            instances.geometry.instances.arrayOfPointers = VK_FALSE;
+            instances.geometry.instances.data.deviceAddress = instanceBuffers.back()->getDeviceAddress();
+            instances.primitiveCount = instanceCount;
+            geometryInstances.push_back(instances);
+        }
+    }
+
+    void createAccelerationStructures()
+    {
+        bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(device,
+            std::list<magma::AccelerationStructureGeometry>{geometry},
+            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+            allocator);
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+        {   // All instances move every frame, so refit would degrade quickly; rebuild instead
+            topLevels.push_back(std::make_shared<magma::TopLevelAccelerationStructure>(device,
+                geometryInstances[frame],
+                VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR,
+                allocator));
+            // Top-level structure is rebuilt every frame, so it owns scratch buffer
+            scratchBuffers.push_back(allocateScratchBuffer(topLevels.back()->getBuildScratchSize()));
+        }
+    }
+
+    void buildBottomLevel()
+    {
+        cmdCompute->reset();
+        cmdCompute->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        {
+            GpuProfiler::Scope scope(*profiler, cmdCompute, 0, "buildBottomLevel", GpuProfiler::Compute);
+            scratchAllocator->buildAccelerationStructure(cmdCompute, bottomLevel, {geometry});
+        }
+        cmdCompute->end();
+        submitComputeCommands();
+    }
+
+    void createUniformBuffer()
+    {
+        animation = std::make_unique<FrameUniformBuffer<Animation>>(device, framesInFlight, allocator);
+    }
+
+    void setupDescriptorSets()
+    {
+        for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+        {   // Frame traces rays against resources it has generated
+            DescriptorSetTable& setTable = setTables[frame];
+            setTable.view = viewUniforms;
+            setTable.topLevel = topLevels[frame];
+            setTable.vertices = vertexBuffer;
+            setTable.normalMatrices = normalMatrices[frame];
+            descriptorSets.push_back(std::make_shared<magma::DescriptorSet>(descriptorPool, setTable,
+                VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR));
+            GenerateSetTable& generateSetTable = generateSetTables[frame];
+            generateSetTable.parameters = parameterBuffer;
+            generateSetTable.instances = instanceBuffers[frame];
+            generateSetTable.normalMatrices = normalMatrices[frame];
+            generateSetTable.animation = animation->getBuffer();
+            generateDescriptorSets.push_back(std::make_shared<magma::DescriptorSet>(descriptorPool, generateSetTable,
+                VK_SHADER_STAGE_COMPUTE_BIT));
+        }
+    }
+
+    void setupPipelines()
+    {
+        const std::vector<magma::RayTracingShaderGroup> shaderGroups{
+            magma::GeneralRayTracingShaderGroup(0),
+            magma::TrianglesHitRayTracingShaderGroup(1),
+            magma::GeneralRayTracingShaderGroup(2)
+        };
+        auto layout = std::shared_ptr<magma::PipelineLayout>(new magma::PipelineLayout(
+            {
+                descriptorSets.front()->getLayout(),
+                swapchainDescriptorSets.front()->getLayout(),
+            }));
+        pipeline = std::shared_ptr<magma::RayTracingPipeline>(new RayTracingPipeline(device, *shaderReflectionFactory,
+            {"trace", "hit", "miss"}, shaderGroups, 1, std::move(layout), pipelineCache));
+        // Light pos
+        shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, 1, rapid::float3(-300, 400, 300));
+        // Background color
+        shaderBindingTable.addShaderRecord(VK_SHADER_STAGE_MISS_BIT_KHR, 2, rapid::float3(0.35f, 0.53f, 0.7f));
+        shaderBindingTable.build(pipeline, cmdBufferCopy, allocator);
+        auto generateLayout = std::shared_ptr<magma::PipelineLayout>(new magma::PipelineLayout(
+            {
+                generateDescriptorSets.front()->getLayout()
+            }));
+        generatePipeline = std::shared_ptr<magma::ComputePipeline>(new ComputePipeline(device, *shaderReflectionFactory,
+            "instances", std::move(generateLayout), pipelineCache));
+    }
+
+    void recordCommandBuffer(uint32_t frame, uint32_t index) override
+    {
+        auto& cmdBuffer = getCommandBuffer(frame, index);
+        auto& backBuffer = swapchainImageViews[index]->getImage();
+        cmdBuffer->begin();
+        {
+            backBuffer->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdBuffer);
+            // Resources of this frame slot aren't used by other frame in flight,
+            // and its previous submission is complete before slot is reused
+            cmdBuffer->bindPipeline(generatePipeline);
+            cmdBuffer->bindDescriptorSets(generatePipeline, 0,
+                {generateDescriptorSets[frame]},
+                {animation->getDynamicOffset(frame)});
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "generateInstances");
+                cmdBuffer->dispatch((instanceCount + groupSize - 1) / groupSize, 1, 1);
+            }
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                magma::MemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_SHADER_READ_BIT));
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "buildTopLevel");
+                cmdBuffer->buildAccelerationStructure(topLevels[frame], geometryInstances[frame], scratchBuffers[frame]);
+            }
+            cmdBuffer->pipelineBarrier(
+                VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                magma::barrier::memory::accelerationStructureWriteShaderRead);
+            cmdBuffer->bindPipeline(pipeline);
+            cmdBuffer->bindDescriptorSets(pipeline, 0,
+                {
+                    descriptorSets[frame],
+                    swapchainDescriptorSets[index]
+                });
+            {
+                GpuProfiler::Scope scope(*profiler, cmdBuffer, frame, "traceRays");
+                traceRays(cmdBuffer, index, shaderBindingTable);
+            }
+            backBuffer->layoutTransition(presentLayout, cmdBuffer);
+        }
+        cmdBuffer->end();
+    }
+};
+
+std::unique_ptr<IApplication> appFactory(const AppEntry& entry)
+{
+    return std::unique_ptr<InstancingApp>(new InstancingApp(entry));
+}
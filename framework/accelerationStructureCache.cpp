@@ -0,0 +1,255 @@
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include "accelerationStructureCache.h"
+#include "utilities.h"
+
+namespace
+{
+constexpr uint32_t cacheMagic = 0x53414B56; // "VKAS"
+constexpr uint32_t cacheVersion = 1;
+
+float millisecondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+    const auto duration = std::chrono::high_resolution_clock::now() - start;
+    return std::chrono::duration<float, std::milli>(duration).count();
+}
+}
+
+AccelerationStructureCache::AccelerationStructureCache(std::shared_ptr<magma::Device> device, const std::string& directory,
+    std::shared_ptr<magma::Allocator> allocator /* nullptr */):
+    device(std::move(device)),
+    allocator(std::move(allocator)),
+    directory(directory),
+    driverUUID{},
+    queryPool(VK_NULL_HANDLE)
+{
+    const VkDevice handle = this->device->getHandle();
+    pfnCmdCopyAccelerationStructureToMemory = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureToMemoryKHR>(
+        vkGetDeviceProcAddr(handle, "vkCmdCopyAccelerationStructureToMemoryKHR"));
+    pfnCmdCopyMemoryToAccelerationStructure = reinterpret_cast<PFN_vkCmdCopyMemoryToAccelerationStructureKHR>(
+        vkGetDeviceProcAddr(handle, "vkCmdCopyMemoryToAccelerationStructureKHR"));
+    pfnCmdWriteAccelerationStructuresProperties = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(
+        vkGetDeviceProcAddr(handle, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    pfnGetDeviceAccelerationStructureCompatibility = reinterpret_cast<PFN_vkGetDeviceAccelerationStructureCompatibilityKHR>(
+        vkGetDeviceProcAddr(handle, "vkGetDeviceAccelerationStructureCompatibilityKHR"));
+    if (!pfnCmdCopyAccelerationStructureToMemory ||
+        !pfnCmdCopyMemoryToAccelerationStructure ||
+        !pfnCmdWriteAccelerationStructuresProperties ||
+        !pfnGetDeviceAccelerationStructureCompatibility)
+        throw std::runtime_error("acceleration structure serialization not supported");
+    // Serialized structure can't be used with different driver
+    VkPhysicalDeviceIDProperties idProperties;
+    idProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    idProperties.pNext = nullptr;
+    VkPhysicalDeviceProperties2 properties;
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &idProperties;
+    vkGetPhysicalDeviceProperties2(this->device->getPhysicalDevice()->getHandle(), &properties);
+    memcpy(driverUUID, idProperties.driverUUID, VK_UUID_SIZE);
+    VkQueryPoolCreateInfo queryPoolInfo;
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.pNext = nullptr;
+    queryPoolInfo.flags = 0;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+    queryPoolInfo.queryCount = 1;
+    queryPoolInfo.pipelineStatistics = 0;
+    if (vkCreateQueryPool(handle, &queryPoolInfo, nullptr, &queryPool) != VK_SUCCESS)
+        throw std::runtime_error("failed to create serialization size query pool");
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+}
+
+AccelerationStructureCache::~AccelerationStructureCache()
+{
+    vkDestroyQueryPool(device->getHandle(), queryPool, nullptr);
+}
+
+bool AccelerationStructureCache::load(const std::shared_ptr<magma::AccelerationStructure>& accelerationStructure,
+    uint64_t hash, VkBuildAccelerationStructureFlagsKHR flags,
+    const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+    const uint64_t key = getKey(hash, flags);
+    std::ifstream file(getFileName(key), std::ios::in | std::ios::binary | std::ios::ate);
+    std::streamoff fileSize = 0;
+    Header header = {};
+    if (file.is_open())
+    {
+        fileSize = file.tellg();
+        file.seekg(0, std::ios::beg);
+        file.read(reinterpret_cast<char *>(&header), sizeof(Header));
+    }
+    if (!file || (header.magic != cacheMagic) || (header.version != cacheVersion) ||
+        (header.key != key) || (header.size < VK_UUID_SIZE * 2))
+    {
+        ++statistics.misses;
+        return false;
+    }
+    if (header.size > static_cast<uint64_t>(fileSize) - sizeof(Header))
+    {   // Don't trust the size read from disk before allocating memory
+        std::cout << "cached acceleration structure is truncated, rebuild" << std::endl;
+        ++statistics.misses;
+        return false;
+    }
+    std::vector<uint8_t> data(static_cast<std::size_t>(header.size));
+    file.read(reinterpret_cast<char *>(data.data()), data.size());
+    if (!file)
+    {   // Truncated file
+        ++statistics.misses;
+        return false;
+    }
+    // Serialized data begins with driver and compatibility UUIDs
+    VkAccelerationStructureVersionInfoKHR versionInfo;
+    versionInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR;
+    versionInfo.pNext = nullptr;
+    versionInfo.pVersionData = data.data();
+    VkAccelerationStructureCompatibilityKHR compatibility = VK_ACCELERATION_STRUCTURE_COMPATIBILITY_INCOMPATIBLE_KHR;
+    pfnGetDeviceAccelerationStructureCompatibility(device->getHandle(), &versionInfo, &compatibility);
+    if (compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR)
+    {
+        std::cout << "cached acceleration structure is incompatible with device, rebuild" << std::endl;
+        ++statistics.misses;
+        return false;
+    }
+    auto srcBuffer = std::make_shared<magma::SrcTransferBuffer>(device, header.size, data.data(), allocator);
+    std::shared_ptr<magma::Buffer> buffer = allocateBuffer(header.size);
+    cmdBuffer->reset();
+    cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    {
+        cmdBuffer->copyBuffer(srcBuffer, buffer);
+        cmdBuffer->pipelineBarrier(
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            magma::MemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT));
+        VkCopyMemoryToAccelerationStructureInfoKHR copyInfo;
+        copyInfo.sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR;
+        copyInfo.pNext = nullptr;
+        copyInfo.src.deviceAddress = buffer->getDeviceAddress();
+        copyInfo.dst = accelerationStructure->getHandle();
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+        pfnCmdCopyMemoryToAccelerationStructure(cmdBuffer->getHandle(), &copyInfo);
+    }
+    cmdBuffer->end();
+    magma::finish(cmdBuffer);
+    const float deserializeTime = millisecondsSince(start);
+    statistics.deserializeTime += deserializeTime;
+    ++statistics.hits;
+    std::cout << std::fixed << std::setprecision(2)
+        << "acceleration structure " << std::hex << key << std::dec
+        << " deserialized in " << deserializeTime << " ms (build took " << header.buildTime << " ms)" << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+    return true;
+}
+
+void AccelerationStructureCache::store(const std::shared_ptr<magma::AccelerationStructure>& accelerationStructure,
+    uint64_t hash, VkBuildAccelerationStructureFlagsKHR flags, float buildTime,
+    const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{
+    statistics.buildTime += buildTime;
+    const VkAccelerationStructureKHR handle = accelerationStructure->getHandle();
+    cmdBuffer->reset();
+    cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    {   // Structure has been built in previous submission
+        cmdBuffer->pipelineBarrier(
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            magma::barrier::memory::accelerationStructureWriteRead);
+        vkCmdResetQueryPool(cmdBuffer->getHandle(), queryPool, 0, 1);
+        pfnCmdWriteAccelerationStructuresProperties(cmdBuffer->getHandle(), 1, &handle,
+            VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, queryPool, 0);
+    }
+    cmdBuffer->end();
+    magma::finish(cmdBuffer);
+    uint64_t size = 0;
+    if (vkGetQueryPoolResults(device->getHandle(), queryPool, 0, 1, sizeof(uint64_t), &size, sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS)
+        throw std::runtime_error("failed to get serialization size");
+    std::shared_ptr<magma::Buffer> buffer = allocateBuffer(size);
+    auto dstBuffer = std::make_shared<magma::DstTransferBuffer>(device, size, allocator);
+    cmdBuffer->reset();
+    cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    {
+        VkCopyAccelerationStructureToMemoryInfoKHR copyInfo;
+        copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR;
+        copyInfo.pNext = nullptr;
+        copyInfo.src = handle;
+        copyInfo.dst.deviceAddress = buffer->getDeviceAddress();
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+        pfnCmdCopyAccelerationStructureToMemory(cmdBuffer->getHandle(), &copyInfo);
+        cmdBuffer->pipelineBarrier(
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            magma::MemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT));
+        cmdBuffer->copyBuffer(buffer, dstBuffer);
+    }
+    cmdBuffer->end();
+    magma::finish(cmdBuffer);
+    const uint64_t key = getKey(hash, flags);
+    const std::string fileName = getFileName(key);
+    Header header = {};
+    header.magic = cacheMagic;
+    header.version = cacheVersion;
+    header.key = key;
+    header.buildTime = buildTime;
+    header.size = size;
+    // Write to temporary file and replace the old one, so that reader never sees partial data
+    const std::string tmpFileName = fileName + ".tmp";
+    {
+        std::ofstream file(tmpFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {   // Cache is optional
+            std::cout << "failed to create file \"" << tmpFileName << "\"" << std::endl;
+            return;
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+        magma::helpers::mapScoped<char>(dstBuffer,
+            [&file, size](const char *data)
+            {
+                file.write(data, static_cast<std::streamsize>(size));
+            });
+        if (!file.flush())
+        {
+            std::cout << "failed to write file \"" << tmpFileName << "\"" << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpFileName, fileName, error);
+    if (error)
+    {
+        std::cout << "failed to replace file \"" << fileName << "\": " << error.message() << std::endl;
+        std::filesystem::remove(tmpFileName, error);
+        return;
+    }
+    std::cout << std::fixed << std::setprecision(2)
+        << "acceleration structure " << std::hex << key << std::dec
+        << " built in " << buildTime << " ms, cached " << size / 1024 << " KB" << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+uint64_t AccelerationStructureCache::getKey(uint64_t hash, VkBuildAccelerationStructureFlagsKHR flags) const noexcept
+{
+    uint64_t key = utilities::hash(&flags, sizeof(flags), hash);
+    return utilities::hash(driverUUID, VK_UUID_SIZE, key);
+}
+
+std::string AccelerationStructureCache::getFileName(uint64_t key) const
+{
+    std::ostringstream fileName;
+    fileName << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".as";
+    return fileName.str();
+}
+
+std::shared_ptr<magma::Buffer> AccelerationStructureCache::allocateBuffer(VkDeviceSize size) const
+{   // Serialized data is addressed by device address
+    magma::Buffer::Initializer initializer;
+    initializer.deviceAddress = true;
+    return std::make_shared<magma::StorageBuffer>(device, size, allocator, initializer);
+}
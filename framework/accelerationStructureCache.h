@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include "magma/magma.h"
+
+/* Stores serialized acceleration structures on disk. Cache file is keyed
+   by hash of geometry data, build flags and driver UUID, and its content
+   is validated by device compatibility check before deserialization,
+   so structure is built from scratch only on miss or driver update. */
+
+class AccelerationStructureCache
+{
+public:
+    struct Statistics
+    {
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+        float buildTime = 0.f; // Milliseconds
+        float deserializeTime = 0.f;
+    };
+
+    explicit AccelerationStructureCache(std::shared_ptr<magma::Device> device, const std::string& directory,
+        std::shared_ptr<magma::Allocator> allocator = nullptr);
+    ~AccelerationStructureCache();
+    bool load(const std::shared_ptr<magma::AccelerationStructure>& accelerationStructure,
+        uint64_t hash, VkBuildAccelerationStructureFlagsKHR flags,
+        const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
+    void store(const std::shared_ptr<magma::AccelerationStructure>& accelerationStructure,
+        uint64_t hash, VkBuildAccelerationStructureFlagsKHR flags, float buildTime,
+        const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
+    const Statistics& getStatistics() const noexcept { return statistics; }
+
+private:
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        float buildTime;
+        uint32_t reserved;
+        uint64_t size; // Serialized data follows
+    };
+
+    uint64_t getKey(uint64_t hash, VkBuildAccelerationStructureFlagsKHR flags) const noexcept;
+    std::string getFileName(uint64_t key) const;
+    std::shared_ptr<magma::Buffer> allocateBuffer(VkDeviceSize size) const;
+
+    std::shared_ptr<magma::Device> device;
+    std::shared_ptr<magma::Allocator> allocator;
+    std::string directory;
+    uint8_t driverUUID[VK_UUID_SIZE];
+    VkQueryPool queryPool;
+    PFN_vkCmdCopyAccelerationStructureToMemoryKHR pfnCmdCopyAccelerationStructureToMemory;
+    PFN_vkCmdCopyMemoryToAccelerationStructureKHR pfnCmdCopyMemoryToAccelerationStructure;
+    PFN_vkCmdWriteAccelerationStructuresPropertiesKHR pfnCmdWriteAccelerationStructuresProperties;
+    PFN_vkGetDeviceAccelerationStructureCompatibilityKHR pfnGetDeviceAccelerationStructureCompatibility;
+    Statistics statistics;
+};
@@ -28,6 +28,7 @@ public:
     virtual void onMouseRButton(bool down, int x, int y) = 0;
     virtual void onMouseMButton(bool down, int x, int y) = 0;
     virtual void onMouseWheel(float distance) = 0;
+    virtual int getExitCode() const noexcept = 0;
 
 protected:
     virtual char translateKey(int code) const = 0;
@@ -57,6 +58,7 @@ protected:
     BaseApp(const std::tstring& caption, uint32_t width, uint32_t height):
         caption(caption), width(width), height(height) {}
     virtual void close() override { quit = true; }
+    virtual int getExitCode() const noexcept override { return exitCode; }
     virtual void onKeyDown(char key, int /* repeat */, uint32_t /* flags */) override
     {
         if (AppKey::Escape == key)
@@ -70,6 +72,8 @@ protected:
     float spinX = 0.f;
     float spinY = 0.f;
     bool quit = false;
+    bool headless = false; // No window, render offscreen
+    int exitCode = 0;
 };
 
 std::unique_ptr<IApplication> appFactory(const AppEntry&);
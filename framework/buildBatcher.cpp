@@ -0,0 +1,263 @@
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "buildBatcher.h"
+#include "scratchAllocator.h"
+#include "timelineScheduler.h"
+
+namespace
+{
+constexpr VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) noexcept
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+template<class Function>
+Function getDeviceProcAddr(VkDevice device, const char *name)
+{
+    Function function = reinterpret_cast<Function>(vkGetDeviceProcAddr(device, name));
+    if (!function)
+        throw std::runtime_error(std::string("failed to get ") + name);
+    return function;
+}
+}
+
+BuildBatcher::BuildBatcher(std::shared_ptr<magma::Device> device, ScratchAllocator& scratchAllocator,
+    bool hostBuild /* false */,
+    VkDeviceSize scratchBudget /* 256 MB */):
+    device(std::move(device)),
+    scratchAllocator(scratchAllocator),
+    hostBuild(hostBuild),
+    scratchBudget(scratchBudget),
+    pfnBuildAccelerationStructures(nullptr),
+    pfnCreateDeferredOperation(nullptr),
+    pfnDestroyDeferredOperation(nullptr),
+    pfnGetDeferredOperationMaxConcurrency(nullptr),
+    pfnGetDeferredOperationResult(nullptr),
+    pfnDeferredOperationJoin(nullptr),
+    deferredOperation(VK_NULL_HANDLE),
+    operationIndex(0),
+    participantCount(0),
+    pendingCount(0),
+    stopWorkers(false)
+{
+    const VkDevice handle = this->device->getHandle();
+    pfnCmdBuildAccelerationStructures = getDeviceProcAddr<PFN_vkCmdBuildAccelerationStructuresKHR>(handle, "vkCmdBuildAccelerationStructuresKHR");
+    if (hostBuild)
+    {
+        pfnBuildAccelerationStructures = getDeviceProcAddr<PFN_vkBuildAccelerationStructuresKHR>(handle, "vkBuildAccelerationStructuresKHR");
+        pfnCreateDeferredOperation = getDeviceProcAddr<PFN_vkCreateDeferredOperationKHR>(handle, "vkCreateDeferredOperationKHR");
+        pfnDestroyDeferredOperation = getDeviceProcAddr<PFN_vkDestroyDeferredOperationKHR>(handle, "vkDestroyDeferredOperationKHR");
+        pfnGetDeferredOperationMaxConcurrency = getDeviceProcAddr<PFN_vkGetDeferredOperationMaxConcurrencyKHR>(handle, "vkGetDeferredOperationMaxConcurrencyKHR");
+        pfnGetDeferredOperationResult = getDeviceProcAddr<PFN_vkGetDeferredOperationResultKHR>(handle, "vkGetDeferredOperationResultKHR");
+        pfnDeferredOperationJoin = getDeviceProcAddr<PFN_vkDeferredOperationJoinKHR>(handle, "vkDeferredOperationJoinKHR");
+        // Calling thread joins operation too, so one worker less
+        const uint32_t workerCount = std::max(1U, std::thread::hardware_concurrency()) - 1;
+        for (uint32_t i = 0; i < workerCount; ++i)
+            workers.emplace_back(&BuildBatcher::runWorker, this, i);
+    }
+}
+
+BuildBatcher::~BuildBatcher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopWorkers = true;
+    }
+    operationReady.notify_all();
+    for (std::thread& worker: workers)
+        worker.join();
+}
+
+void BuildBatcher::add(std::shared_ptr<magma::AccelerationStructure> accelerationStructure,
+    const std::list<magma::AccelerationStructureGeometry>& geometries,
+    BuiltCallback onBuilt /* nullptr */)
+{
+    Build build;
+    for (const magma::AccelerationStructureGeometry& geometry: geometries)
+    {
+        build.geometries.push_back(geometry);
+        build.buildRanges.push_back({geometry.primitiveCount, 0, 0, 0});
+    }
+    build.scratchSize = alignUp(accelerationStructure->getBuildScratchSize(), scratchAllocator.getAlignment());
+    build.accelerationStructure = std::move(accelerationStructure);
+    build.onBuilt = std::move(onBuilt);
+    builds.push_back(std::move(build));
+}
+
+void BuildBatcher::flush(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{
+    while (!builds.empty())
+    {
+        const auto start = std::chrono::high_resolution_clock::now();
+        VkDeviceSize arenaSize = 0;
+        const std::size_t count = getBatchSize(arenaSize);
+        if (hostBuild)
+            buildOnHost(count, arenaSize);
+        else
+        {
+            cmdBuffer->reset();
+            cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+            record(cmdBuffer, count, arenaSize);
+            cmdBuffer->end();
+            magma::finish(cmdBuffer);
+            // Batch is complete, so its scratch arena can be reused by the next one
+            scratchAllocator.release(TimelineScheduler::SyncPoint());
+        }
+        const auto duration = std::chrono::high_resolution_clock::now() - start;
+        const float batchTime = std::chrono::duration<float, std::milli>(duration).count();
+        std::vector<Build> batch(std::make_move_iterator(builds.begin()), std::make_move_iterator(builds.begin() + count));
+        builds.erase(builds.begin(), builds.begin() + count);
+        ++statistics.batchCount;
+        statistics.buildTime += batchTime;
+        for (Build& build: batch)
+        {
+            ++statistics.buildCount;
+            for (const VkAccelerationStructureBuildRangeInfoKHR& buildRange: build.buildRanges)
+                statistics.primitiveCount += buildRange.primitiveCount;
+            // Build time is shared evenly between structures of the batch
+            if (build.onBuilt)
+                build.onBuilt(batchTime / count);
+        }
+    }
+    // Free host scratch memory until the next batch
+    hostScratch.clear();
+    hostScratch.shrink_to_fit();
+}
+
+std::size_t BuildBatcher::getBatchSize(VkDeviceSize& arenaSize) const noexcept
+{   // Take as many builds as fit into the budget, but at least one
+    std::size_t count = 0;
+    arenaSize = 0;
+    for (const Build& build: builds)
+    {
+        if (count && (arenaSize + build.scratchSize > scratchBudget))
+            break;
+        arenaSize += build.scratchSize;
+        ++count;
+    }
+    return count;
+}
+
+void BuildBatcher::setupBuildInfos(std::size_t count,
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR>& buildInfos,
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *>& buildRangeInfos) const
+{
+    buildInfos.resize(count);
+    buildRangeInfos.resize(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        const Build& build = builds[i];
+        VkAccelerationStructureBuildGeometryInfoKHR& buildInfo = buildInfos[i];
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.pNext = nullptr;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = build.accelerationStructure->getBuildFlags();
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
+        buildInfo.dstAccelerationStructure = build.accelerationStructure->getHandle();
+        buildInfo.geometryCount = static_cast<uint32_t>(build.geometries.size());
+        buildInfo.pGeometries = build.geometries.data();
+        buildInfo.ppGeometries = nullptr;
+        buildInfo.scratchData.deviceAddress = 0;
+        buildRangeInfos[i] = build.buildRanges.data();
+    }
+}
+
+void BuildBatcher::record(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, std::size_t count, VkDeviceSize arenaSize)
+{
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *> buildRangeInfos;
+    setupBuildInfos(count, buildInfos, buildRangeInfos);
+    // Each build gets its own range of the arena, so they can run concurrently
+    VkDeviceAddress scratchAddress = scratchAllocator.allocate(arenaSize);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        buildInfos[i].scratchData.deviceAddress = scratchAddress;
+        scratchAddress += builds[i].scratchSize;
+    }
+    pfnCmdBuildAccelerationStructures(cmdBuffer->getHandle(),
+        static_cast<uint32_t>(count), buildInfos.data(), buildRangeInfos.data());
+}
+
+void BuildBatcher::buildOnHost(std::size_t count, VkDeviceSize arenaSize)
+{
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos;
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR *> buildRangeInfos;
+    setupBuildInfos(count, buildInfos, buildRangeInfos);
+    const VkDeviceSize alignment = scratchAllocator.getAlignment();
+    if (hostScratch.size() < arenaSize + alignment)
+        hostScratch.resize(static_cast<std::size_t>(arenaSize + alignment));
+    const std::uintptr_t scratchAddress = reinterpret_cast<std::uintptr_t>(hostScratch.data());
+    uint8_t *scratchData = hostScratch.data() + (alignUp(scratchAddress, alignment) - scratchAddress);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        buildInfos[i].scratchData.hostAddress = scratchData;
+        scratchData += builds[i].scratchSize;
+    }
+    const VkDevice handle = device->getHandle();
+    VkDeferredOperationKHR operation;
+    if (pfnCreateDeferredOperation(handle, nullptr, &operation) != VK_SUCCESS)
+        throw std::runtime_error("failed to create deferred operation");
+    VkResult result = pfnBuildAccelerationStructures(handle, operation,
+        static_cast<uint32_t>(count), buildInfos.data(), buildRangeInfos.data());
+    if (VK_OPERATION_DEFERRED_KHR == result)
+    {   // Driver splits the work between as many threads as join the operation
+        const uint32_t maxConcurrency = pfnGetDeferredOperationMaxConcurrency(handle, operation);
+        const uint32_t workerCount = std::min(std::max(1U, maxConcurrency) - 1, static_cast<uint32_t>(workers.size()));
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            deferredOperation = operation;
+            participantCount = workerCount;
+            pendingCount = workerCount;
+            ++operationIndex;
+        }
+        operationReady.notify_all();
+        joinDeferredOperation(operation);
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            operationJoined.wait(lock, [this]() { return !pendingCount; });
+        }
+        result = pfnGetDeferredOperationResult(handle, operation);
+    }
+    else if (VK_OPERATION_NOT_DEFERRED_KHR == result)
+        result = VK_SUCCESS;
+    pfnDestroyDeferredOperation(handle, operation, nullptr);
+    if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to build acceleration structures on host");
+}
+
+void BuildBatcher::joinDeferredOperation(VkDeferredOperationKHR operation) const
+{   // VK_THREAD_IDLE_KHR means there is no work for now, but operation isn't complete
+    while (pfnDeferredOperationJoin(device->getHandle(), operation) == VK_THREAD_IDLE_KHR)
+        std::this_thread::yield();
+}
+
+void BuildBatcher::runWorker(uint32_t workerIndex)
+{
+    uint64_t lastOperationIndex = 0;
+    for (;;)
+    {
+        VkDeferredOperationKHR operation;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            operationReady.wait(lock, [this, lastOperationIndex]()
+                { return stopWorkers || (operationIndex != lastOperationIndex); });
+            if (stopWorkers)
+                return;
+            lastOperationIndex = operationIndex;
+            if (workerIndex >= participantCount)
+                continue; // Operation doesn't need that many threads
+            operation = deferredOperation;
+        }
+        joinDeferredOperation(operation);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!--pendingCount)
+                operationJoined.notify_one();
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "magma/magma.h"
+
+class ScratchAllocator;
+
+/* Collects bottom-level acceleration structure builds and records
+   them as a single vkCmdBuildAccelerationStructuresKHR() call with one
+   scratch arena, so that loading many meshes costs one submission
+   instead of one per mesh. Batch is split if its scratch memory would
+   exceed the budget. In host mode the batch is built on CPU as deferred
+   operation, which is joined by pooled worker threads, and GPU stays free. */
+
+class BuildBatcher
+{
+public:
+    typedef std::function<void(float buildTime)> BuiltCallback;
+
+    struct Statistics
+    {
+        uint32_t buildCount = 0;
+        uint32_t batchCount = 0;
+        uint64_t primitiveCount = 0;
+        float buildTime = 0.f; // Milliseconds
+    };
+
+    explicit BuildBatcher(std::shared_ptr<magma::Device> device, ScratchAllocator& scratchAllocator,
+        bool hostBuild = false,
+        VkDeviceSize scratchBudget = 256 * 1024 * 1024);
+    ~BuildBatcher();
+    void add(std::shared_ptr<magma::AccelerationStructure> accelerationStructure,
+        const std::list<magma::AccelerationStructureGeometry>& geometries,
+        BuiltCallback onBuilt = nullptr);
+    void flush(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
+    bool empty() const noexcept { return builds.empty(); }
+    bool isHostBuild() const noexcept { return hostBuild; }
+    const Statistics& getStatistics() const noexcept { return statistics; }
+
+private:
+    struct Build
+    {
+        std::shared_ptr<magma::AccelerationStructure> accelerationStructure;
+        std::vector<VkAccelerationStructureGeometryKHR> geometries;
+        std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRanges;
+        VkDeviceSize scratchSize;
+        BuiltCallback onBuilt;
+    };
+
+    std::size_t getBatchSize(VkDeviceSize& arenaSize) const noexcept;
+    void setupBuildInfos(std::size_t count,
+        std::vector<VkAccelerationStructureBuildGeometryInfoKHR>& buildInfos,
+        std::vector<const VkAccelerationStructureBuildRangeInfoKHR *>& buildRangeInfos) const;
+    void record(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, std::size_t count, VkDeviceSize arenaSize);
+    void buildOnHost(std::size_t count, VkDeviceSize arenaSize);
+    void joinDeferredOperation(VkDeferredOperationKHR operation) const;
+    void runWorker(uint32_t workerIndex);
+
+    std::shared_ptr<magma::Device> device;
+    ScratchAllocator& scratchAllocator;
+    const bool hostBuild;
+    const VkDeviceSize scratchBudget;
+    std::vector<Build> builds;
+    std::vector<uint8_t> hostScratch;
+    Statistics statistics;
+    PFN_vkCmdBuildAccelerationStructuresKHR pfnCmdBuildAccelerationStructures;
+    PFN_vkBuildAccelerationStructuresKHR pfnBuildAccelerationStructures;
+    PFN_vkCreateDeferredOperationKHR pfnCreateDeferredOperation;
+    PFN_vkDestroyDeferredOperationKHR pfnDestroyDeferredOperation;
+    PFN_vkGetDeferredOperationMaxConcurrencyKHR pfnGetDeferredOperationMaxConcurrency;
+    PFN_vkGetDeferredOperationResultKHR pfnGetDeferredOperationResult;
+    PFN_vkDeferredOperationJoinKHR pfnDeferredOperationJoin;
+    // Worker pool of host build
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable operationReady;
+    std::condition_variable operationJoined;
+    VkDeferredOperationKHR deferredOperation;
+    uint64_t operationIndex;
+    uint32_t participantCount;
+    uint32_t pendingCount;
+    bool stopWorkers;
+};
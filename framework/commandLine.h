@@ -0,0 +1,56 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <vector>
+#include "application.h"
+
+class CommandLine
+{
+public:
+    explicit CommandLine(const AppEntry& entry)
+    {
+#ifdef VK_USE_PLATFORM_WIN32_KHR
+        std::istringstream stream(entry.lpCmdLine ? entry.lpCmdLine : "");
+        std::string arg;
+        while (stream >> arg)
+            args.push_back(arg);
+#else
+        for (int i = 1; i < entry.argc; ++i)
+            args.push_back(entry.argv[i]);
+#endif
+    }
+
+    bool hasOption(const char *name) const
+    {
+        return find(name) != args.end();
+    }
+
+    std::string getString(const char *name, const std::string& defaultValue) const
+    {
+        auto it = find(name);
+        if ((it == args.end()) || (++it == args.end()))
+            return defaultValue;
+        return *it;
+    }
+
+    uint32_t getUint(const char *name, uint32_t defaultValue) const
+    {
+        const std::string value = getString(name, std::string());
+        return value.empty() ? defaultValue : static_cast<uint32_t>(std::stoul(value));
+    }
+
+    float getFloat(const char *name, float defaultValue) const
+    {
+        const std::string value = getString(name, std::string());
+        return value.empty() ? defaultValue : std::stof(value);
+    }
+
+private:
+    std::vector<std::string>::const_iterator find(const char *name) const
+    {
+        return std::find(args.begin(), args.end(), std::string(name));
+    }
+
+    std::vector<std::string> args;
+};
@@ -0,0 +1,18 @@
+#include "computePipeline.h"
+#include "rayTracingPipeline.h"
+
+ComputePipeline::ComputePipeline(std::shared_ptr<magma::Device> device,
+    ShaderReflectionFactory& shaderReflectionFactory,
+    const char *fileName,
+    std::shared_ptr<magma::PipelineLayout> layout,
+    std::shared_ptr<PipelineCache> pipelineCache /* null */,
+    std::shared_ptr<magma::IAllocator> allocator /* null */):
+    magma::ComputePipeline(device,
+        RayTracingPipeline::loadShader(shaderReflectionFactory, fileName),
+        std::move(layout),
+        std::move(allocator),
+        pipelineCache)
+{
+    if (pipelineCache)
+        pipelineCache->logCreation("compute", getCreationTime());
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "magma/magma.h"
+#include "pipelineCache.h"
+
+class ShaderReflectionFactory;
+
+class ComputePipeline : private PipelineCreationTimer, public magma::ComputePipeline
+{
+public:
+    explicit ComputePipeline(std::shared_ptr<magma::Device> device,
+        ShaderReflectionFactory& shaderReflectionFactory,
+        const char *fileName,
+        std::shared_ptr<magma::PipelineLayout> layout,
+        std::shared_ptr<PipelineCache> pipelineCache = nullptr,
+        std::shared_ptr<magma::IAllocator> allocator = nullptr);
+};
@@ -0,0 +1,53 @@
+#include <algorithm>
+#include <cmath>
+#include "dynamicResolution.h"
+
+namespace
+{
+// Smoothing factor of frame time moving average
+constexpr float smoothing = 0.1f;
+// Don't grow resolution until there is some headroom, otherwise scale oscillates
+constexpr float headroom = 0.9f;
+// Scale changes in steps of 1/32 of full resolution
+constexpr float scaleStep = 1.f/32.f;
+}
+
+DynamicResolution::DynamicResolution(float targetTime, float minScale, uint32_t latency):
+    targetTime(std::max(targetTime, 0.1f)),
+    minScale(std::min(std::max(minScale, scaleStep), 1.f)),
+    latency(latency),
+    scale(1.f),
+    averageTime(0.f),
+    cooldown(latency)
+{}
+
+bool DynamicResolution::update(float gpuTime)
+{
+    if (gpuTime <= 0.f)
+        return false; // Nothing measured yet
+    if (cooldown)
+    {   // Frames in flight were recorded with previous scale
+        --cooldown;
+        return false;
+    }
+    if (averageTime > 0.f)
+        averageTime += (gpuTime - averageTime) * smoothing;
+    else
+        averageTime = gpuTime;
+    if ((averageTime < targetTime) && (averageTime > targetTime * headroom))
+        return false;
+    float newScale = scale * std::sqrt(targetTime * headroom / averageTime);
+    newScale = std::round(newScale / scaleStep) * scaleStep;
+    newScale = std::min(std::max(newScale, minScale), 1.f);
+    if (newScale == scale)
+        return false;
+    scale = newScale;
+    averageTime = 0.f;
+    cooldown = latency;
+    return true;
+}
+
+uint32_t DynamicResolution::scaleDimension(uint32_t size) const noexcept
+{
+    return std::max(1U, static_cast<uint32_t>(size * scale + 0.5f));
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+
+/* Scales ray dispatch to hold GPU frame time within a budget.
+   Cost of ray tracing is roughly proportional to the number of
+   pixels, so scale is corrected by square root of the ratio of
+   target and measured time. Scale is quantized to limit how often
+   command buffers have to be re-recorded. */
+
+class DynamicResolution
+{
+public:
+    explicit DynamicResolution(float targetTime, float minScale = 0.5f, uint32_t latency = 2);
+    bool update(float gpuTime);
+    float getScale() const noexcept { return scale; }
+    float getTargetTime() const noexcept { return targetTime; }
+    uint32_t scaleDimension(uint32_t size) const noexcept;
+
+private:
+    const float targetTime; // Milliseconds
+    const float minScale;
+    const uint32_t latency; // Frames until new scale is measured
+    float scale;
+    float averageTime;
+    uint32_t cooldown;
+};
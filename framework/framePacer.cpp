@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#endif
+#include "framePacer.h"
+
+namespace
+{
+// OS sleep may oversleep, so spin through the last part of the interval
+constexpr std::chrono::microseconds spinThreshold(1000);
+// Wake up earlier than GPU is predicted to finish to absorb jitter
+constexpr float latencyMargin = 0.5f;
+}
+
+FramePacer::FramePacer(Mode mode, float targetFps):
+    mode(mode),
+    period(std::chrono::duration_cast<HiResClock::duration>(
+        std::chrono::duration<double>(1. / std::max(targetFps, 1.f)))),
+    predictedWait(0.f),
+    frameCount(0),
+    mean(0.), m2(0.),
+    min(0.f), max(0.f),
+    waitableTimer(nullptr)
+{
+#if defined(_WIN32) && defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+    // Default scheduler granularity on Windows is ~15 ms, use high-resolution timer if available
+    waitableTimer = CreateWaitableTimerExW(nullptr, nullptr,
+        CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+    deadline = HiResClock::now();
+}
+
+FramePacer::~FramePacer()
+{
+#ifdef _WIN32
+    if (waitableTimer)
+        CloseHandle(waitableTimer);
+#endif
+}
+
+void FramePacer::beginFrame(const std::function<void()>& waitForGpu)
+{
+    switch (mode)
+    {
+    case Mode::Uncapped:
+        waitForGpu();
+        break;
+    case Mode::FixedRate:
+        {
+            deadline += period;
+            const HiResClock::time_point now = HiResClock::now();
+            if (deadline < now)
+            {   // Missed the deadline, don't try to catch up with a burst of frames
+                deadline = now;
+            }
+            else
+                sleepUntil(deadline);
+            waitForGpu();
+        }
+        break;
+    case Mode::LowLatency:
+        {   // Sleep instead of blocking on GPU so that input is sampled as late as possible
+            const HiResClock::time_point begin = HiResClock::now();
+            if (predictedWait > latencyMargin)
+            {
+                sleepUntil(begin + std::chrono::duration_cast<HiResClock::duration>(
+                    std::chrono::duration<float, std::milli>(predictedWait - latencyMargin)));
+            }
+            const HiResClock::time_point slept = HiResClock::now();
+            waitForGpu();
+            const float blocked = std::chrono::duration<float, std::milli>(HiResClock::now() - slept).count();
+            const float gpuWait = std::chrono::duration<float, std::milli>(HiResClock::now() - begin).count();
+            if (blocked < 0.05f)
+            {   // GPU finished before we woke up, back off
+                predictedWait *= 0.9f;
+            }
+            else
+            {   // Exponential moving average of time until GPU completion
+                predictedWait = predictedWait * 0.9f + gpuWait * 0.1f;
+            }
+        }
+        break;
+    }
+}
+
+void FramePacer::endFrame()
+{
+    const HiResClock::time_point now = HiResClock::now();
+    if (lastFrameEnd != HiResClock::time_point())
+    {
+        const float frameTime = std::chrono::duration<float, std::milli>(now - lastFrameEnd).count();
+        if (0 == frameCount++)
+            min = max = frameTime;
+        else
+        {
+            min = std::min(min, frameTime);
+            max = std::max(max, frameTime);
+        }
+        const double delta = frameTime - mean;
+        mean += delta / frameCount;
+        m2 += delta * (frameTime - mean);
+    }
+    lastFrameEnd = now;
+}
+
+FramePacer::Statistics FramePacer::getStatistics() const noexcept
+{
+    Statistics stats;
+    stats.frameCount = frameCount;
+    stats.mean = static_cast<float>(mean);
+    if (frameCount > 1)
+        stats.stdDev = static_cast<float>(std::sqrt(m2 / (frameCount - 1)));
+    stats.min = min;
+    stats.max = max;
+    return stats;
+}
+
+FramePacer::Mode FramePacer::parseMode(const std::string& name)
+{
+    if ("uncapped" == name)
+        return Mode::Uncapped;
+    if ("fixed" == name)
+        return Mode::FixedRate;
+    if ("low-latency" == name)
+        return Mode::LowLatency;
+    throw std::runtime_error("unknown pacing mode \"" + name + "\"");
+}
+
+const char *FramePacer::getModeName(Mode mode) noexcept
+{
+    switch (mode)
+    {
+    case Mode::Uncapped: return "uncapped";
+    case Mode::FixedRate: return "fixed";
+    case Mode::LowLatency: return "low-latency";
+    }
+    return "unknown";
+}
+
+void FramePacer::sleepUntil(HiResClock::time_point deadline)
+{
+    const HiResClock::duration remaining = deadline - HiResClock::now();
+    if (remaining > spinThreshold)
+    {
+        const HiResClock::duration duration = remaining - spinThreshold;
+    #ifdef _WIN32
+        if (waitableTimer)
+        {   // Negative value is relative time in 100 ns units
+            LARGE_INTEGER dueTime;
+            dueTime.QuadPart = -static_cast<LONGLONG>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 100);
+            if (SetWaitableTimerEx(waitableTimer, &dueTime, 0, nullptr, nullptr, nullptr, 0))
+                WaitForSingleObject(waitableTimer, INFINITE);
+        }
+        else
+    #endif // _WIN32
+        std::this_thread::sleep_for(duration);
+    }
+    while (HiResClock::now() < deadline)
+        std::this_thread::yield();
+}
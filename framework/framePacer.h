@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+class FramePacer
+{
+    typedef std::chrono::high_resolution_clock HiResClock;
+
+public:
+    enum class Mode : uint8_t
+    {
+        Uncapped, // Render as fast as possible
+        FixedRate, // Hold target frame rate
+        LowLatency // Start frame just before GPU releases its resources
+    };
+
+    struct Statistics
+    {
+        uint32_t frameCount = 0;
+        float mean = 0.f; // Milliseconds
+        float stdDev = 0.f;
+        float min = 0.f;
+        float max = 0.f;
+    };
+
+    explicit FramePacer(Mode mode, float targetFps = 60.f);
+    ~FramePacer();
+    Mode getMode() const noexcept { return mode; }
+    void beginFrame(const std::function<void()>& waitForGpu);
+    void endFrame();
+    Statistics getStatistics() const noexcept;
+    static Mode parseMode(const std::string& name);
+    static const char *getModeName(Mode mode) noexcept;
+
+private:
+    void sleepUntil(HiResClock::time_point deadline);
+
+    const Mode mode;
+    const HiResClock::duration period;
+    HiResClock::time_point deadline;
+    HiResClock::time_point lastFrameEnd;
+    float predictedWait; // Milliseconds
+    // Running frame time statistics (Welford's algorithm)
+    uint32_t frameCount;
+    double mean, m2;
+    float min, max;
+    void *waitableTimer;
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include "magma/magma.h"
+
+/* Uniform data that CPU rewrites every frame. Single buffer is divided
+   into regions, one per frame in flight, and mapped once for lifetime.
+   Frame selects its region with dynamic offset, so command buffers of
+   different frames share one descriptor set. Region of a frame is written
+   only after its previous submission has been completed on GPU.
+   Memory may be not host coherent, so written region is flushed. */
+
+template<class Type>
+class FrameUniformBuffer
+{
+public:
+    explicit FrameUniformBuffer(std::shared_ptr<magma::Device> device, uint32_t frameCount,
+        std::shared_ptr<magma::Allocator> allocator = nullptr):
+        atomSize(device->getPhysicalDevice()->getProperties().limits.nonCoherentAtomSize),
+        buffer(std::make_shared<magma::DynamicUniformBuffer<Type>>(std::move(device), frameCount, std::move(allocator))),
+        frameCount(frameCount)
+    {
+        data = reinterpret_cast<uint8_t *>(buffer->getMemory()->map());
+        if (!data)
+            throw std::runtime_error("failed to map uniform buffer");
+    }
+
+    ~FrameUniformBuffer()
+    {
+        buffer->getMemory()->unmap();
+    }
+
+    Type *getFrameData(uint32_t frame) noexcept
+    {
+        MAGMA_ASSERT(frame < frameCount);
+        return reinterpret_cast<Type *>(data + getDynamicOffset(frame));
+    }
+
+    void flush(uint32_t frame)
+    {   // Range has to be aligned to nonCoherentAtomSize
+        MAGMA_ASSERT(frame < frameCount);
+        const VkDeviceSize begin = getDynamicOffset(frame);
+        const VkDeviceSize end = begin + (frame + 1 < frameCount ? getDynamicOffset(frame + 1) - begin : sizeof(Type));
+        const VkDeviceSize offset = begin / atomSize * atomSize;
+        const VkDeviceSize size = (end + atomSize - 1) / atomSize * atomSize - offset;
+        if (offset + size >= buffer->getSize())
+            buffer->getMemory()->flushMappedRange(offset, VK_WHOLE_SIZE);
+        else
+            buffer->getMemory()->flushMappedRange(offset, size);
+    }
+
+    uint32_t getDynamicOffset(uint32_t frame) const noexcept
+    {
+        return buffer->getDynamicOffset(frame);
+    }
+
+    const std::shared_ptr<magma::DynamicUniformBuffer<Type>>& getBuffer() const noexcept
+    {
+        return buffer;
+    }
+
+private:
+    const VkDeviceSize atomSize;
+    std::shared_ptr<magma::DynamicUniformBuffer<Type>> buffer;
+    const uint32_t frameCount;
+    uint8_t *data;
+};
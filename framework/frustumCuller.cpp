@@ -0,0 +1,113 @@
+#include <algorithm>
+#include <cmath>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define FRUSTUM_CULLER_SSE2
+#include <emmintrin.h>
+#endif
+#include "frustumCuller.h"
+
+namespace
+{
+void normalize(float v[3]) noexcept
+{
+    const float length = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    v[0] /= length; v[1] /= length; v[2] /= length;
+}
+
+void cross(const float a[3], const float b[3], float c[3]) noexcept
+{
+    c[0] = a[1] * b[2] - a[2] * b[1];
+    c[1] = a[2] * b[0] - a[0] * b[2];
+    c[2] = a[0] * b[1] - a[1] * b[0];
+}
+}
+
+FrustumCuller::FrustumCuller(float guardBand /* 0 */) noexcept:
+    planes{},
+    guardBand(guardBand)
+{}
+
+void FrustumCuller::setPerspective(const rapid::float3& eye, const rapid::float3& center, const rapid::float3& up,
+    float fovY, float aspect, float zNear) noexcept
+{   // Same basis as right-handed look-at matrix
+    float f[3] = {center.x - eye.x, center.y - eye.y, center.z - eye.z};
+    normalize(f);
+    const float upVec[3] = {up.x, up.y, up.z};
+    float r[3], u[3];
+    cross(f, upVec, r);
+    normalize(r);
+    cross(r, f, u);
+    const float tanY = std::tan(fovY * 0.5f);
+    const float tanX = tanY * aspect;
+    // Inward normals of side planes are orthogonal to frustum edges
+    const float normals[planeCount][3] = {
+        {f[0], f[1], f[2]}, // Near
+        {r[0] + tanX * f[0], r[1] + tanX * f[1], r[2] + tanX * f[2]}, // Left
+        {-r[0] + tanX * f[0], -r[1] + tanX * f[1], -r[2] + tanX * f[2]}, // Right
+        {u[0] + tanY * f[0], u[1] + tanY * f[1], u[2] + tanY * f[2]}, // Bottom
+        {-u[0] + tanY * f[0], -u[1] + tanY * f[1], -u[2] + tanY * f[2]} // Top
+    };
+    for (int i = 0; i < planeCount; ++i)
+    {
+        Plane& plane = planes[i];
+        float n[3] = {normals[i][0], normals[i][1], normals[i][2]};
+        normalize(n);
+        plane.nx = n[0];
+        plane.ny = n[1];
+        plane.nz = n[2];
+        // Side planes pass through eye, near plane is shifted along view direction
+        plane.d = -(n[0] * eye.x + n[1] * eye.y + n[2] * eye.z) - (i ? 0.f : zNear);
+    }
+}
+
+void FrustumCuller::cull(const std::vector<Sphere>& spheres, std::vector<uint32_t>& visibleIndices) const
+{
+    visibleIndices.clear();
+    const uint32_t count = static_cast<uint32_t>(spheres.size());
+#ifdef FRUSTUM_CULLER_SSE2
+    const __m128 band = _mm_set1_ps(guardBand);
+    for (uint32_t i = 0; i < count; i += 4)
+    {   // Transpose four spheres into x, y, z and radius vectors
+        const uint32_t n = std::min(4U, count - i);
+        __m128 x = _mm_load_ps(&spheres[i].x);
+        __m128 y = (n > 1) ? _mm_load_ps(&spheres[i + 1].x) : x;
+        __m128 z = (n > 2) ? _mm_load_ps(&spheres[i + 2].x) : x;
+        __m128 r = (n > 3) ? _mm_load_ps(&spheres[i + 3].x) : x;
+        _MM_TRANSPOSE4_PS(x, y, z, r);
+        // Sphere is visible if it isn't completely behind any of planes
+        const __m128 minDistance = _mm_sub_ps(_mm_setzero_ps(), _mm_add_ps(r, band));
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (const Plane& plane: planes)
+        {
+            __m128 distance = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.nx)), _mm_set1_ps(plane.d));
+            distance = _mm_add_ps(distance, _mm_mul_ps(y, _mm_set1_ps(plane.ny)));
+            distance = _mm_add_ps(distance, _mm_mul_ps(z, _mm_set1_ps(plane.nz)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, minDistance));
+        }
+        const int mask = _mm_movemask_ps(inside);
+        for (uint32_t j = 0; j < n; ++j)
+        {
+            if (mask & (1 << j))
+                visibleIndices.push_back(i + j);
+        }
+    }
+#else
+    for (uint32_t i = 0; i < count; ++i)
+    {   // Sphere is visible if it isn't completely behind any of planes
+        const Sphere& sphere = spheres[i];
+        const float minDistance = -(sphere.radius + guardBand);
+        bool inside = true;
+        for (const Plane& plane: planes)
+        {
+            const float distance = sphere.x * plane.nx + sphere.y * plane.ny + sphere.z * plane.nz + plane.d;
+            if (distance < minDistance)
+            {
+                inside = false;
+                break;
+            }
+        }
+        if (inside)
+            visibleIndices.push_back(i);
+    }
+#endif // FRUSTUM_CULLER_SSE2
+}
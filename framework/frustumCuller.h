@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "rapid/rapid.h"
+
+/* Culls bounding spheres of top-level instances against view frustum,
+   so that only visible instances are written into instance buffer and
+   top-level structure is built over them. Spheres are tested four at a
+   time with SSE2 where available, one by one otherwise. Guard band
+   extends frustum outwards, so that objects just outside of view still
+   cast shadows and appear in reflections. */
+
+class FrustumCuller
+{
+public:
+    struct alignas(16) Sphere
+    {
+        float x, y, z;
+        float radius;
+    };
+
+    explicit FrustumCuller(float guardBand = 0.f) noexcept;
+    void setPerspective(const rapid::float3& eye, const rapid::float3& center, const rapid::float3& up,
+        float fovY, float aspect, float zNear) noexcept;
+    void cull(const std::vector<Sphere>& spheres, std::vector<uint32_t>& visibleIndices) const;
+    void setGuardBand(float guardBand) noexcept { this->guardBand = guardBand; }
+    float getGuardBand() const noexcept { return guardBand; }
+
+private:
+    static constexpr int planeCount = 5; // Far plane is given by ray length
+
+    struct Plane
+    {
+        float nx, ny, nz, d;
+    };
+
+    Plane planes[planeCount];
+    float guardBand;
+};
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include "gpuProfiler.h"
+
+GpuProfiler::Scope::Scope(GpuProfiler& profiler, const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t frame, const char *name,
+    Queue queue /* Graphics */):
+    profiler(profiler),
+    cmdBuffer(cmdBuffer),
+    enabled(profiler.enabled && profiler.timestampMasks[queue]),
+    pool(profiler.getPoolIndex(queue, frame)),
+    index(enabled ? profiler.getScopeIndex(name) : 0)
+{
+    if (enabled)
+    {   // Queries have to be reset before every write, as command buffer may be submitted many times
+        profiler.writeTimestamp(cmdBuffer, pool, index * 2, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, true);
+    }
+}
+
+GpuProfiler::Scope::~Scope()
+{
+    if (enabled)
+        profiler.writeTimestamp(cmdBuffer, pool, index * 2 + 1, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, false);
+}
+
+GpuProfiler::GpuProfiler(std::shared_ptr<magma::Device> device, uint32_t graphicsQueueFamily, uint32_t computeQueueFamily,
+    uint32_t frameCount, bool enabled):
+    device(std::move(device)),
+    frameCount(frameCount),
+    timestampMasks{0ull, 0ull},
+    timestampPeriod(0.),
+    baseTimestamp(0),
+    resolvedFrames(0),
+    frameTime(0.f),
+    enabled(enabled)
+{
+    const VkPhysicalDeviceLimits& limits = this->device->getPhysicalDevice()->getProperties().limits;
+    if (enabled && !limits.timestampComputeAndGraphics)
+    {
+        std::cout << "timestamp queries not supported, profiling disabled" << std::endl;
+        this->enabled = false;
+    }
+    if (!this->enabled)
+        return;
+    const std::vector<VkQueueFamilyProperties> queueFamilies = this->device->getPhysicalDevice()->getQueueFamilyProperties();
+    const uint32_t queueFamilyIndices[QueueCount] = {graphicsQueueFamily, computeQueueFamily};
+    for (uint32_t queue = Graphics; queue < QueueCount; ++queue)
+    {   // Bits above timestampValidBits are undefined
+        const uint32_t validBits = queueFamilies[queueFamilyIndices[queue]].timestampValidBits;
+        timestampMasks[queue] = (validBits >= 64) ? ~0ull : ((1ull << validBits) - 1);
+    }
+    if (!timestampMasks[Graphics])
+    {
+        std::cout << "graphics queue doesn't support timestamps, profiling disabled" << std::endl;
+        this->enabled = false;
+        return;
+    }
+    if (!timestampMasks[Compute])
+        std::cout << "compute queue doesn't support timestamps, compute scopes are not profiled" << std::endl;
+    timestampPeriod = limits.timestampPeriod;
+    VkQueryPoolCreateInfo queryPoolInfo;
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.pNext = nullptr;
+    queryPoolInfo.flags = 0;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = maxScopes * 2;
+    queryPoolInfo.pipelineStatistics = 0;
+    for (uint32_t i = 0; i < frameCount * QueueCount; ++i)
+    {
+        VkQueryPool queryPool;
+        if (vkCreateQueryPool(this->device->getHandle(), &queryPoolInfo, nullptr, &queryPool) != VK_SUCCESS)
+            throw std::runtime_error("failed to create timestamp query pool");
+        queryPools.push_back(queryPool);
+        lastTimestamps.emplace_back(maxScopes * 2, 0ull);
+    }
+    scopes.reserve(maxScopes);
+}
+
+GpuProfiler::~GpuProfiler()
+{
+    for (VkQueryPool queryPool: queryPools)
+        vkDestroyQueryPool(device->getHandle(), queryPool, nullptr);
+}
+
+void GpuProfiler::reset(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{   // Queries should be reset before they can be read first time
+    for (VkQueryPool queryPool: queryPools)
+        vkCmdResetQueryPool(cmdBuffer->getHandle(), queryPool, 0, maxScopes * 2);
+}
+
+void GpuProfiler::resolve(uint32_t frame)
+{   // Called when GPU has finished the frame, so it never waits for results
+    frameTime = 0.f;
+    for (ScopeHistory& scope: scopes)
+        scope.lastDuration = 0.f;
+    if (!enabled || scopes.empty())
+        return;
+    // Compute work of the frame is a dependency of its graphics submission
+    for (uint32_t queue = Graphics; queue < QueueCount; ++queue)
+    {
+        if (timestampMasks[queue])
+            resolvePool(getPoolIndex(static_cast<Queue>(queue), frame), timestampMasks[queue]);
+    }
+    ++resolvedFrames;
+}
+
+void GpuProfiler::resolvePool(uint32_t pool, uint64_t timestampMask)
+{
+    const uint32_t queryCount = static_cast<uint32_t>(scopes.size()) * 2;
+    std::vector<uint64_t> results(queryCount * 2); // Timestamp and availability
+    const VkResult result = vkGetQueryPoolResults(device->getHandle(), queryPools[pool],
+        0, queryCount, results.size() * sizeof(uint64_t), results.data(), sizeof(uint64_t) * 2,
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if ((result != VK_SUCCESS) && (result != VK_NOT_READY))
+        throw std::runtime_error("failed to get query pool results");
+    std::vector<uint64_t>& lastFrameTimestamps = lastTimestamps[pool];
+    for (uint32_t i = 0; i < static_cast<uint32_t>(scopes.size()); ++i)
+    {
+        const uint64_t begin = results[i * 4] & timestampMask;
+        const uint64_t end = results[i * 4 + 2] & timestampMask;
+        const bool available = results[i * 4 + 1] && results[i * 4 + 3];
+        if (!available)
+            continue;
+        if ((begin == lastFrameTimestamps[i * 2]) && (end == lastFrameTimestamps[i * 2 + 1]))
+            continue; // Scope wasn't submitted again, e.g. one-time build
+        lastFrameTimestamps[i * 2] = begin;
+        lastFrameTimestamps[i * 2 + 1] = end;
+        if (!baseTimestamp)
+            baseTimestamp = begin;
+        const uint64_t ticks = (end - begin) & timestampMask; // Counter may wrap around
+        const double duration = ticks * timestampPeriod * 1e-3;
+        ScopeHistory& scope = scopes[i];
+        scope.durations[scope.next] = static_cast<float>(duration * 1e-3);
+        scope.lastDuration += scope.durations[scope.next];
+        frameTime += scope.durations[scope.next];
+        scope.next = (scope.next + 1) % historySize;
+        scope.sampleCount = std::min(scope.sampleCount + 1, historySize);
+        if ((events.size() < maxEvents) && (begin >= baseTimestamp))
+            events.push_back(Event{i, resolvedFrames, (begin - baseTimestamp) * timestampPeriod * 1e-3, duration});
+    }
+}
+
+std::vector<GpuProfiler::Statistics> GpuProfiler::getStatistics() const
+{
+    std::vector<Statistics> statistics;
+    for (const ScopeHistory& scope: scopes)
+    {
+        Statistics stats;
+        stats.name = scope.name;
+        stats.sampleCount = scope.sampleCount;
+        if (scope.sampleCount)
+        {
+            std::vector<float> durations(scope.durations.begin(), scope.durations.begin() + scope.sampleCount);
+            stats.min = *std::min_element(durations.begin(), durations.end());
+            stats.avg = std::accumulate(durations.begin(), durations.end(), 0.f) / durations.size();
+            auto p99 = durations.begin() + (durations.size() * 99) / 100;
+            std::nth_element(durations.begin(), p99, durations.end());
+            stats.p99 = *p99;
+        }
+        statistics.push_back(stats);
+    }
+    return statistics;
+}
+
+void GpuProfiler::printSummary(std::ostream& out) const
+{
+    for (const Statistics& stats: getStatistics())
+    {
+        out << std::setw(24) << std::left << stats.name << std::fixed << std::setprecision(3)
+            << " min " << stats.min << " ms, avg " << stats.avg << " ms, p99 " << stats.p99 << " ms ("
+            << stats.sampleCount << " samples)" << std::endl;
+    }
+    out.unsetf(std::ios::floatfield);
+}
+
+void GpuProfiler::exportCsv(const std::string& fileName) const
+{
+    std::ofstream file(fileName);
+    if (!file)
+        throw std::runtime_error("failed to write \"" + fileName + "\"");
+    file << "scope,samples,min,avg,p99" << std::endl;
+    for (const Statistics& stats: getStatistics())
+        file << stats.name << "," << stats.sampleCount << "," << stats.min << "," << stats.avg << "," << stats.p99 << std::endl;
+}
+
+void GpuProfiler::exportChromeTrace(const std::string& fileName) const
+{   // Can be opened in chrome://tracing or ui.perfetto.dev
+    std::ofstream file(fileName);
+    if (!file)
+        throw std::runtime_error("failed to write \"" + fileName + "\"");
+    file << "{\"traceEvents\":[" << std::endl << std::fixed << std::setprecision(3);
+    for (std::size_t i = 0; i < events.size(); ++i)
+    {
+        const Event& event = events[i];
+        file << "{\"name\":\"" << scopes[event.scope].name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0"
+            << ",\"ts\":" << event.start << ",\"dur\":" << event.duration
+            << ",\"args\":{\"frame\":" << event.frame << "}}"
+            << ((i + 1 < events.size()) ? "," : "") << std::endl;
+    }
+    file << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
+
+float GpuProfiler::getScopeTime(const char *name) const noexcept
+{
+    auto it = std::find_if(scopes.begin(), scopes.end(),
+        [name](const ScopeHistory& scope) { return scope.name == name; });
+    return (it != scopes.end()) ? it->lastDuration : 0.f;
+}
+
+uint32_t GpuProfiler::getScopeIndex(const char *name)
+{
+    auto it = std::find_if(scopes.begin(), scopes.end(),
+        [name](const ScopeHistory& scope) { return scope.name == name; });
+    if (it != scopes.end())
+        return static_cast<uint32_t>(std::distance(scopes.begin(), it));
+    if (scopes.size() == maxScopes)
+        throw std::runtime_error("too many profiler scopes");
+    ScopeHistory scope;
+    scope.name = name;
+    scope.durations.resize(historySize);
+    scopes.push_back(std::move(scope));
+    return static_cast<uint32_t>(scopes.size() - 1);
+}
+
+void GpuProfiler::writeTimestamp(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t pool,
+    uint32_t query, VkPipelineStageFlagBits stage, bool reset)
+{
+    const VkCommandBuffer commandBuffer = cmdBuffer->getHandle();
+    if (reset)
+        vkCmdResetQueryPool(commandBuffer, queryPools[pool], query, 2);
+    vkCmdWriteTimestamp(commandBuffer, stage, queryPools[pool], query);
+}
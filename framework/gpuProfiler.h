@@ -0,0 +1,97 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "magma/magma.h"
+
+/* Measures GPU time of command buffer scopes with timestamp queries.
+   Each frame in flight has its own query pool for every queue, which
+   results are read when CPU has waited for that frame anyway, so
+   profiling never stalls. Command buffers may be recorded once and
+   submitted many times. Timestamps are masked to valid bits of queue. */
+
+class GpuProfiler
+{
+public:
+    enum Queue : uint32_t
+    {
+        Graphics, Compute, QueueCount
+    };
+
+    struct Statistics
+    {
+        std::string name;
+        uint32_t sampleCount = 0;
+        float min = 0.f; // Milliseconds
+        float avg = 0.f;
+        float p99 = 0.f;
+    };
+
+    class Scope
+    {
+    public:
+        Scope(GpuProfiler& profiler, const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t frame, const char *name,
+            Queue queue = Graphics);
+        ~Scope();
+
+    private:
+        GpuProfiler& profiler;
+        const std::shared_ptr<magma::CommandBuffer>& cmdBuffer;
+        const bool enabled;
+        const uint32_t pool;
+        const uint32_t index;
+    };
+
+    GpuProfiler(std::shared_ptr<magma::Device> device, uint32_t graphicsQueueFamily, uint32_t computeQueueFamily,
+        uint32_t frameCount, bool enabled);
+    ~GpuProfiler();
+    bool isEnabled() const noexcept { return enabled; }
+    void reset(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
+    void resolve(uint32_t frame);
+    float getFrameTime() const noexcept { return frameTime; }
+    float getScopeTime(const char *name) const noexcept;
+    std::vector<Statistics> getStatistics() const;
+    void printSummary(std::ostream& out) const;
+    void exportCsv(const std::string& fileName) const;
+    void exportChromeTrace(const std::string& fileName) const;
+
+private:
+    struct Event
+    {
+        uint32_t scope;
+        uint64_t frame;
+        double start; // Microseconds
+        double duration;
+    };
+
+    struct ScopeHistory
+    {
+        std::string name;
+        std::vector<float> durations; // Ring buffer
+        uint32_t next = 0;
+        uint32_t sampleCount = 0;
+        float lastDuration = 0.f; // Zero if scope wasn't resolved last time
+    };
+
+    uint32_t getScopeIndex(const char *name);
+    uint32_t getPoolIndex(Queue queue, uint32_t frame) const noexcept { return queue * frameCount + frame; }
+    void resolvePool(uint32_t pool, uint64_t timestampMask);
+    void writeTimestamp(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t pool,
+        uint32_t query, VkPipelineStageFlagBits stage, bool reset);
+
+    static constexpr uint32_t maxScopes = 32;
+    static constexpr uint32_t historySize = 256;
+    static constexpr std::size_t maxEvents = 64 * 1024;
+
+    std::shared_ptr<magma::Device> device;
+    const uint32_t frameCount;
+    std::vector<VkQueryPool> queryPools; // Graphics pools, then compute pools
+    uint64_t timestampMasks[QueueCount]; // Zero if queue doesn't support timestamps
+    std::vector<std::vector<uint64_t>> lastTimestamps;
+    std::vector<ScopeHistory> scopes;
+    std::vector<Event> events;
+    double timestampPeriod; // Nanoseconds per tick
+    uint64_t baseTimestamp;
+    uint64_t resolvedFrames;
+    float frameTime; // Sum of scopes resolved last time
+    bool enabled;
+};
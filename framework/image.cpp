@@ -1,8 +1,11 @@
 #include "image.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "../third-party/stb/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../third-party/stb/stb_image_write.h"
 
-std::shared_ptr<magma::ImageView> loadImage(const std::string& fileName, std::shared_ptr<magma::CommandBuffer> cmdBuffer)
+std::shared_ptr<magma::ImageView> loadImage(const std::string& fileName, std::shared_ptr<magma::CommandBuffer> cmdBuffer,
+    std::shared_ptr<magma::Allocator> allocator /* nullptr */)
 {
     int width = 0, height = 0, channels = 0;
     unsigned char *data = stbi_load(fileName.c_str(), &width, &height, &channels, STBI_rgb_alpha);
@@ -15,14 +18,15 @@ std::shared_ptr<magma::ImageView> loadImage(const std::string& fileName, std::sh
         mip.texels = data;
         mip.size = width * height * sizeof(uint32_t);
         std::shared_ptr<magma::Image2D> image = std::make_shared<magma::Image2D>(cmdBuffer, VK_FORMAT_R8G8B8A8_UNORM,
-            std::vector<magma::Image::MipData>{mip}, nullptr, magma::Image::Initializer{}, magma::Sharing(), memcpy);
+            std::vector<magma::Image::MipData>{mip}, std::move(allocator), magma::Image::Initializer{}, magma::Sharing(), memcpy);
         stbi_image_free(data);
         return std::make_shared<magma::ImageView>(std::move(image));
     }
     return nullptr;
 }
 
-std::shared_ptr<magma::ImageView> loadBlankImage(std::shared_ptr<magma::CommandBuffer> cmdBuffer)
+std::shared_ptr<magma::ImageView> loadBlankImage(std::shared_ptr<magma::CommandBuffer> cmdBuffer,
+    std::shared_ptr<magma::Allocator> allocator /* nullptr */)
 {
     const uint8_t blank[4] = {0, 0, 0, 0};
     magma::Image::MipData mip;
@@ -32,6 +36,28 @@ std::shared_ptr<magma::ImageView> loadBlankImage(std::shared_ptr<magma::CommandB
     mip.texels = blank;
     mip.size = sizeof(uint32_t);
     std::shared_ptr<magma::Image2D> image = std::make_shared<magma::Image2D>(cmdBuffer, VK_FORMAT_R8G8B8A8_UNORM,
-        std::vector<magma::Image::MipData>{mip}, nullptr, magma::Image::Initializer{}, magma::Sharing(), memcpy);
+        std::vector<magma::Image::MipData>{mip}, std::move(allocator), magma::Image::Initializer{}, magma::Sharing(), memcpy);
     return std::make_shared<magma::ImageView>(std::move(image));
 }
+
+bool loadPixels(const std::string& fileName, std::vector<uint32_t>& pixels, uint32_t& width, uint32_t& height)
+{
+    int w = 0, h = 0, channels = 0;
+    unsigned char *data = stbi_load(fileName.c_str(), &w, &h, &channels, STBI_rgb_alpha);
+    if (!data)
+        return false;
+    width = static_cast<uint32_t>(w);
+    height = static_cast<uint32_t>(h);
+    pixels.resize(width * height);
+    memcpy(pixels.data(), data, pixels.size() * sizeof(uint32_t));
+    stbi_image_free(data);
+    return true;
+}
+
+bool savePixels(const std::string& fileName, const std::vector<uint32_t>& pixels, uint32_t width, uint32_t height)
+{
+    MAGMA_ASSERT(pixels.size() == width * height);
+    const int stride = static_cast<int>(width * sizeof(uint32_t));
+    return stbi_write_png(fileName.c_str(), static_cast<int>(width), static_cast<int>(height),
+        STBI_rgb_alpha, pixels.data(), stride) != 0;
+}
@@ -2,5 +2,9 @@
 #include "magma/magma.h"
 
 std::shared_ptr<magma::ImageView> loadImage(const std::string& fileName,
-    std::shared_ptr<magma::CommandBuffer> cmdBuffer);
-std::shared_ptr<magma::ImageView> loadBlankImage(std::shared_ptr<magma::CommandBuffer> cmdBuffer);
+    std::shared_ptr<magma::CommandBuffer> cmdBuffer,
+    std::shared_ptr<magma::Allocator> allocator = nullptr);
+std::shared_ptr<magma::ImageView> loadBlankImage(std::shared_ptr<magma::CommandBuffer> cmdBuffer,
+    std::shared_ptr<magma::Allocator> allocator = nullptr);
+bool loadPixels(const std::string& fileName, std::vector<uint32_t>& pixels, uint32_t& width, uint32_t& height);
+bool savePixels(const std::string& fileName, const std::vector<uint32_t>& pixels, uint32_t width, uint32_t height);
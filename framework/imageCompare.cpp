@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "imageCompare.h"
+
+namespace
+{
+struct Lab
+{
+    float L, a, b;
+};
+
+inline float linear(float cs) noexcept
+{
+    if (cs <= 0.04045f)
+        return cs / 12.92f;
+    return std::pow((cs + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float labCurve(float t) noexcept
+{
+    constexpr float delta = 6.f/29.f;
+    if (t > delta * delta * delta)
+        return std::cbrt(t);
+    return t / (3.f * delta * delta) + 4.f/29.f;
+}
+
+Lab rgbaToLab(uint32_t rgba) noexcept
+{   // Stored values are what the viewer sees, so treat them as sRGB
+    const float r = linear((rgba & 0xFF) / 255.f);
+    const float g = linear(((rgba >> 8) & 0xFF) / 255.f);
+    const float b = linear(((rgba >> 16) & 0xFF) / 255.f);
+    // Linear sRGB to XYZ (D65), normalized by white point
+    const float x = (0.4124f * r + 0.3576f * g + 0.1805f * b) / 0.95047f;
+    const float y = (0.2126f * r + 0.7152f * g + 0.0722f * b);
+    const float z = (0.0193f * r + 0.1192f * g + 0.9505f * b) / 1.08883f;
+    const float fx = labCurve(x);
+    const float fy = labCurve(y);
+    const float fz = labCurve(z);
+    return Lab{116.f * fy - 16.f, 500.f * (fx - fy), 200.f * (fy - fz)};
+}
+
+uint32_t heatColor(float error, float threshold) noexcept
+{   // Black below threshold, then blue -> green -> yellow -> red
+    if (error < threshold)
+        return 0xFF000000;
+    const float t = std::min((error - threshold) / (threshold * 4.f), 1.f);
+    float r, g, b;
+    if (t < 1.f/3.f)
+        r = 0.f, g = t * 3.f, b = 1.f - t * 3.f;
+    else if (t < 2.f/3.f)
+        r = (t - 1.f/3.f) * 3.f, g = 1.f, b = 0.f;
+    else
+        r = 1.f, g = 1.f - (t - 2.f/3.f) * 3.f, b = 0.f;
+    return 0xFF000000 |
+        (uint32_t(b * 255.f) << 16) |
+        (uint32_t(g * 255.f) << 8) |
+         uint32_t(r * 255.f);
+}
+} // namespace
+
+ImageDiff compareImages(const std::vector<uint32_t>& image, const std::vector<uint32_t>& reference,
+    uint32_t width, uint32_t height, float threshold)
+{
+    assert(image.size() == width * height);
+    assert(reference.size() == width * height);
+    ImageDiff diff;
+    diff.heatmap.resize(width * height);
+    double sum = 0.;
+    for (uint32_t i = 0, count = width * height; i < count; ++i)
+    {
+        const Lab p = rgbaToLab(image[i]);
+        const Lab q = rgbaToLab(reference[i]);
+        const float dL = p.L - q.L, da = p.a - q.a, db = p.b - q.b;
+        const float error = std::sqrt(dL * dL + da * da + db * db);
+        if (error > threshold)
+            ++diff.failedPixels;
+        diff.maxError = std::max(diff.maxError, error);
+        diff.heatmap[i] = heatColor(error, threshold);
+        sum += error;
+    }
+    diff.meanError = static_cast<float>(sum / (width * height));
+    return diff;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+struct ImageDiff
+{
+    float meanError = 0.f; // Mean CIE76 delta E
+    float maxError = 0.f;
+    uint32_t failedPixels = 0;
+    std::vector<uint32_t> heatmap;
+};
+
+ImageDiff compareImages(const std::vector<uint32_t>& image, const std::vector<uint32_t>& reference,
+    uint32_t width, uint32_t height, float threshold);
@@ -0,0 +1,54 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "instanceTracker.h"
+
+InstanceTracker::InstanceTracker(uint32_t instanceCount, float sceneRadius, float rebuildThreshold /* 0.5 */):
+    sceneRadius(std::max(sceneRadius, 1e-6f)),
+    rebuildThreshold(rebuildThreshold),
+    transforms(instanceCount, VkTransformMatrixKHR{}),
+    builtTransforms(instanceCount, VkTransformMatrixKHR{}),
+    modifiedCount(0)
+{}
+
+bool InstanceTracker::setTransform(uint32_t index, const VkTransformMatrixKHR& transform) noexcept
+{
+    MAGMA_ASSERT(index < transforms.size());
+    if (memcmp(&transforms[index], &transform, sizeof(VkTransformMatrixKHR)) == 0)
+        return false;
+    transforms[index] = transform;
+    ++modifiedCount;
+    return true;
+}
+
+bool InstanceTracker::rebuildRequired() const noexcept
+{
+    for (uint32_t i = 0, count = static_cast<uint32_t>(transforms.size()); i < count; ++i)
+    {
+        if (getMotion(i) > rebuildThreshold)
+            return true;
+    }
+    return false;
+}
+
+void InstanceTracker::commit(bool rebuilt) noexcept
+{
+    if (rebuilt)
+        builtTransforms = transforms;
+    modifiedCount = 0;
+}
+
+float InstanceTracker::getMotion(uint32_t index) const noexcept
+{   // Change of rotation/scale is dimensionless, translation is relative to scene size
+    const VkTransformMatrixKHR& transform = transforms[index];
+    const VkTransformMatrixKHR& builtTransform = builtTransforms[index];
+    float rotation = 0.f, translation = 0.f;
+    for (int row = 0; row < 3; ++row)
+    {
+        for (int col = 0; col < 3; ++col)
+            rotation = std::max(rotation, std::fabs(transform.matrix[row][col] - builtTransform.matrix[row][col]));
+        const float delta = transform.matrix[row][3] - builtTransform.matrix[row][3];
+        translation += delta * delta;
+    }
+    return rotation + std::sqrt(translation) / sceneRadius;
+}
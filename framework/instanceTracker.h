@@ -0,0 +1,29 @@
+#pragma once
+#include <vector>
+#include "magma/magma.h"
+
+/* Tracks transforms of top-level instances written to instance buffer.
+   Only transforms that actually changed are written, so that upload
+   copies modified ranges only and update is skipped when nothing moved.
+   Refitting keeps topology of the tree built for initial transforms,
+   so once instances moved too far from them, structure is rebuilt. */
+
+class InstanceTracker
+{
+public:
+    explicit InstanceTracker(uint32_t instanceCount, float sceneRadius, float rebuildThreshold = 0.5f);
+    bool setTransform(uint32_t index, const VkTransformMatrixKHR& transform) noexcept;
+    bool modified() const noexcept { return modifiedCount > 0; }
+    bool rebuildRequired() const noexcept;
+    void commit(bool rebuilt) noexcept;
+    uint32_t getModifiedCount() const noexcept { return modifiedCount; }
+
+private:
+    float getMotion(uint32_t index) const noexcept;
+
+    const float sceneRadius;
+    const float rebuildThreshold;
+    std::vector<VkTransformMatrixKHR> transforms;
+    std::vector<VkTransformMatrixKHR> builtTransforms; // At the time of last build
+    uint32_t modifiedCount;
+};
@@ -0,0 +1,117 @@
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "lodCache.h"
+#include "utilities.h"
+
+namespace
+{
+constexpr uint32_t cacheMagic = 0x444F4C56; // "VLOD"
+constexpr uint32_t cacheVersion = 1;
+}
+
+LodCache::LodCache(const std::string& directory):
+    directory(directory)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+}
+
+bool LodCache::load(uint64_t hash, uint32_t lodCount, std::vector<std::vector<uint32_t>>& levels)
+{
+    std::ifstream file(getFileName(hash), std::ios::in | std::ios::binary | std::ios::ate);
+    std::streamoff fileSize = 0;
+    Header header = {};
+    if (file.is_open())
+    {
+        fileSize = file.tellg();
+        file.seekg(0, std::ios::beg);
+        file.read(reinterpret_cast<char *>(&header), sizeof(Header));
+    }
+    if (!file || (header.magic != cacheMagic) || (header.version != cacheVersion) ||
+        (header.key != hash) || (header.lodCount != lodCount) ||
+        (header.size != static_cast<uint64_t>(fileSize) - sizeof(Header)) ||
+        (header.size < lodCount * sizeof(uint64_t)))
+    {   // Don't trust the size read from disk before allocating memory
+        ++statistics.misses;
+        return false;
+    }
+    std::vector<uint8_t> data(static_cast<std::size_t>(header.size));
+    file.read(reinterpret_cast<char *>(data.data()), data.size());
+    if (!file || (utilities::hash(data.data(), data.size()) != header.hash))
+    {   // Truncated or corrupted file
+        ++statistics.misses;
+        return false;
+    }
+    const uint64_t *indexCounts = reinterpret_cast<const uint64_t *>(data.data());
+    uint64_t totalCount = 0;
+    for (uint32_t lod = 0; lod < lodCount; ++lod)
+        totalCount += indexCounts[lod];
+    if (totalCount * sizeof(uint32_t) != header.size - lodCount * sizeof(uint64_t))
+    {
+        ++statistics.misses;
+        return false;
+    }
+    const uint32_t *indices = reinterpret_cast<const uint32_t *>(indexCounts + lodCount);
+    levels.clear();
+    for (uint32_t lod = 0; lod < lodCount; ++lod)
+    {
+        levels.emplace_back(indices, indices + indexCounts[lod]);
+        indices += indexCounts[lod];
+    }
+    ++statistics.hits;
+    return true;
+}
+
+void LodCache::store(uint64_t hash, const std::vector<std::vector<uint32_t>>& levels) const
+{
+    std::vector<uint8_t> data(levels.size() * sizeof(uint64_t));
+    for (std::size_t lod = 0; lod < levels.size(); ++lod)
+        reinterpret_cast<uint64_t *>(data.data())[lod] = levels[lod].size();
+    for (const std::vector<uint32_t>& indices: levels)
+    {
+        const uint8_t *indexData = reinterpret_cast<const uint8_t *>(indices.data());
+        data.insert(data.end(), indexData, indexData + indices.size() * sizeof(uint32_t));
+    }
+    Header header = {};
+    header.magic = cacheMagic;
+    header.version = cacheVersion;
+    header.key = hash;
+    header.hash = utilities::hash(data.data(), data.size());
+    header.lodCount = static_cast<uint32_t>(levels.size());
+    header.size = data.size();
+    const std::string fileName = getFileName(hash);
+    // Write to temporary file and replace the old one, so that reader never sees partial data
+    const std::string tmpFileName = fileName + ".tmp";
+    {
+        std::ofstream file(tmpFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {   // Cache is optional
+            std::cout << "failed to create file \"" << tmpFileName << "\"" << std::endl;
+            return;
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+        file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!file.flush())
+        {
+            std::cout << "failed to write file \"" << tmpFileName << "\"" << std::endl;
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpFileName, fileName, error);
+    if (error)
+    {
+        std::cout << "failed to replace file \"" << fileName << "\": " << error.message() << std::endl;
+        std::filesystem::remove(tmpFileName, error);
+    }
+}
+
+std::string LodCache::getFileName(uint64_t key) const
+{
+    std::ostringstream fileName;
+    fileName << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".lod";
+    return fileName.str();
+}
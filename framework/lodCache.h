@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/* Stores index buffers of simplified levels of detail on disk. Cache
+   file is keyed by hash of source vertices, indices and level count,
+   so quadric simplification runs only when mesh is loaded first time. */
+
+class LodCache
+{
+public:
+    struct Statistics
+    {
+        uint32_t hits = 0;
+        uint32_t misses = 0;
+    };
+
+    explicit LodCache(const std::string& directory);
+    bool load(uint64_t hash, uint32_t lodCount, std::vector<std::vector<uint32_t>>& levels);
+    void store(uint64_t hash, const std::vector<std::vector<uint32_t>>& levels) const;
+    const Statistics& getStatistics() const noexcept { return statistics; }
+
+private:
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        uint64_t hash; // Of index data
+        uint32_t lodCount;
+        uint32_t reserved;
+        uint64_t size; // Index counts of levels, then indices follow
+    };
+
+    std::string getFileName(uint64_t key) const;
+
+    std::string directory;
+    Statistics statistics;
+};
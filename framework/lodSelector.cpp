@@ -0,0 +1,29 @@
+#include <algorithm>
+#include <cmath>
+#include "lodSelector.h"
+
+LodSelector::LodSelector(uint32_t lodCount, float fovY, uint32_t viewportHeight,
+    float fullDetailSize /* 256 */, float hysteresis /* 0.1 */) noexcept:
+    lodCount(std::max(lodCount, 1U)),
+    fullDetailSize(fullDetailSize),
+    hysteresis(hysteresis),
+    pixelScale(viewportHeight / std::tan(fovY * 0.5f))
+{}
+
+float LodSelector::getProjectedSize(float radius, float distance) const noexcept
+{   // Diameter of bounding sphere in pixels
+    if (distance <= radius)
+        return fullDetailSize * 2.f; // Camera is inside of sphere
+    return radius * pixelScale / distance;
+}
+
+uint32_t LodSelector::select(float radius, float distance, uint32_t currentLod) const noexcept
+{
+    const float size = std::max(getProjectedSize(radius, distance), 1e-6f);
+    // Current level is kept for continuous level in [currentLod - hysteresis, currentLod + 1 + hysteresis)
+    const float level = std::log2(fullDetailSize / size);
+    if ((level >= currentLod - hysteresis) && (level < currentLod + 1 + hysteresis))
+        return std::min(currentLod, lodCount - 1);
+    const int lod = static_cast<int>(std::floor(level));
+    return static_cast<uint32_t>(std::max(0, std::min(lod, static_cast<int>(lodCount) - 1)));
+}
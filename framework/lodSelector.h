@@ -0,0 +1,23 @@
+#pragma once
+#include <cstdint>
+
+/* Selects level of detail of instance from projected size of its
+   bounding sphere. Full detail is used while sphere covers at least
+   given number of pixels, and each next level is used when projected
+   size halves. Level isn't switched until size leaves hysteresis band
+   around threshold, so that instance doesn't flicker between levels. */
+
+class LodSelector
+{
+public:
+    explicit LodSelector(uint32_t lodCount, float fovY, uint32_t viewportHeight,
+        float fullDetailSize = 256.f, float hysteresis = 0.1f) noexcept;
+    float getProjectedSize(float radius, float distance) const noexcept;
+    uint32_t select(float radius, float distance, uint32_t currentLod) const noexcept;
+
+private:
+    const uint32_t lodCount;
+    const float fullDetailSize;
+    const float hysteresis;
+    float pixelScale;
+};
@@ -15,7 +15,7 @@ void onError(
 }
 
 #ifdef MAGMA_NO_EXCEPTIONS
-void runApp(const AppEntry& entry)
+int runApp(const AppEntry& entry)
 {
     magma::exception::setExceptionHandler(
         [](const char *message, const magma::exception::source_where& where)
@@ -49,13 +49,15 @@ void runApp(const AppEntry& entry)
     std::unique_ptr<IApplication> app = appFactory(entry);
     app->show();
     app->run();
+    return app->getExitCode();
 }
 #else
-void runAppWithExceptionHandling(const AppEntry& entry) try
+int runAppWithExceptionHandling(const AppEntry& entry) try
 {
     std::unique_ptr<IApplication> app = appFactory(entry);
     app->show();
     app->run();
+    return app->getExitCode();
 }
 catch (const magma::exception::ErrorResult& exc)
 {
@@ -70,6 +72,7 @@ catch (const magma::exception::ErrorResult& exc)
             << exc.what();
     }
     onError(msg.str(), "Vulkan");
+    return EXIT_FAILURE;
 }
 catch (const magma::exception::ReflectionErrorResult& exc)
 {
@@ -84,6 +87,7 @@ catch (const magma::exception::ReflectionErrorResult& exc)
             << exc.what();
     }
     onError(msg.str(), "SPIRV-Reflect");
+    return EXIT_FAILURE;
 }
 catch (const magma::exception::Exception& exc)
 {
@@ -96,12 +100,14 @@ catch (const magma::exception::Exception& exc)
             << "Error: " << exc.what();
     }
     onError(msg.str(), "Magma");
+    return EXIT_FAILURE;
 }
 catch (const std::exception& exc)
 {
     std::ostringstream msg;
     msg << "Error: " << exc.what() << std::endl;
     onError(msg.str(), "Error");
+    return EXIT_FAILURE;
 }
 #endif // MAGMA_NO_EXCEPTIONS
 
@@ -122,9 +128,8 @@ int main(int argc, char *argv[])
     entry.argv = argv;
 #endif
 #ifdef MAGMA_NO_EXCEPTIONS
-    runApp(entry);
+    return runApp(entry);
 #else
-    runAppWithExceptionHandling(entry);
+    return runAppWithExceptionHandling(entry);
 #endif
-    return 0;
 }
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include "meshSimplifier.h"
+
+void MeshSimplifier::Quadric::addPlane(double nx, double ny, double nz, double d, double weight) noexcept
+{   // Upper triangle of symmetric 4x4 matrix of plane equation outer product
+    a[0] += weight * nx * nx; a[1] += weight * nx * ny; a[2] += weight * nx * nz; a[3] += weight * nx * d;
+    a[4] += weight * ny * ny; a[5] += weight * ny * nz; a[6] += weight * ny * d;
+    a[7] += weight * nz * nz; a[8] += weight * nz * d;
+    a[9] += weight * d * d;
+}
+
+void MeshSimplifier::Quadric::add(const Quadric& q) noexcept
+{
+    for (int i = 0; i < 10; ++i)
+        a[i] += q.a[i];
+}
+
+double MeshSimplifier::Quadric::evaluate(const float *p) const noexcept
+{
+    const double x = p[0], y = p[1], z = p[2];
+    return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+        a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y +
+        a[7] * z * z + 2 * a[8] * z +
+        a[9];
+}
+
+MeshSimplifier::MeshSimplifier(const void *vertices, std::size_t vertexCount, std::size_t vertexStride,
+    const std::vector<uint32_t>& indices):
+    vertices(reinterpret_cast<const uint8_t *>(vertices)),
+    vertexStride(vertexStride),
+    indices(indices),
+    quadrics(vertexCount),
+    remap(vertexCount),
+    versions(vertexCount, 0),
+    locked(vertexCount, false),
+    removedTriangles(indices.size() / 3, false),
+    vertexTriangles(vertexCount),
+    error(0.f)
+{
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        remap[i] = i;
+    std::unordered_map<uint64_t, uint32_t> edgeCounts;
+    const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+    for (uint32_t t = 0; t < triangleCount; ++t)
+    {
+        const uint32_t *tri = &indices[t * 3];
+        const float *p0 = getPosition(tri[0]);
+        const float *p1 = getPosition(tri[1]);
+        const float *p2 = getPosition(tri[2]);
+        const double e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+        const double e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+        double n[3] = {
+            e1[1] * e2[2] - e1[2] * e2[1],
+            e1[2] * e2[0] - e1[0] * e2[2],
+            e1[0] * e2[1] - e1[1] * e2[0]};
+        const double length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length > 0.)
+        {   // Plane is weighted by triangle area
+            n[0] /= length; n[1] /= length; n[2] /= length;
+            const double d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+            for (int i = 0; i < 3; ++i)
+                quadrics[tri[i]].addPlane(n[0], n[1], n[2], d, length * 0.5);
+        }
+        for (int i = 0; i < 3; ++i)
+        {
+            vertexTriangles[tri[i]].push_back(t);
+            const uint32_t a = std::min(tri[i], tri[(i + 1) % 3]);
+            const uint32_t b = std::max(tri[i], tri[(i + 1) % 3]);
+            ++edgeCounts[(uint64_t(a) << 32) | b];
+        }
+    }
+    for (const auto& it: edgeCounts)
+    {   // Open edge is either a border or a seam between split vertices
+        if (it.second != 2)
+        {
+            locked[static_cast<uint32_t>(it.first >> 32)] = true;
+            locked[static_cast<uint32_t>(it.first & 0xFFFFFFFF)] = true;
+        }
+    }
+}
+
+std::vector<uint32_t> MeshSimplifier::simplify(std::size_t targetIndexCount, float maxError /* 1e30 */)
+{
+    std::size_t indexCount = 0;
+    for (bool removed: removedTriangles)
+        indexCount += removed ? 0 : 3;
+    std::vector<Collapse> heap;
+    Collapse collapse;
+    for (uint32_t v = 0, count = static_cast<uint32_t>(remap.size()); v < count; ++v)
+    {
+        if (findCollapse(v, collapse))
+            heap.push_back(collapse);
+    }
+    std::make_heap(heap.begin(), heap.end());
+    while ((indexCount > targetIndexCount) && !heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end());
+        collapse = heap.back();
+        heap.pop_back();
+        if (collapse.cost > maxError)
+            break;
+        const uint32_t from = collapse.from;
+        const uint32_t to = find(collapse.to);
+        // Skip candidates that became stale after neighbourhood changed
+        if ((remap[from] != from) || (collapse.version != versions[from]) || (from == to))
+            continue;
+        if (flipsTriangle(from, to))
+            continue;
+        remap[from] = to;
+        quadrics[to].add(quadrics[from]);
+        for (uint32_t t: vertexTriangles[from])
+        {
+            if (removedTriangles[t])
+                continue;
+            uint32_t *tri = &indices[t * 3];
+            for (int i = 0; i < 3; ++i)
+                tri[i] = find(tri[i]);
+            if ((tri[0] == tri[1]) || (tri[1] == tri[2]) || (tri[0] == tri[2]))
+            {   // Triangle that shared collapsed edge degenerates
+                removedTriangles[t] = true;
+                indexCount -= 3;
+            }
+            else
+                vertexTriangles[to].push_back(t);
+        }
+        vertexTriangles[from].clear();
+        error = std::max(error, collapse.cost);
+        // Costs around merged vertex have changed, so previous candidates become stale
+        std::vector<uint32_t> neighbours(1, to);
+        for (uint32_t t: vertexTriangles[to])
+        {
+            if (!removedTriangles[t])
+                neighbours.insert(neighbours.end(), &indices[t * 3], &indices[t * 3] + 3);
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (uint32_t v: neighbours)
+        {
+            ++versions[v];
+            if (findCollapse(v, collapse))
+            {
+                heap.push_back(collapse);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    }
+    std::vector<uint32_t> simplifiedIndices;
+    simplifiedIndices.reserve(indexCount);
+    for (uint32_t t = 0, count = static_cast<uint32_t>(removedTriangles.size()); t < count; ++t)
+    {
+        if (!removedTriangles[t])
+        {
+            for (int i = 0; i < 3; ++i)
+                simplifiedIndices.push_back(find(indices[t * 3 + i]));
+        }
+    }
+    return simplifiedIndices;
+}
+
+const float *MeshSimplifier::getPosition(uint32_t vertex) const noexcept
+{   // Position should be the first member of vertex
+    return reinterpret_cast<const float *>(vertices + vertex * vertexStride);
+}
+
+uint32_t MeshSimplifier::find(uint32_t vertex) const noexcept
+{
+    while (remap[vertex] != vertex)
+        vertex = remap[vertex];
+    return vertex;
+}
+
+bool MeshSimplifier::flipsTriangle(uint32_t from, uint32_t to) const noexcept
+{
+    const float *target = getPosition(to);
+    for (uint32_t t: vertexTriangles[from])
+    {
+        if (removedTriangles[t])
+            continue;
+        uint32_t tri[3];
+        bool degenerates = false;
+        for (int i = 0; i < 3; ++i)
+        {
+            tri[i] = find(indices[t * 3 + i]);
+            degenerates |= (tri[i] == to);
+        }
+        if (degenerates)
+            continue; // Will be removed
+        const float *p[3], *q[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            p[i] = getPosition(tri[i]);
+            q[i] = (tri[i] == from) ? target : p[i];
+        }
+        float n0[3], n1[3];
+        for (int k = 0; k < 2; ++k)
+        {
+            const float *const *v = k ? q : p;
+            const float e1[3] = {v[1][0] - v[0][0], v[1][1] - v[0][1], v[1][2] - v[0][2]};
+            const float e2[3] = {v[2][0] - v[0][0], v[2][1] - v[0][1], v[2][2] - v[0][2]};
+            float *n = k ? n1 : n0;
+            n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+            n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+            n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+        }
+        if (n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2] <= 0.f)
+            return true;
+    }
+    return false;
+}
+
+bool MeshSimplifier::findCollapse(uint32_t vertex, Collapse& best) const noexcept
+{   // Vertex collapses onto the neighbour with the least error
+    if (locked[vertex] || (remap[vertex] != vertex))
+        return false;
+    best = {1e30f, vertex, vertex, versions[vertex]};
+    for (uint32_t t: vertexTriangles[vertex])
+    {
+        if (removedTriangles[t])
+            continue;
+        for (int i = 0; i < 3; ++i)
+        {
+            const uint32_t neighbour = find(indices[t * 3 + i]);
+            if (neighbour == vertex)
+                continue;
+            Quadric q = quadrics[vertex];
+            q.add(quadrics[neighbour]);
+            const float cost = static_cast<float>(std::max(0., q.evaluate(getPosition(neighbour))));
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.to = neighbour;
+            }
+        }
+    }
+    return best.to != vertex;
+}
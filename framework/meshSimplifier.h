@@ -0,0 +1,52 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+
+/* Simplifies indexed triangle mesh with quadric error metric edge
+   collapse (Garland and Heckbert). Vertex is collapsed onto one of its
+   neighbours, so simplified levels index the same vertex buffer and only
+   index buffer differs. Vertices on open edges and attribute seams
+   (where IndexedVertexArray keeps split vertices) are locked to preserve
+   silhouette and texture mapping. */
+
+class MeshSimplifier
+{
+public:
+    explicit MeshSimplifier(const void *vertices, std::size_t vertexCount, std::size_t vertexStride,
+        const std::vector<uint32_t>& indices);
+    std::vector<uint32_t> simplify(std::size_t targetIndexCount, float maxError = 1e30f);
+    float getError() const noexcept { return error; }
+
+private:
+    struct Quadric
+    {
+        double a[10] = {};
+        void addPlane(double nx, double ny, double nz, double d, double weight) noexcept;
+        void add(const Quadric& q) noexcept;
+        double evaluate(const float *p) const noexcept;
+    };
+
+    struct Collapse
+    {
+        float cost;
+        uint32_t from, to;
+        uint32_t version;
+        bool operator<(const Collapse& other) const noexcept { return cost > other.cost; }
+    };
+
+    const float *getPosition(uint32_t vertex) const noexcept;
+    uint32_t find(uint32_t vertex) const noexcept;
+    bool flipsTriangle(uint32_t from, uint32_t to) const noexcept;
+    bool findCollapse(uint32_t vertex, Collapse& best) const noexcept;
+
+    const uint8_t *vertices;
+    const std::size_t vertexStride;
+    std::vector<uint32_t> indices;
+    std::vector<Quadric> quadrics;
+    std::vector<uint32_t> remap;
+    std::vector<uint32_t> versions;
+    std::vector<bool> locked;
+    std::vector<bool> removedTriangles;
+    std::vector<std::vector<uint32_t>> vertexTriangles;
+    float error;
+};
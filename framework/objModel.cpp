@@ -1,3 +1,5 @@
+#include <cfloat>
+#include <cstring>
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "../third-party/tinyobjloader/tiny_obj_loader.h"
 #include "../third-party/rapid/rapid.h"
@@ -5,12 +7,35 @@
 #include "vertex.h"
 #include "packing.h"
 #include "indexedVertexArray.h"
+#include "meshSimplifier.h"
 #include "image.h"
+#include "accelerationStructureCache.h"
+#include "lodCache.h"
+#include "utilities.h"
+#include "buildBatcher.h"
+
+namespace
+{
+/* Structure built by CPU has to be stored in memory mapped to host */
+class HostBottomLevelAccelerationStructure : public magma::BottomLevelAccelerationStructure
+{
+public:
+    explicit HostBottomLevelAccelerationStructure(std::shared_ptr<magma::Device> device,
+        const std::list<magma::AccelerationStructureGeometry>& geometries,
+        VkBuildAccelerationStructureFlagsKHR buildFlags, std::shared_ptr<magma::Allocator> allocator):
+        magma::BottomLevelAccelerationStructure(std::move(device), geometries,
+            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR, buildFlags,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            std::move(allocator))
+    {}
+};
+}
 
 ObjMesh::ObjMesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib,
     const std::vector<tinyobj::material_t>& materials,
     std::shared_ptr<magma::CommandBuffer> cmdBuffer,
-    bool calculateNormals, bool swapYZ)
+    std::shared_ptr<magma::Allocator> allocator,
+    bool calculateNormals, bool swapYZ, bool keepHostData, uint32_t lodCount, bool splitStreams, LodCache *lodCache)
 {
     const int i1 = swapYZ ? 2 : 1;
     const int i2 = swapYZ ? 1 : 2;
@@ -64,12 +89,109 @@ ObjMesh::ObjMesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib,
         indexedVertices.changeWindingOrder();
     if (calculateNormals)
         calculateVertexNormals(indexedVertices.getVertices(), indexedVertices.getIndices());
-    vertexBuffer = std::make_shared<magma::AccelerationStructureInputBuffer>(cmdBuffer,
-        indexedVertices.getVertices().size_bytes(),
-        indexedVertices.getVertices().data());
-    indexBuffer = std::make_shared<magma::AccelerationStructureInputBuffer>(std::move(cmdBuffer),
-        indexedVertices.getIndices().size_bytes(),
-        indexedVertices.getIndices().data());
+    const vector<Vertex>& meshVertices = indexedVertices.getVertices();
+    bounds = {FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (const Vertex& v: meshVertices)
+    {
+        bounds.minX = std::min(bounds.minX, v.pos.x);
+        bounds.minY = std::min(bounds.minY, v.pos.y);
+        bounds.minZ = std::min(bounds.minZ, v.pos.z);
+        bounds.maxX = std::max(bounds.maxX, v.pos.x);
+        bounds.maxY = std::max(bounds.maxY, v.pos.y);
+        bounds.maxZ = std::max(bounds.maxZ, v.pos.z);
+    }
+    if (splitStreams)
+    {   // Dense positions feed acceleration structure build and face normals,
+        // attributes are fetched only by shaders that need them
+        std::vector<rapid::float3> positions;
+        std::vector<VertexAttributes> attributes;
+        positions.reserve(meshVertices.size());
+        attributes.reserve(meshVertices.size());
+        for (const Vertex& v: meshVertices)
+        {
+            positions.push_back(v.pos);
+            VertexAttributes a = {};
+            a.texCoord = v.texCoord;
+            memcpy(a.normal, v.normal, sizeof(a.normal));
+            memcpy(a.color, v.color, sizeof(a.color));
+            a.matId = v.matId;
+            attributes.push_back(a);
+        }
+        vertexBuffer = std::make_shared<magma::AccelerationStructureInputBuffer>(cmdBuffer,
+            positions.size() * sizeof(rapid::float3),
+            positions.data(),
+            allocator);
+        // Attributes are read only through buffer reference
+        magma::Buffer::Initializer initializer;
+        initializer.deviceAddress = true;
+        attributeBuffer = std::make_shared<magma::StorageBuffer>(cmdBuffer,
+            attributes.size() * sizeof(VertexAttributes),
+            attributes.data(),
+            allocator,
+            initializer);
+        vertexStride = sizeof(rapid::float3);
+        if (keepHostData)
+        {
+            const uint8_t *vertexData = reinterpret_cast<const uint8_t *>(positions.data());
+            hostVertices.assign(vertexData, vertexData + positions.size() * sizeof(rapid::float3));
+        }
+    }
+    else
+    {
+        vertexBuffer = std::make_shared<magma::AccelerationStructureInputBuffer>(cmdBuffer,
+            meshVertices.size_bytes(),
+            meshVertices.data(),
+            allocator);
+        vertexStride = sizeof(Vertex);
+        if (keepHostData)
+        {
+            const uint8_t *vertexData = reinterpret_cast<const uint8_t *>(meshVertices.data());
+            hostVertices.assign(vertexData, vertexData + meshVertices.size_bytes());
+        }
+    }
+    // Identifies geometry in acceleration structure cache
+    const uint64_t vertexHash = utilities::hash(meshVertices.data(), meshVertices.size_bytes());
+    const std::vector<uint32_t>& sourceIndices = indexedVertices.getIndices();
+    std::vector<std::vector<uint32_t>> levels;
+    uint64_t lodHash = utilities::hash(sourceIndices.data(), sourceIndices.size() * sizeof(uint32_t), vertexHash);
+    lodHash = utilities::hash(&lodCount, sizeof(uint32_t), lodHash);
+    if (lodCount == 1)
+        levels.push_back(sourceIndices);
+    else if (!lodCache || !lodCache->load(lodHash, lodCount, levels))
+    {   // Simplification is slow for large meshes, so levels are cached
+        MeshSimplifier simplifier(meshVertices.data(), meshVertices.size(), sizeof(Vertex), sourceIndices);
+        levels.push_back(sourceIndices);
+        for (uint32_t lod = 1; lod < lodCount; ++lod)
+        {   // Each level has a quarter of triangles, as its projected area is four times smaller
+            const std::size_t triangleCount = (sourceIndices.size() / 3) >> (2 * lod);
+            std::vector<uint32_t> simplifiedIndices = simplifier.simplify(std::max(triangleCount, std::size_t(1)) * 3);
+            if (simplifiedIndices.size() < levels.back().size())
+                levels.push_back(std::move(simplifiedIndices));
+            else
+                levels.push_back(levels.back());
+        }
+        if (lodCache)
+            lodCache->store(lodHash, levels);
+    }
+    for (uint32_t lod = 0; lod < lodCount; ++lod)
+    {
+        const std::vector<uint32_t>& indices = levels[lod];
+        if ((lod > 0) && (indices.size() * sizeof(uint32_t) == indexBuffers.back()->getSize()))
+        {   // Simplification is stuck on locked vertices, reuse previous level
+            indexBuffers.push_back(indexBuffers.back());
+            hashes.push_back(hashes.back());
+        }
+        else
+        {
+            indexBuffers.push_back(std::make_shared<magma::AccelerationStructureInputBuffer>(cmdBuffer,
+                indices.size() * sizeof(uint32_t),
+                indices.data(),
+                allocator));
+            hashes.push_back(utilities::hash(indices.data(), indices.size() * sizeof(uint32_t), vertexHash));
+        }
+        if (keepHostData)
+            hostIndices.push_back(indices);
+    }
 }
 
 void ObjMesh::calculateVertexNormals(std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices) const
@@ -103,7 +225,10 @@ void ObjMesh::calculateVertexNormals(std::vector<Vertex>& vertices, const std::v
 }
 
 ObjModel::ObjModel(const std::string& fileName, std::shared_ptr<magma::CommandBuffer> cmdBuffer,
-    bool calculateNormals /* false */, bool swapYZ /* false */)
+    std::shared_ptr<magma::Allocator> allocator, BuildBatcher& batcher, bool calculateNormals /* false */, bool swapYZ /* false */,
+    AccelerationStructureCache *cache /* nullptr */, uint32_t lodCount /* 1 */, bool splitStreams /* false */,
+    LodCache *lodCache /* nullptr */):
+    bounds{FLT_MAX, FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX}
 {
     tinyobj::attrib_t attrib;
     std::vector<tinyobj::shape_t> shapes;
@@ -126,53 +251,97 @@ ObjModel::ObjModel(const std::string& fileName, std::shared_ptr<magma::CommandBu
             std::cout << err;
         return;
     }
-    // Create triangle geometry for each shape
-    std::list<magma::AccelerationStructureGeometry> geometries;
+    if (batcher.isHostBuild())
+    {   // Serialization commands are recorded on device, but structure is built on host
+        cache = nullptr;
+    }
+    lodCount = std::max(lodCount, 1U);
     for (const tinyobj::shape_t& shape: shapes)
     {
-        const ObjMesh mesh(shape.mesh, attrib, materials, cmdBuffer, calculateNormals, swapYZ);
-        magma::AccelerationStructureGeometryTriangles triangles(
-            VK_FORMAT_R32G32B32_SFLOAT, mesh.getVertexBuffer(),
-            VK_INDEX_TYPE_UINT32, mesh.getIndexBuffer());
-        triangles.geometry.triangles.vertexStride = sizeof(Vertex);
-        triangles.geometry.triangles.maxVertex = static_cast<uint32_t>(mesh.getVertexBuffer()->getSize() / sizeof(Vertex));
-        geometries.push_back(triangles);
-        meshes.push_back(mesh);
+        meshes.emplace_back(shape.mesh, attrib, materials, cmdBuffer, allocator, calculateNormals, swapYZ, batcher.isHostBuild(), lodCount, splitStreams, lodCache);
+        const VkAabbPositionsKHR& meshBounds = meshes.back().getBounds();
+        bounds.minX = std::min(bounds.minX, meshBounds.minX);
+        bounds.minY = std::min(bounds.minY, meshBounds.minY);
+        bounds.minZ = std::min(bounds.minZ, meshBounds.minZ);
+        bounds.maxX = std::max(bounds.maxX, meshBounds.maxX);
+        bounds.maxY = std::max(bounds.maxY, meshBounds.maxY);
+        bounds.maxZ = std::max(bounds.maxZ, meshBounds.maxZ);
     }
-    // Create BLAS for all geometries
-    bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(cmdBuffer->getDevice(),
-        geometries,
-        VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
-    // Allocate scratch buffer
-    magma::Buffer::Initializer initializer;
-    initializer.deviceAddress = true;
-    std::shared_ptr<magma::Buffer> scratchBuffer = std::make_shared<magma::StorageBuffer>(
-        cmdBuffer->getDevice(), bottomLevel->getBuildScratchSize(), nullptr, initializer);
-    cmdBuffer->reset();
-    cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-    {   // Build BLAS on device
-        cmdBuffer->buildAccelerationStructure(bottomLevel, geometries, scratchBuffer);
-    }
-    cmdBuffer->end();
-    magma::finish(cmdBuffer);
+    // Create BLAS for each level of detail
+    for (uint32_t lod = 0; lod < lodCount; ++lod)
+        createAccelerationStructure(lod, cmdBuffer, allocator, batcher, cache);
     // Load materials
-    textureCache["blank"] = loadBlankImage(cmdBuffer);
+    textureCache["blank"] = loadBlankImage(cmdBuffer, allocator);
     for (const tinyobj::material_t& mat: materials)
     {
         ObjMaterial material;
-        material.ambientMap = loadTexture(mat.ambient_texname, directory, cmdBuffer);
-        material.diffuseMap = loadTexture(mat.diffuse_texname, directory, cmdBuffer);
-        material.specularMap = loadTexture(mat.specular_texname, directory, cmdBuffer);
-        material.bumpMap = loadTexture(mat.bump_texname, directory, cmdBuffer);
-        material.alphaMap = loadTexture(mat.alpha_texname, directory, cmdBuffer);
-        material.reflectionMap = loadTexture(mat.reflection_texname, directory, cmdBuffer);
+        material.ambientMap = loadTexture(mat.ambient_texname, directory, cmdBuffer, allocator);
+        material.diffuseMap = loadTexture(mat.diffuse_texname, directory, cmdBuffer, allocator);
+        material.specularMap = loadTexture(mat.specular_texname, directory, cmdBuffer, allocator);
+        material.bumpMap = loadTexture(mat.bump_texname, directory, cmdBuffer, allocator);
+        material.alphaMap = loadTexture(mat.alpha_texname, directory, cmdBuffer, allocator);
+        material.reflectionMap = loadTexture(mat.reflection_texname, directory, cmdBuffer, allocator);
         this->materials.push_back(material);
     }
 }
 
+void ObjModel::createAccelerationStructure(uint32_t lod, const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+    std::shared_ptr<magma::Allocator> allocator, BuildBatcher& batcher, AccelerationStructureCache *cache)
+{   // Create triangle geometry for each shape
+    std::list<magma::AccelerationStructureGeometry> geometries;
+    const std::size_t shapeCount = meshes.size();
+    uint64_t hash = utilities::hash(&shapeCount, sizeof(std::size_t));
+    for (const ObjMesh& mesh: meshes)
+    {
+        magma::AccelerationStructureGeometryTriangles triangles(
+            VK_FORMAT_R32G32B32_SFLOAT, mesh.getVertexBuffer(),
+            VK_INDEX_TYPE_UINT32, mesh.getIndexBuffer(lod));
+        triangles.geometry.triangles.vertexStride = mesh.getVertexStride();
+        triangles.geometry.triangles.maxVertex = static_cast<uint32_t>(mesh.getVertexBuffer()->getSize() / mesh.getVertexStride());
+        if (batcher.isHostBuild())
+        {   // Host build reads geometry from CPU memory
+            triangles.geometry.triangles.vertexData.hostAddress = mesh.getHostVertices().data();
+            triangles.geometry.triangles.indexData.hostAddress = mesh.getHostIndices(lod).data();
+        }
+        geometries.push_back(triangles);
+        const uint64_t meshHash = mesh.getHash(lod);
+        hash = utilities::hash(&meshHash, sizeof(uint64_t), hash);
+    }
+    // Create BLAS for all geometries
+    constexpr VkBuildAccelerationStructureFlagsKHR buildFlags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    std::shared_ptr<magma::BottomLevelAccelerationStructure> bottomLevel;
+    if (batcher.isHostBuild())
+    {
+        bottomLevel = std::make_shared<HostBottomLevelAccelerationStructure>(cmdBuffer->getDevice(),
+            geometries,
+            buildFlags,
+            std::move(allocator));
+    }
+    else
+    {
+        bottomLevel = std::make_shared<magma::BottomLevelAccelerationStructure>(cmdBuffer->getDevice(),
+            geometries,
+            VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+            buildFlags,
+            std::move(allocator));
+    }
+    if (!cache || !cache->load(bottomLevel, hash, buildFlags, cmdBuffer))
+    {   // Build is deferred until batch is flushed, then stored in cache
+        BuildBatcher::BuiltCallback onBuilt;
+        if (cache)
+        {
+            onBuilt = [cache, bottomLevel, hash, buildFlags, cmdBuffer](float buildTime)
+            {
+                cache->store(bottomLevel, hash, buildFlags, buildTime, cmdBuffer);
+            };
+        }
+        batcher.add(bottomLevel, geometries, std::move(onBuilt));
+    }
+    bottomLevels.push_back(std::move(bottomLevel));
+}
+
 std::shared_ptr<magma::ImageView> ObjModel::loadTexture(const std::string& name, const std::string& directory,
-    std::shared_ptr<magma::CommandBuffer> cmdBuffer)
+    std::shared_ptr<magma::CommandBuffer> cmdBuffer, std::shared_ptr<magma::Allocator> allocator)
 {
     if (name.empty())
         return textureCache["blank"];
@@ -180,7 +349,7 @@ std::shared_ptr<magma::ImageView> ObjModel::loadTexture(const std::string& name,
     auto it = textureCache.find(name);
     if (it != textureCache.end())
         return it->second;
-    auto texture = loadImage("../assets/meshes/" + directory + "/" + name, cmdBuffer);
+    auto texture = loadImage("../assets/meshes/" + directory + "/" + name, std::move(cmdBuffer), std::move(allocator));
     if (texture)
         return textureCache[name] = texture;
     return textureCache["blank"];
@@ -2,6 +2,9 @@
 #include "../third-party/magma/magma.h"
 
 struct Vertex;
+class AccelerationStructureCache;
+class LodCache;
+class BuildBatcher;
 
 namespace tinyobj
 {
@@ -16,15 +19,29 @@ public:
     explicit ObjMesh(const tinyobj::mesh_t& mesh, const tinyobj::attrib_t& attrib,
         const std::vector<tinyobj::material_t>& materials,
         std::shared_ptr<magma::CommandBuffer> cmdBuffer,
-        bool calculateNormals, bool swapYZ);
+        std::shared_ptr<magma::Allocator> allocator,
+        bool calculateNormals, bool swapYZ, bool keepHostData, uint32_t lodCount, bool splitStreams, LodCache *lodCache);
     const std::shared_ptr<magma::Buffer>& getVertexBuffer() const noexcept { return vertexBuffer; }
-    const std::shared_ptr<magma::Buffer>& getIndexBuffer() const noexcept { return indexBuffer; }
+    const std::shared_ptr<magma::Buffer>& getAttributeBuffer() const noexcept { return attributeBuffer; }
+    uint32_t getVertexStride() const noexcept { return vertexStride; }
+    const std::shared_ptr<magma::Buffer>& getIndexBuffer(uint32_t lod = 0) const noexcept { return indexBuffers[lod]; }
+    const std::vector<uint8_t>& getHostVertices() const noexcept { return hostVertices; }
+    const std::vector<uint32_t>& getHostIndices(uint32_t lod = 0) const noexcept { return hostIndices[lod]; }
+    uint64_t getHash(uint32_t lod = 0) const noexcept { return hashes[lod]; }
+    uint32_t getLodCount() const noexcept { return static_cast<uint32_t>(indexBuffers.size()); }
+    const VkAabbPositionsKHR& getBounds() const noexcept { return bounds; }
 
 private:
     void calculateVertexNormals(std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices) const;
 
-    std::shared_ptr<magma::Buffer> vertexBuffer;
-    std::shared_ptr<magma::Buffer> indexBuffer;
+    std::shared_ptr<magma::Buffer> vertexBuffer; // Positions only if streams are split
+    std::shared_ptr<magma::Buffer> attributeBuffer;
+    std::vector<std::shared_ptr<magma::Buffer>> indexBuffers; // Per level of detail, all index the same vertices
+    std::vector<uint8_t> hostVertices; // For build on host
+    std::vector<std::vector<uint32_t>> hostIndices;
+    std::vector<uint64_t> hashes;
+    VkAabbPositionsKHR bounds;
+    uint32_t vertexStride;
 };
 
 struct ObjMaterial
@@ -42,17 +59,23 @@ class ObjModel
 {
 public:
     explicit ObjModel(const std::string& fileName, std::shared_ptr<magma::CommandBuffer> cmdBuffer,
-        bool calculateNormals = false, bool swapYZ = false);
+        std::shared_ptr<magma::Allocator> allocator, BuildBatcher& batcher, bool calculateNormals = false, bool swapYZ = false,
+        AccelerationStructureCache *cache = nullptr, uint32_t lodCount = 1, bool splitStreams = false, LodCache *lodCache = nullptr);
     const std::list<ObjMesh>& getMeshes() const noexcept { return meshes; }
     const std::list<ObjMaterial>& getMaterials() const noexcept { return materials; }
-    const std::shared_ptr<magma::BottomLevelAccelerationStructure>& getAccelerationStructure() const noexcept { return bottomLevel; }
+    const std::shared_ptr<magma::BottomLevelAccelerationStructure>& getAccelerationStructure(uint32_t lod = 0) const noexcept { return bottomLevels[lod]; }
+    uint32_t getLodCount() const noexcept { return static_cast<uint32_t>(bottomLevels.size()); }
+    const VkAabbPositionsKHR& getBounds() const noexcept { return bounds; }
 
 private:
+    void createAccelerationStructure(uint32_t lod, const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+        std::shared_ptr<magma::Allocator> allocator, BuildBatcher& batcher, AccelerationStructureCache *cache);
     std::shared_ptr<magma::ImageView> loadTexture(const std::string& name, const std::string& directory,
-        std::shared_ptr<magma::CommandBuffer> cmdBuffer);
+        std::shared_ptr<magma::CommandBuffer> cmdBuffer, std::shared_ptr<magma::Allocator> allocator);
 
     std::list<ObjMesh> meshes;
     std::list<ObjMaterial> materials;
     std::map<std::string, std::shared_ptr<magma::ImageView>> textureCache;
-    std::shared_ptr<magma::BottomLevelAccelerationStructure> bottomLevel;
+    std::vector<std::shared_ptr<magma::BottomLevelAccelerationStructure>> bottomLevels; // Per level of detail
+    VkAabbPositionsKHR bounds;
 };
@@ -0,0 +1,138 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include "pipelineCache.h"
+#include "utilities.h"
+
+namespace
+{
+constexpr uint32_t cacheMagic = 0x43505456; // "VTPC"
+constexpr uint32_t cacheVersion = 1;
+
+VkPhysicalDeviceProperties getProperties(const magma::Device& device)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device.getPhysicalDevice()->getHandle(), &properties);
+    return properties;
+}
+}
+
+PipelineCache::PipelineCache(std::shared_ptr<magma::Device> device, const std::string& fileName):
+    PipelineCache(device, fileName, loadData(*device, fileName))
+{}
+
+PipelineCache::PipelineCache(std::shared_ptr<magma::Device> device, const std::string& fileName,
+    const std::vector<uint8_t>& data):
+    magma::PipelineCache(std::move(device), data.size(), data.empty() ? nullptr : data.data()),
+    fileName(fileName),
+    warm(!data.empty())
+{
+    if (warm)
+        std::cout << "pipeline cache loaded (" << data.size() / 1024 << " KB)" << std::endl;
+    else
+        std::cout << "pipeline cache is cold, shaders will be compiled" << std::endl;
+}
+
+void PipelineCache::save() const
+{
+    const VkDevice device = getDevice()->getHandle();
+    std::size_t size = 0;
+    if (vkGetPipelineCacheData(device, getHandle(), &size, nullptr) != VK_SUCCESS)
+        return;
+    std::vector<uint8_t> data(size);
+    if (vkGetPipelineCacheData(device, getHandle(), &size, data.data()) != VK_SUCCESS)
+        return;
+    data.resize(size);
+    Header header = {};
+    header.magic = cacheMagic;
+    header.version = cacheVersion;
+    header.driverVersion = getProperties(*getDevice()).driverVersion;
+    header.hash = utilities::hash(data.data(), data.size());
+    header.size = data.size();
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(fileName).parent_path(), error);
+    // Write to temporary file and replace the old one, so that reader never sees partial data
+    const std::string tmpFileName = fileName + ".tmp";
+    {
+        std::ofstream file(tmpFileName, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {   // Cache is optional
+            std::cout << "failed to create file \"" << tmpFileName << "\"" << std::endl;
+            return;
+        }
+        file.write(reinterpret_cast<const char *>(&header), sizeof(Header));
+        file.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!file.flush())
+        {
+            std::cout << "failed to write file \"" << tmpFileName << "\"" << std::endl;
+            return;
+        }
+    }
+    std::filesystem::rename(tmpFileName, fileName, error);
+    if (error)
+    {
+        std::cout << "failed to replace file \"" << fileName << "\": " << error.message() << std::endl;
+        std::filesystem::remove(tmpFileName, error);
+        return;
+    }
+    std::cout << "pipeline cache saved (" << data.size() / 1024 << " KB)" << std::endl;
+}
+
+void PipelineCache::logCreation(const char *pipelineType, float creationTime) const
+{
+    std::cout << std::fixed << std::setprecision(2)
+        << pipelineType << " pipeline created in " << creationTime << " ms ("
+        << (warm ? "warm" : "cold") << " cache)" << std::endl;
+    std::cout.unsetf(std::ios::floatfield);
+}
+
+float PipelineCreationTimer::getCreationTime() const noexcept
+{
+    const auto duration = std::chrono::high_resolution_clock::now() - start;
+    return std::chrono::duration<float, std::milli>(duration).count();
+}
+
+std::vector<uint8_t> PipelineCache::loadData(const magma::Device& device, const std::string& fileName)
+{
+    std::ifstream file(fileName, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return {};
+    const std::streamoff fileSize = file.tellg();
+    file.seekg(0, std::ios::beg);
+    Header header = {};
+    file.read(reinterpret_cast<char *>(&header), sizeof(Header));
+    const VkPhysicalDeviceProperties properties = getProperties(device);
+    if (!file || (header.magic != cacheMagic) || (header.version != cacheVersion) ||
+        (header.driverVersion != properties.driverVersion) ||
+        (header.size < sizeof(VkPipelineCacheHeaderVersionOne)))
+    {
+        std::cout << "pipeline cache was created by different driver, discard" << std::endl;
+        return {};
+    }
+    if (header.size != static_cast<uint64_t>(fileSize) - sizeof(Header))
+    {   // Don't trust the size read from disk before allocating memory
+        std::cout << "pipeline cache is truncated, discard" << std::endl;
+        return {};
+    }
+    std::vector<uint8_t> data(static_cast<std::size_t>(header.size));
+    file.read(reinterpret_cast<char *>(data.data()), data.size());
+    if (!file || (utilities::hash(data.data(), data.size()) != header.hash))
+    {   // Truncated or corrupted file
+        std::cout << "pipeline cache is corrupted, discard" << std::endl;
+        return {};
+    }
+    // Driver's own header identifies device that created the cache
+    VkPipelineCacheHeaderVersionOne cacheHeader;
+    memcpy(&cacheHeader, data.data(), sizeof(VkPipelineCacheHeaderVersionOne));
+    if ((cacheHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE) ||
+        (cacheHeader.vendorID != properties.vendorID) ||
+        (cacheHeader.deviceID != properties.deviceID) ||
+        memcmp(cacheHeader.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE))
+    {
+        std::cout << "pipeline cache was created by different device, discard" << std::endl;
+        return {};
+    }
+    return data;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <vector>
+#include "magma/magma.h"
+
+/* Pipeline cache that persists on disk between runs, so that shaders
+   aren't recompiled on every start. Loaded data is validated against
+   vendor, device, pipeline cache UUID and driver version, as driver may
+   reject or even crash on foreign data. File is written to temporary
+   one and renamed, so that interrupted save doesn't corrupt the cache. */
+
+class PipelineCache : public magma::PipelineCache
+{
+public:
+    explicit PipelineCache(std::shared_ptr<magma::Device> device, const std::string& fileName);
+    void save() const;
+    bool isWarm() const noexcept { return warm; }
+    void logCreation(const char *pipelineType, float creationTime) const;
+
+private:
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t driverVersion;
+        uint32_t reserved;
+        uint64_t hash;
+        uint64_t size; // Cache data follows
+    };
+
+    explicit PipelineCache(std::shared_ptr<magma::Device> device, const std::string& fileName,
+        const std::vector<uint8_t>& data);
+    static std::vector<uint8_t> loadData(const magma::Device& device, const std::string& fileName);
+
+    const std::string fileName;
+    const bool warm;
+};
+
+/* Private base of pipeline classes, which is constructed before
+   the pipeline itself, so shader loading and compilation are timed. */
+
+class PipelineCreationTimer
+{
+protected:
+    float getCreationTime() const noexcept;
+
+private:
+    const std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+};
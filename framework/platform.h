@@ -44,4 +44,10 @@ namespace std
         return std::to_string(val);
 #endif
     }
+
+#ifdef UNICODE
+    std::string to_utf8(const tstring& str); // Defined by platform app
+#else
+    inline std::string to_utf8(const tstring& str) { return str; }
+#endif
 }
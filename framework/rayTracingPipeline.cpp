@@ -1,44 +1,153 @@
-#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include "rayTracingPipeline.h"
+#include "shaderReflectionFactory.h"
+
+namespace
+{
+template<class Function>
+Function getDeviceProcAddr(VkDevice device, const char *name)
+{
+    Function function = reinterpret_cast<Function>(vkGetDeviceProcAddr(device, name));
+    if (!function)
+        throw std::runtime_error(std::string("failed to get ") + name);
+    return function;
+}
+}
 
 RayTracingPipeline::RayTracingPipeline(std::shared_ptr<magma::Device> device,
+    ShaderReflectionFactory& shaderReflectionFactory,
     const std::initializer_list<const char *> fileNames,
     const std::vector<magma::RayTracingShaderGroup>& shaderGroups,
     uint32_t maxPipelineRayRecursionDepth,
     std::shared_ptr<magma::PipelineLayout> layout,
+    std::shared_ptr<PipelineCache> pipelineCache /* null */,
+    std::shared_ptr<magma::IAllocator> allocator /* null */):
+    magma::RayTracingPipeline(device,
+        compileDeferred(device, loadShaders(shaderReflectionFactory, fileNames), shaderGroups, maxPipelineRayRecursionDepth, layout, pipelineCache),
+        shaderGroups,
+        maxPipelineRayRecursionDepth,
+        layout,
+        std::move(allocator),
+        pipelineCache)
+{
+    if (pipelineCache)
+        pipelineCache->logCreation("ray tracing", getCreationTime());
+}
+
+RayTracingPipeline::RayTracingPipeline(std::shared_ptr<magma::Device> device,
+    const std::vector<magma::PipelineShaderStage>& shaderStages,
+    const std::vector<magma::RayTracingShaderGroup>& shaderGroups,
+    uint32_t maxPipelineRayRecursionDepth,
+    std::shared_ptr<magma::PipelineLayout> layout,
+    std::shared_ptr<PipelineCache> pipelineCache /* null */,
     std::shared_ptr<magma::IAllocator> allocator /* null */):
     magma::RayTracingPipeline(device,
-        loadShaders(device, fileNames),
+        compileDeferred(device, shaderStages, shaderGroups, maxPipelineRayRecursionDepth, layout, pipelineCache),
         shaderGroups,
         maxPipelineRayRecursionDepth,
-        std::move(layout),
-        std::move(allocator))
-{}
+        layout,
+        std::move(allocator),
+        pipelineCache)
+{
+    if (pipelineCache)
+        pipelineCache->logCreation("ray tracing", getCreationTime());
+}
 
-std::vector<magma::PipelineShaderStage> RayTracingPipeline::loadShaders(std::shared_ptr<magma::Device> device,
+std::vector<magma::PipelineShaderStage> RayTracingPipeline::loadShaders(ShaderReflectionFactory& shaderReflectionFactory,
     const std::initializer_list<const char *> fileNames)
 {
-    std::vector<magma::PipelineShaderStage> shaderStages;
+    // Reading, module creation and reflection of each file are independent
+    std::vector<std::future<magma::PipelineShaderStage>> futures;
     for (auto const& fileName: fileNames)
-        shaderStages.push_back(loadShader(device, fileName));
+        futures.push_back(std::async(std::launch::async, loadShader, std::ref(shaderReflectionFactory), fileName));
+    std::vector<magma::PipelineShaderStage> shaderStages;
+    for (auto& future: futures)
+        shaderStages.push_back(future.get());
+    return shaderStages;
+}
+
+std::vector<magma::PipelineShaderStage> RayTracingPipeline::compileDeferred(const std::shared_ptr<magma::Device>& device,
+    std::vector<magma::PipelineShaderStage> shaderStages,
+    const std::vector<magma::RayTracingShaderGroup>& shaderGroups,
+    uint32_t maxPipelineRayRecursionDepth,
+    const std::shared_ptr<magma::PipelineLayout>& layout,
+    const std::shared_ptr<PipelineCache>& pipelineCache)
+{   // magma::RayTracingPipeline creates pipeline in its constructor, so it is compiled
+    // in advance as deferred operation joined by worker threads. Compiled pipeline is
+    // discarded, but its shaders stay in the cache, so second creation is a cache hit.
+    if (!pipelineCache)
+        return shaderStages;
+    const VkDevice handle = device->getHandle();
+    auto pfnCreateDeferredOperation = getDeviceProcAddr<PFN_vkCreateDeferredOperationKHR>(handle, "vkCreateDeferredOperationKHR");
+    auto pfnDestroyDeferredOperation = getDeviceProcAddr<PFN_vkDestroyDeferredOperationKHR>(handle, "vkDestroyDeferredOperationKHR");
+    auto pfnGetDeferredOperationMaxConcurrency = getDeviceProcAddr<PFN_vkGetDeferredOperationMaxConcurrencyKHR>(handle, "vkGetDeferredOperationMaxConcurrencyKHR");
+    auto pfnGetDeferredOperationResult = getDeviceProcAddr<PFN_vkGetDeferredOperationResultKHR>(handle, "vkGetDeferredOperationResultKHR");
+    auto pfnDeferredOperationJoin = getDeviceProcAddr<PFN_vkDeferredOperationJoinKHR>(handle, "vkDeferredOperationJoinKHR");
+    auto pfnCreateRayTracingPipelines = getDeviceProcAddr<PFN_vkCreateRayTracingPipelinesKHR>(handle, "vkCreateRayTracingPipelinesKHR");
+    const std::vector<VkPipelineShaderStageCreateInfo> stages(shaderStages.begin(), shaderStages.end());
+    const std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups(shaderGroups.begin(), shaderGroups.end());
+    VkRayTracingPipelineCreateInfoKHR pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+    pipelineInfo.pNext = nullptr;
+    pipelineInfo.flags = 0;
+    pipelineInfo.stageCount = static_cast<uint32_t>(stages.size());
+    pipelineInfo.pStages = stages.data();
+    pipelineInfo.groupCount = static_cast<uint32_t>(groups.size());
+    pipelineInfo.pGroups = groups.data();
+    pipelineInfo.maxPipelineRayRecursionDepth = maxPipelineRayRecursionDepth;
+    pipelineInfo.pLibraryInfo = nullptr;
+    pipelineInfo.pLibraryInterface = nullptr;
+    pipelineInfo.pDynamicState = nullptr;
+    pipelineInfo.layout = layout->getHandle();
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = -1;
+    VkDeferredOperationKHR operation;
+    if (pfnCreateDeferredOperation(handle, nullptr, &operation) != VK_SUCCESS)
+        throw std::runtime_error("failed to create deferred operation");
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult result = pfnCreateRayTracingPipelines(handle, operation, pipelineCache->getHandle(), 1, &pipelineInfo, nullptr, &pipeline);
+    if (VK_OPERATION_DEFERRED_KHR == result)
+    {   // VK_THREAD_IDLE_KHR means there is no work for now, but operation isn't complete
+        auto join = [handle, operation, pfnDeferredOperationJoin]()
+        {
+            while (pfnDeferredOperationJoin(handle, operation) == VK_THREAD_IDLE_KHR)
+                std::this_thread::yield();
+        };
+        const uint32_t threadCount = std::min(pfnGetDeferredOperationMaxConcurrency(handle, operation),
+            std::max(1U, std::thread::hardware_concurrency()));
+        std::vector<std::future<void>> workers;
+        for (uint32_t i = 1; i < threadCount; ++i)
+            workers.push_back(std::async(std::launch::async, join));
+        join(); // Calling thread participates too
+        for (auto& worker: workers)
+            worker.get();
+        result = pfnGetDeferredOperationResult(handle, operation);
+    }
+    else if (VK_OPERATION_NOT_DEFERRED_KHR == result)
+        result = VK_SUCCESS;
+    pfnDestroyDeferredOperation(handle, operation, nullptr);
+    if (pipeline != VK_NULL_HANDLE)
+        vkDestroyPipeline(handle, pipeline, nullptr);
+    if (result != VK_SUCCESS)
+        throw std::runtime_error("failed to compile ray tracing pipeline");
     return shaderStages;
 }
 
-magma::PipelineShaderStage RayTracingPipeline::loadShader(std::shared_ptr<magma::Device> device,
+std::shared_ptr<magma::ShaderModule> RayTracingPipeline::loadShaderModule(ShaderReflectionFactory& shaderReflectionFactory,
+    const char *fileName)
+{   // Factory reads bytecode and reflects it once per file
+    return shaderReflectionFactory.getShaderModule(fileName);
+}
+
+magma::PipelineShaderStage RayTracingPipeline::loadShader(ShaderReflectionFactory& shaderReflectionFactory,
     const char *fileName)
 {
-    const std::string ext = ".spv";
-    std::ifstream file(fileName + ext, std::ios::in | std::ios::binary);
-    if (!file.is_open())
-        throw std::runtime_error("file \"" + std::string(fileName) + ext + "\" not found");
-    std::vector<char> bytecode((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    if (bytecode.size() % sizeof(magma::SpirvWord))
-        throw std::runtime_error("size of \"" + std::string(fileName) + "\" bytecode must be a multiple of SPIR-V word");
-    auto allocator = device->getHostAllocator();
-    constexpr bool reflect = true;
-    std::shared_ptr<magma::ShaderModule> module(std::make_shared<magma::ShaderModule>(std::move(device),
-        reinterpret_cast<const magma::SpirvWord *>(bytecode.data()), bytecode.size(), 0,
-        std::move(allocator), reflect, 0));
+    std::shared_ptr<magma::ShaderModule> module = loadShaderModule(shaderReflectionFactory, fileName);
     const VkShaderStageFlagBits stage = module->getReflection()->getShaderStage();
     const char *const entrypoint = module->getReflection()->getEntryPointName(0);
     return magma::PipelineShaderStage(stage, std::move(module), entrypoint);
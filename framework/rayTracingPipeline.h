@@ -1,20 +1,41 @@
 #pragma once
 #include "magma/magma.h"
+#include "pipelineCache.h"
 
-class RayTracingPipeline : public magma::RayTracingPipeline
+class ShaderReflectionFactory;
+
+class RayTracingPipeline : private PipelineCreationTimer, public magma::RayTracingPipeline
 {
 public:
     explicit RayTracingPipeline(std::shared_ptr<magma::Device> device,
+        ShaderReflectionFactory& shaderReflectionFactory,
         const std::initializer_list<const char *> fileNames,
         const std::vector<magma::RayTracingShaderGroup>& shaderGroups,
         uint32_t maxPipelineRayRecursionDepth,
         std::shared_ptr<magma::PipelineLayout> layout,
+        std::shared_ptr<PipelineCache> pipelineCache = nullptr,
+        std::shared_ptr<magma::IAllocator> allocator = nullptr);
+    explicit RayTracingPipeline(std::shared_ptr<magma::Device> device,
+        const std::vector<magma::PipelineShaderStage>& shaderStages,
+        const std::vector<magma::RayTracingShaderGroup>& shaderGroups,
+        uint32_t maxPipelineRayRecursionDepth,
+        std::shared_ptr<magma::PipelineLayout> layout,
+        std::shared_ptr<PipelineCache> pipelineCache = nullptr,
         std::shared_ptr<magma::IAllocator> allocator = nullptr);
+    static std::shared_ptr<magma::ShaderModule> loadShaderModule(
+        ShaderReflectionFactory& shaderReflectionFactory, const char *fileName);
+    static magma::PipelineShaderStage loadShader(
+        ShaderReflectionFactory& shaderReflectionFactory, const char *fileName);
 
 private:
     static std::vector<magma::PipelineShaderStage> loadShaders(
-        std::shared_ptr<magma::Device> device,
+        ShaderReflectionFactory& shaderReflectionFactory,
         const std::initializer_list<const char *> fileNames);
-    static magma::PipelineShaderStage loadShader(
-        std::shared_ptr<magma::Device> device, const char *fileName);
+    static std::vector<magma::PipelineShaderStage> compileDeferred(
+        const std::shared_ptr<magma::Device>& device,
+        std::vector<magma::PipelineShaderStage> shaderStages,
+        const std::vector<magma::RayTracingShaderGroup>& shaderGroups,
+        uint32_t maxPipelineRayRecursionDepth,
+        const std::shared_ptr<magma::PipelineLayout>& layout,
+        const std::shared_ptr<PipelineCache>& pipelineCache);
 };
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <stdexcept>
+#include "scratchAllocator.h"
+
+namespace
+{
+constexpr VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) noexcept
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+}
+
+ScratchAllocator::ScratchAllocator(std::shared_ptr<magma::Device> device, const TimelineScheduler *scheduler,
+    std::shared_ptr<magma::Allocator> allocator /* nullptr */):
+    device(std::move(device)),
+    scheduler(scheduler),
+    allocator(std::move(allocator)),
+    baseAddress(0),
+    alignment(1),
+    capacity(0),
+    offset(0),
+    peakUsage(0),
+    unreleased(false)
+{
+    pfnCmdBuildAccelerationStructures = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(
+        vkGetDeviceProcAddr(this->device->getHandle(), "vkCmdBuildAccelerationStructuresKHR"));
+    if (!pfnCmdBuildAccelerationStructures)
+        throw std::runtime_error("failed to get vkCmdBuildAccelerationStructuresKHR");
+    // Scratch address of each build should be aligned
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties;
+    accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+    accelerationStructureProperties.pNext = nullptr;
+    VkPhysicalDeviceProperties2 properties;
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &accelerationStructureProperties;
+    vkGetPhysicalDeviceProperties2(this->device->getPhysicalDevice()->getHandle(), &properties);
+    alignment = std::max(VkDeviceSize(1), VkDeviceSize(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment));
+}
+
+VkDeviceAddress ScratchAllocator::allocate(VkDeviceSize size)
+{
+    size = alignUp(size, alignment);
+    if (offset + size > capacity)
+    {   // Start over if previous builds are complete
+        const bool recycled = recycle();
+        if (offset + size > capacity)
+        {   // Grow geometrically, but keep buffer in use until its builds are complete
+            if (buffer && !recycled)
+                retiredBuffers.push_back(buffer);
+            reallocate(std::max(capacity * 2, size));
+        }
+    }
+    const VkDeviceAddress address = baseAddress + offset;
+    offset += size;
+    peakUsage = std::max(peakUsage, offset);
+    unreleased = true;
+    return address;
+}
+
+void ScratchAllocator::release(const TimelineScheduler::SyncPoint& syncPoint)
+{   // Ranges allocated so far may be reused when sync point is reached
+    pendingSyncPoints.erase(std::remove_if(pendingSyncPoints.begin(), pendingSyncPoints.end(),
+        [this](const TimelineScheduler::SyncPoint& pending)
+        {
+            return scheduler->reached(pending);
+        }),
+        pendingSyncPoints.end());
+    if (!scheduler->reached(syncPoint))
+        pendingSyncPoints.push_back(syncPoint);
+    unreleased = false;
+}
+
+void ScratchAllocator::shrink()
+{
+    if (!buffer || !recycle())
+        return;
+    if (!peakUsage)
+        reallocate(0); // No builds since last call, free memory
+    else if (peakUsage <= capacity / 4)
+        reallocate(peakUsage);
+    peakUsage = 0;
+}
+
+void ScratchAllocator::buildAccelerationStructure(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+    const std::shared_ptr<magma::AccelerationStructure>& accelerationStructure,
+    const std::list<magma::AccelerationStructureGeometry>& geometries)
+{
+    std::vector<VkAccelerationStructureGeometryKHR> buildGeometries;
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> buildRanges;
+    buildGeometries.reserve(geometries.size());
+    buildRanges.reserve(geometries.size());
+    for (const magma::AccelerationStructureGeometry& geometry: geometries)
+    {
+        buildGeometries.push_back(geometry);
+        buildRanges.push_back({geometry.primitiveCount, 0, 0, 0});
+    }
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo;
+    buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+    buildInfo.pNext = nullptr;
+    buildInfo.type = (VK_GEOMETRY_TYPE_INSTANCES_KHR == geometries.front().geometryType)
+        ? VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR
+        : VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    buildInfo.flags = accelerationStructure->getBuildFlags();
+    buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
+    buildInfo.dstAccelerationStructure = accelerationStructure->getHandle();
+    buildInfo.geometryCount = static_cast<uint32_t>(buildGeometries.size());
+    buildInfo.pGeometries = buildGeometries.data();
+    buildInfo.ppGeometries = nullptr;
+    buildInfo.scratchData.deviceAddress = allocate(accelerationStructure->getBuildScratchSize());
+    const VkAccelerationStructureBuildRangeInfoKHR *buildRangeInfos = buildRanges.data();
+    pfnCmdBuildAccelerationStructures(cmdBuffer->getHandle(), 1, &buildInfo, &buildRangeInfos);
+}
+
+bool ScratchAllocator::recycle()
+{
+    if (unreleased)
+        return false; // Allocated ranges haven't been submitted yet
+    for (const TimelineScheduler::SyncPoint& syncPoint: pendingSyncPoints)
+    {
+        if (!scheduler->reached(syncPoint))
+            return false;
+    }
+    pendingSyncPoints.clear();
+    retiredBuffers.clear();
+    offset = 0;
+    return true;
+}
+
+void ScratchAllocator::reallocate(VkDeviceSize size)
+{
+    buffer.reset();
+    baseAddress = 0;
+    capacity = 0;
+    offset = 0;
+    if (size)
+    {   // Reserve space to align base address
+        magma::Buffer::Initializer initializer;
+        initializer.deviceAddress = true;
+        buffer = std::make_shared<magma::StorageBuffer>(device, size + alignment, allocator, initializer);
+        baseAddress = alignUp(buffer->getDeviceAddress(), alignment);
+        capacity = size;
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <list>
+#include <vector>
+#include "magma/magma.h"
+#include "timelineScheduler.h"
+
+/* Sub-allocates scratch memory of acceleration structure builds from
+   a single growable buffer. Ranges are bump-allocated, so concurrent
+   builds recorded into the same command buffer don't overlap. Memory
+   is recycled once submissions that used it are complete, and buffer
+   is shrunk or freed when builds become rare. */
+
+class ScratchAllocator
+{
+public:
+    explicit ScratchAllocator(std::shared_ptr<magma::Device> device, const TimelineScheduler *scheduler,
+        std::shared_ptr<magma::Allocator> allocator = nullptr);
+    VkDeviceAddress allocate(VkDeviceSize size);
+    void release(const TimelineScheduler::SyncPoint& syncPoint);
+    void shrink();
+    void buildAccelerationStructure(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+        const std::shared_ptr<magma::AccelerationStructure>& accelerationStructure,
+        const std::list<magma::AccelerationStructureGeometry>& geometries);
+    VkDeviceSize getAlignment() const noexcept { return alignment; }
+    VkDeviceSize getCapacity() const noexcept { return capacity; }
+
+private:
+    bool recycle();
+    void reallocate(VkDeviceSize size);
+
+    std::shared_ptr<magma::Device> device;
+    const TimelineScheduler *scheduler;
+    std::shared_ptr<magma::Allocator> allocator;
+    std::shared_ptr<magma::Buffer> buffer;
+    std::vector<std::shared_ptr<magma::Buffer>> retiredBuffers; // Still referenced by recorded builds
+    std::vector<TimelineScheduler::SyncPoint> pendingSyncPoints;
+    VkDeviceAddress baseAddress;
+    VkDeviceSize alignment;
+    VkDeviceSize capacity;
+    VkDeviceSize offset;
+    VkDeviceSize peakUsage; // Since last shrink
+    bool unreleased;
+    PFN_vkCmdBuildAccelerationStructuresKHR pfnCmdBuildAccelerationStructures;
+};
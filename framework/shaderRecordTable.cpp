@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "shaderRecordTable.h"
+
+namespace
+{
+constexpr VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) noexcept
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+template<class Function>
+Function getDeviceProcAddr(VkDevice device, const char *name)
+{
+    Function function = reinterpret_cast<Function>(vkGetDeviceProcAddr(device, name));
+    if (!function)
+        throw std::runtime_error(std::string("failed to get ") + name);
+    return function;
+}
+
+/* Device local buffer, which can be addressed as shader binding table */
+class ShaderRecordBuffer : public magma::Buffer
+{
+public:
+    explicit ShaderRecordBuffer(std::shared_ptr<magma::Device> device, VkDeviceSize size,
+        std::shared_ptr<magma::Allocator> allocator, const Initializer& optional):
+        magma::Buffer(std::move(device), size, 0,
+            VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, optional, magma::Sharing(), std::move(allocator))
+    {}
+};
+}
+
+ShaderRecordTable::ShaderRecordTable(std::shared_ptr<magma::Device> device,
+    std::shared_ptr<magma::Allocator> allocator /* nullptr */):
+    device(std::move(device)),
+    allocator(std::move(allocator)),
+    regions{},
+    regionOffsets{},
+    bufferOffset(0),
+    dirtyBegin(0),
+    dirtyEnd(0)
+{
+    const VkDevice handle = this->device->getHandle();
+    pfnGetRayTracingShaderGroupHandles = getDeviceProcAddr<PFN_vkGetRayTracingShaderGroupHandlesKHR>(handle, "vkGetRayTracingShaderGroupHandlesKHR");
+    pfnCmdTraceRays = getDeviceProcAddr<PFN_vkCmdTraceRaysKHR>(handle, "vkCmdTraceRaysKHR");
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties;
+    rayTracingPipelineProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
+    rayTracingPipelineProperties.pNext = nullptr;
+    VkPhysicalDeviceProperties2 properties;
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &rayTracingPipelineProperties;
+    vkGetPhysicalDeviceProperties2(this->device->getPhysicalDevice()->getHandle(), &properties);
+    handleSize = rayTracingPipelineProperties.shaderGroupHandleSize;
+    handleAlignment = std::max(1U, rayTracingPipelineProperties.shaderGroupHandleAlignment);
+    baseAlignment = std::max(1U, rayTracingPipelineProperties.shaderGroupBaseAlignment);
+    maxStride = rayTracingPipelineProperties.maxShaderGroupStride;
+}
+
+uint32_t ShaderRecordTable::addRecord(VkShaderStageFlagBits stage, uint32_t groupIndex,
+    const void *data /* nullptr */, std::size_t size /* 0 */)
+{
+    std::vector<Record>& regionRecords = records[getRegion(stage)];
+    Record record;
+    record.groupIndex = groupIndex;
+    if (data)
+    {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        record.data.assign(bytes, bytes + size);
+    }
+    regionRecords.push_back(std::move(record));
+    return static_cast<uint32_t>(regionRecords.size() - 1);
+}
+
+void ShaderRecordTable::updateRecord(VkShaderStageFlagBits stage, uint32_t recordIndex, const void *data, std::size_t size)
+{
+    const Region region = getRegion(stage);
+    Record& record = records[region].at(recordIndex);
+    if (size > record.data.size())
+        throw std::runtime_error("shader record data can't grow after build");
+    memcpy(record.data.data(), data, size);
+    if (hostData.empty())
+        return; // Not built yet
+    const VkDeviceSize offset = regionOffsets[region] + regions[region].stride * recordIndex + handleSize;
+    memcpy(hostData.data() + offset, data, size);
+    if (dirtyBegin == dirtyEnd)
+    {
+        dirtyBegin = offset;
+        dirtyEnd = offset + size;
+    }
+    else
+    {
+        dirtyBegin = std::min(dirtyBegin, offset);
+        dirtyEnd = std::max(dirtyEnd, offset + size);
+    }
+}
+
+void ShaderRecordTable::build(const std::shared_ptr<magma::RayTracingPipeline>& pipeline,
+    const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{   // Stride of each region fits its largest record
+    VkDeviceSize size = 0;
+    for (uint32_t region = Raygen; region < RegionCount; ++region)
+    {
+        std::size_t maxDataSize = 0;
+        for (const Record& record: records[region])
+            maxDataSize = std::max(maxDataSize, record.data.size());
+        const VkDeviceSize stride = alignUp(handleSize + maxDataSize, handleAlignment);
+        if (stride > maxStride)
+            throw std::runtime_error("shader record size exceeds maximum group stride");
+        regionOffsets[region] = alignUp(size, baseAlignment);
+        regions[region].stride = stride;
+        regions[region].size = stride * records[region].size();
+        size = regionOffsets[region] + regions[region].size;
+    }
+    // Raygen region has single record, so its size should be equal to stride
+    if (records[Raygen].size() != 1)
+        throw std::runtime_error("shader record table should have single raygen record");
+    // Updates are recorded with vkCmdUpdateBuffer() that requires multiple of 4
+    hostData.assign(static_cast<std::size_t>(alignUp(size, 4)), 0);
+    for (uint32_t region = Raygen; region < RegionCount; ++region)
+    {
+        uint8_t *recordData = hostData.data() + regionOffsets[region];
+        for (const Record& record: records[region])
+        {
+            const VkResult result = pfnGetRayTracingShaderGroupHandles(device->getHandle(), pipeline->getHandle(),
+                record.groupIndex, 1, handleSize, recordData);
+            if (result != VK_SUCCESS)
+                throw std::runtime_error("failed to get shader group handle");
+            if (!record.data.empty())
+                memcpy(recordData + handleSize, record.data.data(), record.data.size());
+            recordData += regions[region].stride;
+        }
+    }
+    // Sub-allocated buffer may be not aligned, so reserve space to align base address
+    magma::Buffer::Initializer initializer;
+    initializer.deviceAddress = true;
+    buffer = std::make_shared<ShaderRecordBuffer>(device, hostData.size() + baseAlignment, allocator, initializer);
+    const VkDeviceAddress baseAddress = alignUp(buffer->getDeviceAddress(), baseAlignment);
+    bufferOffset = baseAddress - buffer->getDeviceAddress();
+    auto srcBuffer = std::make_shared<magma::SrcTransferBuffer>(device, hostData.size(), hostData.data(), allocator);
+    cmdBuffer->reset();
+    cmdBuffer->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    const VkBufferCopy region = {0, bufferOffset, hostData.size()};
+    vkCmdCopyBuffer(cmdBuffer->getHandle(), srcBuffer->getHandle(), buffer->getHandle(), 1, &region);
+    cmdBuffer->end();
+    magma::finish(cmdBuffer);
+    for (uint32_t region = Raygen; region < RegionCount; ++region)
+    {
+        if (records[region].empty())
+            regions[region] = VkStridedDeviceAddressRegionKHR{0, 0, 0};
+        else
+            regions[region].deviceAddress = baseAddress + regionOffsets[region];
+    }
+    dirtyBegin = dirtyEnd = 0;
+}
+
+bool ShaderRecordTable::update(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{
+    if (dirtyBegin == dirtyEnd)
+        return false;
+    // Frames submitted earlier to the same queue may still read the table
+    cmdBuffer->pipelineBarrier(
+        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        magma::MemoryBarrier(VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT));
+    VkDeviceSize offset = dirtyBegin & ~VkDeviceSize(3);
+    const VkDeviceSize end = alignUp(dirtyEnd, 4);
+    constexpr VkDeviceSize maxUpdateSize = 65536;
+    while (offset < end)
+    {
+        const VkDeviceSize size = std::min(end - offset, maxUpdateSize);
+        vkCmdUpdateBuffer(cmdBuffer->getHandle(), buffer->getHandle(), bufferOffset + offset, size, hostData.data() + offset);
+        offset += size;
+    }
+    cmdBuffer->pipelineBarrier(
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        magma::MemoryBarrier(VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT));
+    dirtyBegin = dirtyEnd = 0;
+    return true;
+}
+
+void ShaderRecordTable::traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+    uint32_t width, uint32_t height, uint32_t depth) const
+{
+    pfnCmdTraceRays(cmdBuffer->getHandle(), &regions[Raygen], &regions[Miss], &regions[Hit], &regions[Callable],
+        width, height, depth);
+}
+
+ShaderRecordTable::Region ShaderRecordTable::getRegion(VkShaderStageFlagBits stage)
+{
+    switch (stage)
+    {
+    case VK_SHADER_STAGE_RAYGEN_BIT_KHR:
+        return Raygen;
+    case VK_SHADER_STAGE_MISS_BIT_KHR:
+        return Miss;
+    case VK_SHADER_STAGE_ANY_HIT_BIT_KHR:
+    case VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR:
+    case VK_SHADER_STAGE_INTERSECTION_BIT_KHR:
+        return Hit;
+    case VK_SHADER_STAGE_CALLABLE_BIT_KHR:
+        return Callable;
+    default:
+        throw std::runtime_error("invalid shader record stage");
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include "magma/magma.h"
+
+/* Shader binding table that packs inline data of each record after its
+   group handle, so that shaders read material parameters, texture
+   indices or buffer addresses from shaderRecordEXT without indirection.
+   Records are laid out by group handle size and alignment, and regions
+   by base alignment of the device. Data of individual records can be
+   changed after build; only modified range is uploaded by update(),
+   which has to be recorded for the queue that traces rays. */
+
+class ShaderRecordTable
+{
+public:
+    explicit ShaderRecordTable(std::shared_ptr<magma::Device> device,
+        std::shared_ptr<magma::Allocator> allocator = nullptr);
+    uint32_t addRecord(VkShaderStageFlagBits stage, uint32_t groupIndex,
+        const void *data = nullptr, std::size_t size = 0);
+    template<class Type>
+    uint32_t addRecord(VkShaderStageFlagBits stage, uint32_t groupIndex, const Type& data)
+        { return addRecord(stage, groupIndex, &data, sizeof(Type)); }
+    void updateRecord(VkShaderStageFlagBits stage, uint32_t recordIndex, const void *data, std::size_t size);
+    template<class Type>
+    void updateRecord(VkShaderStageFlagBits stage, uint32_t recordIndex, const Type& data)
+        { updateRecord(stage, recordIndex, &data, sizeof(Type)); }
+    void build(const std::shared_ptr<magma::RayTracingPipeline>& pipeline,
+        const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
+    bool update(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
+    void traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+        uint32_t width, uint32_t height, uint32_t depth) const;
+    VkDeviceSize getSize() const noexcept { return hostData.size(); }
+
+private:
+    enum Region : uint32_t
+    {
+        Raygen, Miss, Hit, Callable, RegionCount
+    };
+
+    struct Record
+    {
+        uint32_t groupIndex;
+        std::vector<uint8_t> data;
+    };
+
+    static Region getRegion(VkShaderStageFlagBits stage);
+
+    std::shared_ptr<magma::Device> device;
+    std::shared_ptr<magma::Allocator> allocator;
+    std::shared_ptr<magma::Buffer> buffer;
+    std::vector<Record> records[RegionCount];
+    VkStridedDeviceAddressRegionKHR regions[RegionCount];
+    VkDeviceSize regionOffsets[RegionCount];
+    std::vector<uint8_t> hostData; // Shadow copy of buffer
+    VkDeviceSize bufferOffset; // Aligns base address of the table
+    VkDeviceSize dirtyBegin;
+    VkDeviceSize dirtyEnd;
+    uint32_t handleSize;
+    uint32_t handleAlignment;
+    uint32_t baseAlignment;
+    uint32_t maxStride;
+    PFN_vkGetRayTracingShaderGroupHandlesKHR pfnGetRayTracingShaderGroupHandles;
+    PFN_vkCmdTraceRaysKHR pfnCmdTraceRays;
+};
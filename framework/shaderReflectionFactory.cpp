@@ -0,0 +1,40 @@
+#include <fstream>
+#include "shaderReflectionFactory.h"
+#include "utilities.h"
+
+const std::unique_ptr<const magma::ShaderReflection>& ShaderReflectionFactory::getReflection(const std::string& fileName)
+{   // Module is owned by the factory, so reflection outlives returned pointer
+    return getShaderModule(fileName)->getReflection();
+}
+
+std::shared_ptr<magma::ShaderModule> ShaderReflectionFactory::getShaderModule(const std::string& fileName)
+{
+    const std::string shaderFileName = fileName + std::string(".spv");
+    std::ifstream file(shaderFileName, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        throw std::runtime_error("file \"" + shaderFileName + "\" not found");
+    const std::size_t size = static_cast<std::size_t>(file.tellg());
+    if (size % sizeof(magma::SpirvWord))
+        throw std::runtime_error("size of \"" + shaderFileName + "\" bytecode must be a multiple of SPIR-V word");
+    std::vector<magma::SpirvWord> bytecode(size / sizeof(magma::SpirvWord));
+    file.seekg(0, std::ios::beg);
+    if (!file.read(reinterpret_cast<char *>(bytecode.data()), size))
+        throw std::runtime_error("failed to read \"" + shaderFileName + "\"");
+    const Key key(fileName, utilities::hash(bytecode.data(), size));
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = shaderModules.find(key);
+        if (it != shaderModules.end())
+            return it->second;
+    }
+    // Parse outside of lock, so that different shaders are reflected in parallel
+    auto allocator = device->getHostAllocator();
+    constexpr bool reflect = true;
+    auto shaderModule = std::make_shared<magma::ShaderModule>(device,
+        bytecode.data(), size, 0,
+        std::move(allocator), reflect, 0);
+    std::lock_guard<std::mutex> lock(mtx);
+    // If other thread has been first, its module is kept
+    auto it = shaderModules.emplace(key, std::move(shaderModule)).first;
+    return it->second;
+}
@@ -0,0 +1,48 @@
+/* Progressive accumulation of jittered samples per pixel.
+   Running average is kept in float image, so static view
+   converges to anti-aliased image over many frames. */
+
+#ifndef accumulation_h
+#define accumulation_h
+#include "pcg.h"
+
+layout(set = 2, binding = 0, rgba32f) uniform image2D accumulationImage;
+layout(set = 2, binding = 1) uniform Accumulation {
+    uint sampleIndex; // Zero after reset
+    uint sampleCount; // One if accumulation is disabled
+    uint frameIndex;
+};
+
+bool accumulationConverged()
+{
+    return sampleIndex >= sampleCount;
+}
+
+vec2 subpixelOffset()
+{   // First sample after reset goes through pixel center
+    if (0 == sampleIndex)
+        return vec2(0.5);
+    return pcg3d(uvec3(gl_LaunchIDEXT.xy, frameIndex)).xy;
+}
+
+vec3 accumulate(vec3 color)
+{
+    if (sampleCount > 1)
+    {
+        ivec2 coord = ivec2(gl_LaunchIDEXT.xy);
+        if (sampleIndex > 0)
+        {
+            vec3 average = imageLoad(accumulationImage, coord).rgb;
+            color = mix(average, color, 1./(sampleIndex + 1));
+        }
+        imageStore(accumulationImage, coord, vec4(color, 1));
+    }
+    return color;
+}
+
+vec3 accumulatedColor()
+{
+    return imageLoad(accumulationImage, ivec2(gl_LaunchIDEXT.xy)).rgb;
+}
+
+#endif // accumulation_h
@@ -16,6 +16,29 @@ layout(buffer_reference) buffer readonly IndexBuffer {
     uint indices[];
 };
 
+// Split streams: tightly packed positions and the rest of attributes
+struct VertexAttributes
+{
+    vec2 texCoord;
+    uint normal;
+    uint color;
+    uint matId;
+    uint padding;
+};
+
+layout(buffer_reference) buffer readonly PositionBuffer {
+    float positions[]; // vec3 array would have 16-byte stride
+};
+layout(buffer_reference) buffer readonly AttributeBuffer {
+    VertexAttributes attributes[];
+};
+
+vec3 loadPosition(PositionBuffer pb, uint index)
+{
+    uint i = index * 3;
+    return vec3(pb.positions[i], pb.positions[i + 1], pb.positions[i + 2]);
+}
+
 void loadTriangleAttributes(uint64_t vbAddr, uint64_t ibAddr,
     inout vec3 normal, inout vec3 color)
 {
@@ -33,6 +56,25 @@ void loadTriangleAttributes(uint64_t vbAddr, uint64_t ibAddr,
     color = unpackUnorm4x8(vb.vertices[face.x].color).rgb;
 }
 
+void loadTriangleAttributes(uint64_t pbAddr, uint64_t abAddr, uint64_t ibAddr,
+    inout vec3 normal, inout vec3 color)
+{
+    uint i = gl_PrimitiveID * 3;
+    IndexBuffer ib = IndexBuffer(ibAddr);
+    uvec3 face;
+    face.x = ib.indices[i];
+    face.y = ib.indices[i + 1];
+    face.z = ib.indices[i + 2];
+    PositionBuffer pb = PositionBuffer(pbAddr);
+    vec3 v0 = loadPosition(pb, face.x);
+    vec3 v1 = loadPosition(pb, face.y);
+    vec3 v2 = loadPosition(pb, face.z);
+    normal = cross(v1 - v0, v2 - v0);
+    // Only color of the first vertex is fetched from attribute stream
+    AttributeBuffer ab = AttributeBuffer(abAddr);
+    color = unpackUnorm4x8(ab.attributes[face.x].color).rgb;
+}
+
 void interpolateTriangleAttributes(uint64_t vbAddr, uint64_t ibAddr, vec3 barycentrics,
     inout vec3 normal, inout vec2 texCoord, inout vec3 color)
 {
@@ -59,3 +101,29 @@ void interpolateTriangleAttributes(uint64_t vbAddr, uint64_t ibAddr, vec3 baryce
     vec3 c2 = unpackUnorm4x8(v2.color).rgb;
     color = interpolate(c0, c1, c2, barycentrics);
 }
+
+void interpolateTriangleAttributes(uint64_t abAddr, uint64_t ibAddr, vec3 barycentrics,
+    inout vec3 normal, inout vec2 texCoord, inout vec3 color, inout uint matId)
+{
+    uint i = gl_PrimitiveID * 3;
+    IndexBuffer ib = IndexBuffer(ibAddr);
+    uvec3 face;
+    face.x = ib.indices[i];
+    face.y = ib.indices[i + 1];
+    face.z = ib.indices[i + 2];
+    // Positions are not needed for shading, so only attribute stream is fetched
+    AttributeBuffer ab = AttributeBuffer(abAddr);
+    VertexAttributes a0 = ab.attributes[face.x];
+    VertexAttributes a1 = ab.attributes[face.y];
+    VertexAttributes a2 = ab.attributes[face.z];
+    vec3 n0 = unpackSnorm4x8(a0.normal).xyz;
+    vec3 n1 = unpackSnorm4x8(a1.normal).xyz;
+    vec3 n2 = unpackSnorm4x8(a2.normal).xyz;
+    normal = interpolate(n0, n1, n2, barycentrics);
+    texCoord = interpolate(a0.texCoord, a1.texCoord, a2.texCoord, barycentrics);
+    vec3 c0 = unpackUnorm4x8(a0.color).rgb;
+    vec3 c1 = unpackUnorm4x8(a1.color).rgb;
+    vec3 c2 = unpackUnorm4x8(a2.color).rgb;
+    color = interpolate(c0, c1, c2, barycentrics);
+    matId = a0.matId; // Material is the same for all vertices of triangle
+}
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <stdexcept>
+#include "timelineScheduler.h"
+
+TimelineScheduler::TimelineScheduler(std::shared_ptr<magma::Device> device,
+    std::shared_ptr<magma::Queue> graphicsQueue, std::shared_ptr<magma::Queue> computeQueue,
+    std::shared_ptr<magma::Queue> transferQueue):
+    device(std::move(device)),
+    queues{graphicsQueue, computeQueue, transferQueue ? transferQueue : graphicsQueue},
+    semaphores{},
+    submittedValues{},
+    completedValues{}
+{
+    const VkDevice handle = this->device->getHandle();
+    pfnGetSemaphoreCounterValue = reinterpret_cast<PFN_vkGetSemaphoreCounterValueKHR>(
+        vkGetDeviceProcAddr(handle, "vkGetSemaphoreCounterValueKHR"));
+    pfnWaitSemaphores = reinterpret_cast<PFN_vkWaitSemaphoresKHR>(
+        vkGetDeviceProcAddr(handle, "vkWaitSemaphoresKHR"));
+    if (!pfnGetSemaphoreCounterValue || !pfnWaitSemaphores)
+        throw std::runtime_error("timeline semaphores not supported");
+    VkSemaphoreTypeCreateInfoKHR semaphoreTypeInfo;
+    semaphoreTypeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+    semaphoreTypeInfo.pNext = nullptr;
+    semaphoreTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    semaphoreTypeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semaphoreInfo;
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &semaphoreTypeInfo;
+    semaphoreInfo.flags = 0;
+    for (VkSemaphore& semaphore: semaphores)
+    {
+        if (vkCreateSemaphore(handle, &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS)
+            throw std::runtime_error("failed to create timeline semaphore");
+    }
+}
+
+TimelineScheduler::~TimelineScheduler()
+{
+    waitIdle();
+    for (VkSemaphore semaphore: semaphores)
+        vkDestroySemaphore(device->getHandle(), semaphore, nullptr);
+}
+
+TimelineScheduler::SyncPoint TimelineScheduler::submit(Queue queue,
+    const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+    const std::vector<Dependency>& dependencies,
+    const std::shared_ptr<magma::Semaphore>& waitSemaphore, VkPipelineStageFlags waitStageMask,
+    const std::shared_ptr<magma::Semaphore>& signalSemaphore)
+{
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<uint64_t> waitValues;
+    std::vector<VkPipelineStageFlags> waitStageMasks;
+    for (const Dependency& dependency: dependencies)
+    {
+        const SyncPoint& syncPoint = dependency.syncPoint;
+        if (syncPoint.value > completedValues[syncPoint.queue])
+        {   // Skip dependencies that are known to be reached
+            waitSemaphores.push_back(semaphores[syncPoint.queue]);
+            waitValues.push_back(syncPoint.value);
+            waitStageMasks.push_back(dependency.dstStageMask);
+        }
+    }
+    if (waitSemaphore)
+    {   // Value is ignored for binary semaphore
+        waitSemaphores.push_back(waitSemaphore->getHandle());
+        waitValues.push_back(0);
+        waitStageMasks.push_back(waitStageMask);
+    }
+    const uint64_t value = ++submittedValues[queue];
+    VkSemaphore signalSemaphores[2] = {semaphores[queue]};
+    const uint64_t signalValues[2] = {value, 0};
+    if (signalSemaphore)
+        signalSemaphores[1] = signalSemaphore->getHandle();
+    const uint32_t signalSemaphoreCount = signalSemaphore ? 2 : 1;
+    VkTimelineSemaphoreSubmitInfoKHR timelineInfo;
+    timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+    timelineInfo.pNext = nullptr;
+    timelineInfo.waitSemaphoreValueCount = static_cast<uint32_t>(waitValues.size());
+    timelineInfo.pWaitSemaphoreValues = waitValues.data();
+    timelineInfo.signalSemaphoreValueCount = signalSemaphoreCount;
+    timelineInfo.pSignalSemaphoreValues = signalValues;
+    const VkCommandBuffer commandBuffer = cmdBuffer->getHandle();
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+    submitInfo.pWaitSemaphores = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = waitStageMasks.data();
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.signalSemaphoreCount = signalSemaphoreCount;
+    submitInfo.pSignalSemaphores = signalSemaphores;
+    if (vkQueueSubmit(queues[queue]->getHandle(), 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+        throw std::runtime_error("failed to submit command buffer");
+    return SyncPoint{queue, value};
+}
+
+bool TimelineScheduler::reached(const SyncPoint& syncPoint) const
+{
+    uint64_t& completedValue = completedValues[syncPoint.queue];
+    if (syncPoint.value <= completedValue)
+        return true;
+    pfnGetSemaphoreCounterValue(device->getHandle(), semaphores[syncPoint.queue], &completedValue);
+    return (syncPoint.value <= completedValue);
+}
+
+void TimelineScheduler::wait(const SyncPoint& syncPoint) const
+{
+    if (reached(syncPoint))
+        return;
+    VkSemaphoreWaitInfoKHR waitInfo;
+    waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+    waitInfo.pNext = nullptr;
+    waitInfo.flags = 0;
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &semaphores[syncPoint.queue];
+    waitInfo.pValues = &syncPoint.value;
+    if (pfnWaitSemaphores(device->getHandle(), &waitInfo, UINT64_MAX) != VK_SUCCESS)
+        throw std::runtime_error("failed to wait for timeline semaphore");
+    completedValues[syncPoint.queue] = std::max(completedValues[syncPoint.queue], syncPoint.value);
+}
+
+void TimelineScheduler::waitIdle() const
+{
+    for (uint8_t queue = Graphics; queue < QueueCount; ++queue)
+        wait(SyncPoint{static_cast<Queue>(queue), submittedValues[queue]});
+}
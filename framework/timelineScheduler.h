@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include "magma/magma.h"
+
+/* Submits command buffers to graphics, compute and transfer queues.
+   Each queue owns a timeline semaphore which counter is incremented
+   with every submission, so any submission can be referenced later
+   as a pair of queue and counter value. Dependencies between queues
+   are resolved on GPU, CPU only waits when it needs the results. */
+
+class TimelineScheduler
+{
+public:
+    enum Queue : uint8_t
+    {
+        Graphics, Compute, Transfer, QueueCount
+    };
+
+    struct SyncPoint
+    {
+        Queue queue = Graphics;
+        uint64_t value = 0; // Zero is always reached
+    };
+
+    struct Dependency
+    {
+        SyncPoint syncPoint;
+        VkPipelineStageFlags dstStageMask;
+    };
+
+    TimelineScheduler(std::shared_ptr<magma::Device> device,
+        std::shared_ptr<magma::Queue> graphicsQueue,
+        std::shared_ptr<magma::Queue> computeQueue,
+        std::shared_ptr<magma::Queue> transferQueue);
+    ~TimelineScheduler();
+    SyncPoint submit(Queue queue,
+        const std::shared_ptr<magma::CommandBuffer>& cmdBuffer,
+        const std::vector<Dependency>& dependencies = {},
+        const std::shared_ptr<magma::Semaphore>& waitSemaphore = nullptr,
+        VkPipelineStageFlags waitStageMask = 0,
+        const std::shared_ptr<magma::Semaphore>& signalSemaphore = nullptr);
+    bool reached(const SyncPoint& syncPoint) const;
+    void wait(const SyncPoint& syncPoint) const;
+    void waitIdle() const;
+
+private:
+    std::shared_ptr<magma::Device> device;
+    std::shared_ptr<magma::Queue> queues[QueueCount];
+    VkSemaphore semaphores[QueueCount];
+    uint64_t submittedValues[QueueCount];
+    mutable uint64_t completedValues[QueueCount];
+    PFN_vkGetSemaphoreCounterValueKHR pfnGetSemaphoreCounterValue;
+    PFN_vkWaitSemaphoresKHR pfnWaitSemaphores;
+};
@@ -13,6 +13,11 @@ public:
         running = true;
     }
 
+    void setFixedStep(float milliseconds) noexcept
+    {   // Makes animation deterministic regardless of frame rate
+        fixedStep = milliseconds;
+    }
+
     float millisecondsElapsed()
     {
         assert(running);
@@ -20,6 +25,8 @@ public:
         const std::chrono::microseconds ms =
             std::chrono::duration_cast<std::chrono::microseconds>(now - prev);
         prev = now;
+        if (fixedStep > 0.f)
+            return fixedStep;
         return static_cast<float>(ms.count()) * 0.001f;
     }
 
@@ -30,5 +37,6 @@ public:
 
 private:
     HiResClock::time_point prev;
+    float fixedStep = 0.f;
     bool running = false;
 };
@@ -41,6 +41,15 @@ void saveBinaryFile(const std::string& fileName, const void *data, size_t size)
     file.write((char *)data, size);
 }
 
+uint64_t hash(const void *data, size_t size, uint64_t seed /* FNV offset basis */) noexcept
+{   // FNV-1a
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
 VkBool32 VKAPI_PTR reportCallback(VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objectType,
     uint64_t object, size_t location, int32_t messageCode,
     const char *pLayerPrefix, const char *pMessage, void *pUserData)
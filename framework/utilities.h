@@ -19,6 +19,7 @@ namespace utilities
 {
     aligned_vector<char> loadBinaryFile(const std::string& filename);
     void saveBinaryFile(const std::string& fileName, const void *data, size_t size);
+    uint64_t hash(const void *data, size_t size, uint64_t seed = 14695981039346656037ull) noexcept;
     VkBool32 VKAPI_PTR reportCallback(VkDebugReportFlagsEXT flags, VkDebugReportObjectTypeEXT objectType,
         uint64_t object, size_t location, int32_t messageCode,
         const char *pLayerPrefix, const char *pMessage, void *pUserData);
@@ -9,6 +9,18 @@ struct alignas(16) Vertex
     uint32_t matId;
 };
 
+/* Vertex without position, which is stored in separate stream.
+   Layout matches std430 array of VertexAttributes in shaders. */
+
+struct alignas(8) VertexAttributes
+{
+    rapid::float2 texCoord;
+    int8_t normal[4];
+    uint8_t color[4];
+    uint32_t matId;
+    uint32_t padding;
+};
+
 inline bool operator==(const Vertex& a, const Vertex& b) noexcept
 {
     return !memcmp(&a, &b, sizeof(a));
@@ -1,27 +1,111 @@
+#include <cctype>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <thread>
 #include "vulkanRtApp.h"
 #include "utilities.h"
+#include "image.h"
+#include "imageCompare.h"
 
-VulkanRayTracingApp::VulkanRayTracingApp(const AppEntry& entry, const std::tstring& caption, uint32_t width, uint32_t height):
+namespace
+{
+/* Storage image that can also be read back and be source or destination of upscale blit */
+class TransferStorageImage2D : public magma::Image2D
+{
+public:
+    explicit TransferStorageImage2D(std::shared_ptr<magma::Device> device, VkFormat format, const VkExtent2D& extent,
+        std::shared_ptr<magma::Allocator> allocator):
+        magma::Image2D(std::move(device), format, extent, 1, 1, 1, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+            0, Initializer(), magma::Sharing(), std::move(allocator))
+    {}
+};
+}
+
+VulkanRayTracingApp::VulkanRayTracingApp(const AppEntry& entry, const std::tstring& caption, uint32_t width, uint32_t height,
+    bool accumulation /* false */):
     PlatformApp(entry, caption, width, height),
     timer(std::make_unique<Timer>()),
     backbufferFormat{VK_FORMAT_UNDEFINED, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR},
+    presentLayout(headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR),
     vSync(false),
-    presentWait(PresentationWait::Fence),
+    framesInFlight(2),
+    frameInFlightIndex(0),
     bufferIndex(0),
-    frameIndex(0)
+    frameIndex(0),
+    accumulation(accumulation)
 {
+    const CommandLine cmdLine(entry);
+    captureFileName = cmdLine.getString("--capture", std::string());
+    referenceFileName = cmdLine.getString("--reference", std::string());
+    timingsFileName = cmdLine.getString("--timings", std::string());
+    cpuReference = cmdLine.hasOption("--cpu-reference");
+    if (headless && captureFileName.empty())
+    {   // "Shader binding table" -> "shader-binding-table.png"
+        std::string name = std::to_utf8(caption);
+        std::transform(name.begin(), name.end(), name.begin(),
+            [](char c) { return (' ' == c) ? '-' : static_cast<char>(std::tolower(c)); });
+        captureFileName = name + ".png";
+    }
+    const bool regression = !captureFileName.empty() || !referenceFileName.empty() || cpuReference;
+    maxFrames = cmdLine.getUint("--frames", regression ? 64 : 0);
+    diffThreshold = cmdLine.getFloat("--threshold", 2.3f); // Just noticeable difference
+    diffTolerance = cmdLine.getFloat("--tolerance", 0.001f);
+    framesInFlight = std::max(1U, std::min(cmdLine.getUint("--frames-in-flight", framesInFlight), maxFramesInFlight));
+    profileCsvFileName = cmdLine.getString("--profile-csv", std::string());
+    profileTraceFileName = cmdLine.getString("--profile-trace", std::string());
+    profiling = cmdLine.hasOption("--profile") || !profileCsvFileName.empty() || !profileTraceFileName.empty();
+    memoryStatistics = cmdLine.hasOption("--memory-stats");
+    hostBuild = cmdLine.hasOption("--host-build");
+    // Animated samples don't accumulate, otherwise they would freeze when converged
+    accumulationSamples = accumulation ? std::max(1U, cmdLine.getUint("--accumulate", 1)) : 1;
+    accumulatedSamples = 0;
+    const float frameTimeBudget = cmdLine.getFloat("--dynamic-resolution", 0.f);
+    if (frameTimeBudget > 0.f)
+    {
+        dynamicResolution = std::make_unique<DynamicResolution>(frameTimeBudget,
+            cmdLine.getFloat("--min-scale", 0.5f), framesInFlight);
+    }
+    const FramePacer::Mode pacingMode = FramePacer::parseMode(cmdLine.getString("--pacing", "uncapped"));
+    framePacer = std::make_unique<FramePacer>(pacingMode, cmdLine.getFloat("--fps", 60.f));
+    if (maxFrames)
+    {   // Fixed time step gives the same image on every run
+        timer->setFixedStep(1000.f/60.f);
+    }
     createInstance();
     createLogicalDevice();
-    createSwapchain();
-    createRenderPass();
-    createFramebuffer();
+    createAllocator();
+    if (headless)
+        createOffscreenImages();
+    else
+    {   // Offscreen images are never used as color attachments
+        createSwapchain();
+        createRenderPass();
+        createFramebuffer();
+    }
     createCommandBuffers();
     createSyncPrimitives();
+    scratchAllocator = std::make_unique<ScratchAllocator>(device, scheduler.get(), allocator);
+    buildBatcher = std::make_unique<BuildBatcher>(device, *scratchAllocator, hostBuild);
+    if (dynamicResolution)
+        createInternalImage();
     createDescriptorPool();
     createDescriptorSets();
     createUniformBuffers();
-    pipelineCache = std::make_shared<magma::PipelineCache>(device);
+    createProfiler(profiling || dynamicResolution);
+    if (dynamicResolution && !profiler->isEnabled())
+    {   // Can't measure GPU time, keep full resolution
+        dynamicResolution.reset();
+    }
+    createAccumulationResources();
+    pipelineCache = std::make_shared<PipelineCache>(device, "../cache/pipelines.bin");
     shaderReflectionFactory = std::make_shared<ShaderReflectionFactory>(device);
+    if (!cmdLine.hasOption("--no-as-cache"))
+    {
+        accelerationStructureCache = std::make_unique<AccelerationStructureCache>(device, "../cache", allocator);
+        lodCache = std::make_unique<LodCache>("../cache");
+    }
 }
 
 VulkanRayTracingApp::~VulkanRayTracingApp()
@@ -33,47 +117,80 @@ VulkanRayTracingApp::~VulkanRayTracingApp()
 void VulkanRayTracingApp::close()
 {
     device->waitIdle();
+    pipelineCache->save();
+    if (!maxFrames)
+        printFrameStatistics();
+    if (memoryStatistics)
+        printMemoryStatistics();
+    if (hostBuild || profiling)
+        printBuildStatistics();
+    if (profiling && profiler->isEnabled())
+    {
+        profiler->printSummary(std::cout);
+        if (!profileCsvFileName.empty())
+            profiler->exportCsv(profileCsvFileName);
+        if (!profileTraceFileName.empty())
+            profiler->exportChromeTrace(profileTraceFileName);
+    }
     quit = true;
 }
 
 void VulkanRayTracingApp::onIdle()
 {
+    if (accumulation && !isAnimated() && accumulationConverged() && !maxFrames)
+    {   // Image on screen is final, don't waste GPU time until something changes
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return;
+    }
     onPaint();
 }
 
 void VulkanRayTracingApp::onPaint()
-{
-    bufferIndex = swapchain->acquireNextImage(presentFinished);
-    if (PresentationWait::Fence == presentWait)
-    {   // Fence to be signaled when command buffer completed execution
-        waitFences[bufferIndex]->reset();
-        waitFence = &waitFences[bufferIndex];
+{   // Wait only until GPU finished the frame which resources we are going to reuse
+    const TimelineScheduler::SyncPoint& frameSyncPoint = frameSyncPoints[frameInFlightIndex];
+    framePacer->beginFrame([this, &frameSyncPoint]() { scheduler->wait(frameSyncPoint); });
+    // Timestamps of this frame slot are available without waiting
+    profiler->resolve(frameInFlightIndex);
+    if (frameIndex % 60 == 0)
+        scratchAllocator->shrink(); // Return scratch memory once models are loaded
+    if (profiling && profiler->isEnabled() && !headless && (frameIndex % 60 == 0))
+        showProfilerCaption();
+    // Only tracing cost scales with resolution, builds and copies don't
+    if (dynamicResolution && dynamicResolution->update(profiler->getScopeTime("traceRays")))
+        resetAccumulation(); // Samples are traced with different launch size
+    if (accumulation && isAnimated())
+        resetAccumulation(); // Previous samples belong to a different scene state
+    updateAccumulation();
+    if (headless)
+    {   // Image of this frame isn't used by GPU anymore
+        bufferIndex = frameInFlightIndex;
     }
+    else
+        bufferIndex = swapchain->acquireNextImage(presentFinished[frameInFlightIndex]);
     render(bufferIndex);
-    graphicsQueue->present(swapchain, bufferIndex, renderFinished);
-    switch (presentWait)
+    std::vector<uint32_t> pixels;
+    if (maxFrames && (frameIndex == maxFrames - 1))
+    {   // Read back before the image is handed over to presentation engine
+        pixels = readBackbuffer(bufferIndex);
+    }
+    if (!headless)
+        graphicsQueue->present(swapchain, bufferIndex, renderFinished[bufferIndex]);
+    framePacer->endFrame();
+    if (!pixels.empty())
     {
-    case PresentationWait::Fence:
-        if (waitFence)
-        {
-            (*waitFence)->wait();
-            graphicsQueue->onIdle();
-        }
-        break;
-    case PresentationWait::Queue:
-        graphicsQueue->waitIdle();
-        break;
-    case PresentationWait::Device:
-        // vkDeviceWaitIdle is equivalent to calling vkQueueWaitIdle
-        // for all queues owned by device.
-        device->waitIdle();
-        break;
-    }
-    if (!vSync)
-    {   // Cap fps
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        checkRegression(pixels);
+        close();
     }
     ++frameIndex;
+    frameInFlightIndex = frameIndex % framesInFlight;
+}
+
+void VulkanRayTracingApp::onMouseMove(int x, int y)
+{
+    const float lastSpinX = spinX, lastSpinY = spinY;
+    PlatformApp::onMouseMove(x, y);
+    if ((spinX != lastSpinX) || (spinY != lastSpinY))
+        resetAccumulation(); // Samples rotate instances with mouse
 }
 
 void VulkanRayTracingApp::createInstance()
@@ -87,16 +204,18 @@ void VulkanRayTracingApp::createInstance()
         layerNames.push_back("VK_LAYER_LUNARG_standard_validation");
 #endif // _DEBUG
 
-    magma::NullTerminatedStringArray enabledExtensions = {
-        VK_KHR_SURFACE_EXTENSION_NAME,
+    magma::NullTerminatedStringArray enabledExtensions;
+    if (!headless)
+    {
+        enabledExtensions.push_back(VK_KHR_SURFACE_EXTENSION_NAME);
     #if defined(VK_USE_PLATFORM_WIN32_KHR)
-        VK_KHR_WIN32_SURFACE_EXTENSION_NAME
+        enabledExtensions.push_back(VK_KHR_WIN32_SURFACE_EXTENSION_NAME);
     #elif defined(VK_USE_PLATFORM_XLIB_KHR)
-        VK_KHR_XLIB_SURFACE_EXTENSION_NAME
+        enabledExtensions.push_back(VK_KHR_XLIB_SURFACE_EXTENSION_NAME);
     #elif defined(VK_USE_PLATFORM_XCB_KHR)
-        VK_KHR_XCB_SURFACE_EXTENSION_NAME
+        enabledExtensions.push_back(VK_KHR_XCB_SURFACE_EXTENSION_NAME);
     #endif // VK_USE_PLATFORM_XCB_KHR
-    };
+    }
     instanceExtensions = std::make_unique<magma::InstanceExtensions>();
 #ifdef VK_KHR_get_physical_device_properties2
     if (instanceExtensions->KHR_get_physical_device_properties2)
@@ -166,7 +285,6 @@ void VulkanRayTracingApp::createLogicalDevice()
     features.shaderInt64 = VK_TRUE;
 
     magma::NullTerminatedStringArray enabledExtensions = {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
         VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
         VK_KHR_RAY_QUERY_EXTENSION_NAME,
         VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
@@ -174,13 +292,31 @@ void VulkanRayTracingApp::createLogicalDevice()
         VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
         VK_KHR_SPIRV_1_4_EXTENSION_NAME,
         VK_KHR_SHADER_FLOAT_CONTROLS_EXTENSION_NAME,
+        VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME,
         VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
     };
+    if (!headless)
+        enabledExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
     if (extensions->KHR_maintenance1)
         enabledExtensions.push_back(VK_KHR_MAINTENANCE1_EXTENSION_NAME);
     else if (extensions->AMD_negative_viewport_height)
         enabledExtensions.push_back(VK_AMD_NEGATIVE_VIEWPORT_HEIGHT_EXTENSION_NAME);
 
+    if (hostBuild)
+    {   // Check whether driver is able to build acceleration structures on CPU
+        VkPhysicalDeviceAccelerationStructureFeaturesKHR supportedFeatures = {};
+        supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+        VkPhysicalDeviceFeatures2 supportedFeatures2 = {};
+        supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        supportedFeatures2.pNext = &supportedFeatures;
+        vkGetPhysicalDeviceFeatures2(physicalDevice->getHandle(), &supportedFeatures2);
+        if (!supportedFeatures.accelerationStructureHostCommands)
+        {
+            std::cout << "acceleration structure host commands not supported, build on device" << std::endl;
+            hostBuild = false;
+        }
+    }
+
     magma::StructureChain extendedFeatures;
 
     VkPhysicalDeviceAccelerationStructureFeaturesKHR accelerationStructureFeatures;
@@ -189,7 +325,7 @@ void VulkanRayTracingApp::createLogicalDevice()
     accelerationStructureFeatures.accelerationStructure = VK_TRUE;
     accelerationStructureFeatures.accelerationStructureCaptureReplay = VK_FALSE;
     accelerationStructureFeatures.accelerationStructureIndirectBuild = VK_FALSE;
-    accelerationStructureFeatures.accelerationStructureHostCommands = VK_FALSE;
+    accelerationStructureFeatures.accelerationStructureHostCommands = hostBuild ? VK_TRUE : VK_FALSE;
     accelerationStructureFeatures.descriptorBindingAccelerationStructureUpdateAfterBind = VK_FALSE;
     extendedFeatures.linkNode(accelerationStructureFeatures);
 
@@ -217,10 +353,23 @@ void VulkanRayTracingApp::createLogicalDevice()
     bufferDeviceAddressFeatures.bufferDeviceAddressMultiDevice = VK_FALSE;
     extendedFeatures.linkNode(bufferDeviceAddressFeatures);
 
+    VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineSemaphoreFeatures;
+    timelineSemaphoreFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+    timelineSemaphoreFeatures.pNext = nullptr;
+    timelineSemaphoreFeatures.timelineSemaphore = VK_TRUE;
+    extendedFeatures.linkNode(timelineSemaphoreFeatures);
+
     const std::vector<const char*> noLayers;
     device = physicalDevice->createDevice(queueDescriptors, noLayers, enabledExtensions, features, extendedFeatures);
 }
 
+void VulkanRayTracingApp::createAllocator()
+{   // Buffers and images are sub-allocated from large memory blocks pooled per memory type,
+    // instead of calling vkAllocateMemory() for each resource
+    deviceAllocator = std::make_shared<magma::DeviceMemoryAllocator>(device);
+    allocator = std::make_shared<magma::Allocator>(nullptr, deviceAllocator);
+}
+
 void VulkanRayTracingApp::createSwapchain()
 {
 #if defined(VK_USE_PLATFORM_WIN32_KHR)
@@ -297,6 +446,15 @@ void VulkanRayTracingApp::createSwapchain()
     const VkSurfaceCapabilitiesKHR surfaceCapabilities = physicalDevice->getSurfaceCapabilities(surface);
     if (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT)
         imageUsageFlags |= VK_IMAGE_USAGE_STORAGE_BIT; // Can trace rays directly to back buffer
+    if (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)
+        imageUsageFlags |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT; // Can read back to host
+    if (surfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+        imageUsageFlags |= VK_IMAGE_USAGE_TRANSFER_DST_BIT; // Can upscale to back buffer
+    else if (dynamicResolution)
+    {
+        std::cout << "swapchain doesn't support transfer, dynamic resolution disabled" << std::endl;
+        dynamicResolution.reset();
+    }
     magma::Swapchain::Initializer initializer;
     initializer.debugReportCallback = debugReportCallback.get();
     swapchain = std::make_unique<magma::Swapchain>(device, surface,
@@ -311,11 +469,34 @@ void VulkanRayTracingApp::createSwapchain()
     }
 }
 
+void VulkanRayTracingApp::createOffscreenImages()
+{   // Rays are traced to storage images that are read back instead of being presented
+    backbufferFormat = {VK_FORMAT_R8G8B8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR};
+    const VkExtent2D extent = {width, height};
+    for (uint32_t i = 0; i < framesInFlight; ++i)
+    {
+        auto image = std::make_shared<TransferStorageImage2D>(device, backbufferFormat.format, extent, allocator);
+        swapchainImageViews.push_back(std::make_shared<magma::ImageView>(image));
+    }
+}
+
+void VulkanRayTracingApp::createInternalImage()
+{   // Rays are traced to the top-left part of this image, then upscaled to back buffer
+    const VkExtent2D extent = {width, height};
+    auto image = std::make_shared<TransferStorageImage2D>(device, backbufferFormat.format, extent, allocator);
+    cmdImageCopy->reset();
+    cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    image->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdImageCopy);
+    cmdImageCopy->end();
+    submitCopyImageCommands();
+    internalImageView = std::make_shared<magma::ImageView>(image);
+}
+
 void VulkanRayTracingApp::createRenderPass()
 {
     const magma::AttachmentDescription colorAttachment(backbufferFormat.format,
         1, magma::op::store, magma::op::dontCare,
-        VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+        VK_IMAGE_LAYOUT_UNDEFINED, presentLayout);
     renderPass = std::make_shared<magma::RenderPass>(device, colorAttachment);
 }
 
@@ -333,8 +514,9 @@ void VulkanRayTracingApp::createCommandBuffers()
     computeQueue = device->getQueue(VK_QUEUE_COMPUTE_BIT, 0);
     commandPools[0] = std::make_shared<magma::CommandPool>(device, graphicsQueue->getFamilyIndex());
     commandPools[1] = std::make_shared<magma::CommandPool>(device, computeQueue->getFamilyIndex());
-    // Create draw command buffers
-    commandBuffers = commandPools[0]->allocateCommandBuffers(static_cast<uint32_t>(framebuffers.size()), true);
+    // Create draw command buffers for each frame in flight and swapchain (or offscreen) image
+    const uint32_t commandBufferCount = framesInFlight * static_cast<uint32_t>(swapchainImageViews.size());
+    commandBuffers = commandPools[0]->allocateCommandBuffers(commandBufferCount, true);
     // Create image copy command buffer
     cmdImageCopy = std::make_shared<magma::PrimaryCommandBuffer>(commandPools[0]);
     // Create command buffer used for build acceleration structures in compute queue
@@ -353,76 +535,436 @@ void VulkanRayTracingApp::createCommandBuffers()
 
 void VulkanRayTracingApp::createSyncPrimitives()
 {
-    presentFinished = std::make_shared<magma::Semaphore>(device);
-    renderFinished = std::make_shared<magma::Semaphore>(device);
-    for (int i = 0; i < (int)commandBuffers.size(); ++i)
-        waitFences.push_back(std::make_unique<magma::Fence>(device, nullptr, VK_FENCE_CREATE_SIGNALED_BIT));
+    for (uint32_t i = 0; i < framesInFlight; ++i)
+        presentFinished.push_back(std::make_shared<magma::Semaphore>(device));
+    // Presentation engine may still wait for semaphore of other image when
+    // frame slot is reused, so semaphores of present are owned by images
+    for (std::size_t i = 0; i < swapchainImageViews.size(); ++i)
+        renderFinished.push_back(std::make_shared<magma::Semaphore>(device));
+    scheduler = std::make_unique<TimelineScheduler>(device, graphicsQueue, computeQueue, transferQueue);
 }
 
 void VulkanRayTracingApp::createDescriptorPool()
 {
-    constexpr uint32_t maxDescriptorSets = 10;
-    // Allocate descriptor pool with enough size for basic samples
+    // Framework allocates set per swapchain image and accumulation set, samples allocate up to
+    // two sets for each frame in flight. Descriptor counts are the largest ones of sample sets.
+    const uint32_t imageCount = static_cast<uint32_t>(swapchainImageViews.size());
+    const uint32_t maxDescriptorSets = imageCount + 1 + framesInFlight * 2;
     descriptorPool = std::make_shared<magma::DescriptorPool>(device, maxDescriptorSets,
         std::vector<magma::descriptor::DescriptorPool>{
-            magma::descriptor::UniformBufferPool(4),
-            magma::descriptor::DynamicUniformBufferPool(4),
-            magma::descriptor::StorageBufferPool(10),
-            magma::descriptor::CombinedImageSamplerPool(4),
-            magma::descriptor::AccelerationStructurePool(10)
+            magma::descriptor::UniformBufferPool(2 * framesInFlight),
+            magma::descriptor::DynamicUniformBufferPool(framesInFlight + 1),
+            magma::descriptor::StorageBufferPool(5 * framesInFlight),
+            magma::descriptor::StorageImagePool(imageCount + 1),
+            magma::descriptor::CombinedImageSamplerPool(framesInFlight),
+            magma::descriptor::AccelerationStructurePool(framesInFlight)
         });
 }
 
 void VulkanRayTracingApp::createDescriptorSets()
 {   // General layout of storage image is required
-    swapchain->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdImageCopy,
-        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+    if (headless)
+    {
+        cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        for (auto& imageView: swapchainImageViews)
+            imageView->getImage()->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdImageCopy);
+        cmdImageCopy->end();
+        submitCopyImageCommands();
+    }
+    else
+    {
+        swapchain->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdImageCopy,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+    }
     uint32_t index = 0;
     for (auto& imageView: swapchainImageViews)
     {
-        swapchainImageTables[index].output = imageView;
+        swapchainImageTables[index].output = internalImageView ? internalImageView : imageView;
         auto descriptorSet = std::make_shared<magma::DescriptorSet>(descriptorPool,
             swapchainImageTables[index++], VK_SHADER_STAGE_RAYGEN_BIT_KHR);
         swapchainDescriptorSets.push_back(descriptorSet);
     }
     // Make sure that recorded command buffer will perform present -> general layout transition
-    swapchain->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdImageCopy,
-        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+    if (headless)
+    {
+        cmdImageCopy->reset();
+        cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        for (auto& imageView: swapchainImageViews)
+            imageView->getImage()->layoutTransition(presentLayout, cmdImageCopy);
+        cmdImageCopy->end();
+        submitCopyImageCommands();
+    }
+    else
+    {
+        swapchain->layoutTransition(VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, cmdImageCopy,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+    }
 }
 
 void VulkanRayTracingApp::createUniformBuffers()
 {
-    viewUniforms = std::make_shared<magma::UniformBuffer<View>>(device);
+    viewUniforms = std::make_shared<magma::UniformBuffer<View>>(device, 1, allocator);
+}
+
+void VulkanRayTracingApp::createProfiler(bool enabled)
+{
+    profiler = std::make_unique<GpuProfiler>(device, graphicsQueue->getFamilyIndex(), computeQueue->getFamilyIndex(),
+        framesInFlight, enabled);
+    if (profiler->isEnabled())
+    {
+        cmdImageCopy->reset();
+        cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        profiler->reset(cmdImageCopy);
+        cmdImageCopy->end();
+        submitCopyImageCommands();
+    }
+}
+
+void VulkanRayTracingApp::createAccumulationResources()
+{   // If accumulation is disabled, image is still required to fill descriptor set
+    const VkExtent2D extent = (accumulationSamples > 1) ? VkExtent2D{width, height} : VkExtent2D{1, 1};
+    accumulationImage = std::make_shared<magma::StorageImage2D>(device, VK_FORMAT_R32G32B32A32_SFLOAT, extent, 1, 1, allocator);
+    cmdImageCopy->reset();
+    cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    accumulationImage->layoutTransition(VK_IMAGE_LAYOUT_GENERAL, cmdImageCopy);
+    cmdImageCopy->end();
+    submitCopyImageCommands();
+    accumulationUniforms = std::make_unique<FrameUniformBuffer<Accumulation>>(device, framesInFlight, allocator);
+    accumulationTable.image = std::make_shared<magma::ImageView>(accumulationImage);
+    accumulationTable.parameters = accumulationUniforms->getBuffer();
+    accumulationDescriptorSet = std::make_shared<magma::DescriptorSet>(descriptorPool,
+        accumulationTable, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
+}
+
+const std::shared_ptr<magma::CommandBuffer>& VulkanRayTracingApp::getCommandBuffer(uint32_t frame, uint32_t bufferIndex) const noexcept
+{
+    MAGMA_ASSERT(frame < framesInFlight);
+    return commandBuffers[frame * swapchainImageViews.size() + bufferIndex];
+}
+
+void VulkanRayTracingApp::recordCommandBuffers()
+{
+    const float scale = dynamicResolution ? dynamicResolution->getScale() : 1.f;
+    recordedScales.assign(commandBuffers.size(), scale);
+    for (uint32_t frame = 0; frame < framesInFlight; ++frame)
+    {
+        for (uint32_t index = 0; index < static_cast<uint32_t>(swapchainImageViews.size()); ++index)
+            recordCommandBuffer(frame, index);
+    }
 }
 
 std::shared_ptr<magma::Buffer> VulkanRayTracingApp::allocateScratchBuffer(VkDeviceSize size)
 {
     magma::Buffer::Initializer initializer;
     initializer.deviceAddress = true;
-    return std::make_shared<magma::StorageBuffer>(device, size, nullptr, initializer);
+    return std::make_shared<magma::StorageBuffer>(device, size, allocator, initializer);
+}
+
+magma::Sharing VulkanRayTracingApp::getComputeGraphicsSharing() const
+{   // Resources written on compute queue and read on graphics queue of other family
+    // are shared concurrently, as pre-recorded command buffers can't transfer ownership
+    const uint32_t graphicsFamily = graphicsQueue->getFamilyIndex();
+    const uint32_t computeFamily = computeQueue->getFamilyIndex();
+    if (graphicsFamily == computeFamily)
+        return magma::Sharing();
+    return magma::Sharing(std::vector<uint32_t>{graphicsFamily, computeFamily});
+}
+
+void VulkanRayTracingApp::traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t bufferIndex,
+    const magma::ShaderBindingTable& shaderBindingTable)
+{
+    traceRays(cmdBuffer, bufferIndex,
+        [&cmdBuffer, &shaderBindingTable](uint32_t width, uint32_t height)
+        {
+            cmdBuffer->traceRays(shaderBindingTable, width, height, 1);
+        });
+}
+
+void VulkanRayTracingApp::traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t bufferIndex,
+    const ShaderRecordTable& shaderRecordTable)
+{
+    traceRays(cmdBuffer, bufferIndex,
+        [&cmdBuffer, &shaderRecordTable](uint32_t width, uint32_t height)
+        {
+            shaderRecordTable.traceRays(cmdBuffer, width, height, 1);
+        });
+}
+
+void VulkanRayTracingApp::traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t bufferIndex,
+    const std::function<void(uint32_t width, uint32_t height)>& dispatch)
+{
+    if (!internalImageView)
+    {   // Trace directly to back buffer
+        dispatch(width, height);
+        return;
+    }
+    uint32_t scaledWidth = width, scaledHeight = height;
+    if (dynamicResolution)
+    {
+        scaledWidth = dynamicResolution->scaleDimension(width);
+        scaledHeight = dynamicResolution->scaleDimension(height);
+    }
+    // Previous frame may still upscale internal image
+    cmdBuffer->pipelineBarrier(
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        magma::MemoryBarrier(VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT));
+    dispatch(scaledWidth, scaledHeight);
+    cmdBuffer->pipelineBarrier(
+        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        magma::MemoryBarrier(VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT));
+    VkImageBlit region;
+    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.mipLevel = 0;
+    region.srcSubresource.baseArrayLayer = 0;
+    region.srcSubresource.layerCount = 1;
+    region.srcOffsets[0] = VkOffset3D{0, 0, 0};
+    region.srcOffsets[1] = VkOffset3D{static_cast<int32_t>(scaledWidth), static_cast<int32_t>(scaledHeight), 1};
+    region.dstSubresource = region.srcSubresource;
+    region.dstOffsets[0] = VkOffset3D{0, 0, 0};
+    region.dstOffsets[1] = VkOffset3D{static_cast<int32_t>(width), static_cast<int32_t>(height), 1};
+    // Back buffer is in general layout while rays are traced
+    cmdBuffer->blitImage(internalImageView->getImage(), swapchainImageViews[bufferIndex]->getImage(),
+        region, VK_FILTER_LINEAR);
+}
+
+std::vector<uint32_t> VulkanRayTracingApp::readBackbuffer(uint32_t bufferIndex)
+{
+    const std::shared_ptr<magma::Image>& backBuffer = swapchainImageViews[bufferIndex]->getImage();
+    const VkExtent3D extent = backBuffer->getExtent();
+    std::shared_ptr<magma::DstTransferBuffer> buffer = std::make_shared<magma::DstTransferBuffer>(device,
+        extent.width * extent.height * sizeof(uint32_t), allocator);
+    cmdImageCopy->reset();
+    cmdImageCopy->begin(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+    {
+        backBuffer->layoutTransition(VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, cmdImageCopy);
+        VkBufferImageCopy region = {};
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.layerCount = 1;
+        region.imageExtent = extent;
+        cmdImageCopy->copyImageToBuffer(backBuffer, buffer, region);
+        backBuffer->layoutTransition(presentLayout, cmdImageCopy);
+    }
+    cmdImageCopy->end();
+    submitCopyImageCommands();
+    // Convert to RGBA8
+    std::vector<uint32_t> pixels(extent.width * extent.height);
+    const VkFormat format = backBuffer->getFormat();
+    magma::helpers::mapScoped<uint32_t>(buffer,
+        [&pixels, format](const uint32_t *data)
+        {
+            for (std::size_t i = 0; i < pixels.size(); ++i)
+            {
+                const uint32_t texel = data[i];
+                switch (format)
+                {
+                case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+                    pixels[i] = 0xFF000000 |
+                        (((texel >> 22) & 0xFF) << 16) |
+                        (((texel >> 12) & 0xFF) << 8) |
+                         ((texel >> 2) & 0xFF);
+                    break;
+                case VK_FORMAT_B8G8R8A8_UNORM:
+                case VK_FORMAT_B8G8R8A8_SRGB:
+                    pixels[i] = 0xFF000000 |
+                        ((texel & 0xFF) << 16) |
+                        (texel & 0xFF00) |
+                        ((texel >> 16) & 0xFF);
+                    break;
+                default:
+                    pixels[i] = texel | 0xFF000000;
+                }
+            }
+        });
+    return pixels;
+}
+
+void VulkanRayTracingApp::printFrameStatistics() const
+{
+    const FramePacer::Statistics stats = framePacer->getStatistics();
+    if (stats.frameCount)
+    {
+        std::cout << FramePacer::getModeName(framePacer->getMode()) << " pacing: " << stats.frameCount << " frames, avg "
+            << stats.mean << " ms, std dev " << stats.stdDev << " (min " << stats.min << ", max " << stats.max << ")" << std::endl;
+    }
+}
+
+void VulkanRayTracingApp::printMemoryStatistics() const
+{
+    // Query through magma's allocator interface, its backend is an implementation detail
+    const std::vector<magma::MemoryBudget> budgets = deviceAllocator->getBudget();
+    VkDeviceSize allocationBytes = 0, blockBytes = 0;
+    for (uint32_t heapIndex = 0; heapIndex < static_cast<uint32_t>(budgets.size()); ++heapIndex)
+    {
+        const magma::MemoryBudget& heap = budgets[heapIndex];
+        if (heap.blockBytes)
+        {
+            std::cout << "memory heap " << heapIndex << ": " << heap.allocationBytes / 1024 << " of "
+                << heap.blockBytes / 1024 << " KiB used, process usage " << heap.usage / 1024 << " of "
+                << heap.budget / 1024 << " KiB budget" << std::endl;
+        }
+        allocationBytes += heap.allocationBytes;
+        blockBytes += heap.blockBytes;
+    }
+    std::cout << "device memory: " << allocationBytes / 1024 << " of " << blockBytes / 1024 << " KiB used, "
+        << (blockBytes - allocationBytes) / 1024 << " KiB free in allocated blocks" << std::endl;
+}
+
+void VulkanRayTracingApp::printBuildStatistics() const
+{
+    const BuildBatcher::Statistics& stats = buildBatcher->getStatistics();
+    if (stats.buildCount && stats.buildTime > 0.f)
+    {
+        std::cout << (buildBatcher->isHostBuild() ? "host" : "device") << " build: " << stats.buildCount << " structures in "
+            << stats.batchCount << " batches, " << stats.primitiveCount << " triangles, " << stats.buildTime << " ms ("
+            << stats.primitiveCount / stats.buildTime / 1000.f << " Mtris/s)" << std::endl;
+    }
+}
+
+bool VulkanRayTracingApp::accumulationConverged() const noexcept
+{
+    return (accumulationSamples > 1) && (accumulatedSamples >= accumulationSamples);
+}
+
+void VulkanRayTracingApp::updateAccumulation()
+{   // When converged, ray generation shader only copies accumulated image
+    Accumulation *accumulation = accumulationUniforms->getFrameData(frameInFlightIndex);
+    accumulation->sampleIndex = accumulatedSamples;
+    accumulation->sampleCount = accumulationSamples;
+    accumulation->frameIndex = frameIndex;
+    accumulationUniforms->flush(frameInFlightIndex);
+    if ((accumulationSamples > 1) && (accumulatedSamples < accumulationSamples))
+        ++accumulatedSamples;
+}
+
+void VulkanRayTracingApp::showProfilerCaption()
+{
+    std::basic_ostringstream<std::tstring::value_type> summary;
+    summary << caption << std::fixed << std::setprecision(2);
+    for (const GpuProfiler::Statistics& stats: profiler->getStatistics())
+    {   // Scope names are ASCII, so widening is lossless
+        if (stats.sampleCount > 1)
+            summary << TEXT(" | ") << std::tstring(stats.name.begin(), stats.name.end()) << TEXT(" ") << stats.avg << TEXT(" ms");
+    }
+    setWindowCaption(summary.str());
+}
+
+void VulkanRayTracingApp::checkRegression(const std::vector<uint32_t>& pixels)
+{
+    const std::string name = std::to_utf8(caption);
+    const FramePacer::Statistics stats = framePacer->getStatistics();
+    if (stats.frameCount)
+    {
+        std::cout << name << ": " << stats.frameCount << " frames, avg " << stats.mean << " ms"
+            << " (min " << stats.min << ", max " << stats.max << ")" << std::endl;
+        if (!timingsFileName.empty())
+        {
+            std::ofstream file(timingsFileName, std::ios::out | std::ios::app);
+            file << name << "," << stats.frameCount << "," << stats.mean << ","
+                << stats.min << "," << stats.max << "," << stats.stdDev << std::endl;
+        }
+    }
+    if (!captureFileName.empty())
+    {
+        if (!savePixels(captureFileName, pixels, width, height))
+            throw std::runtime_error("failed to write \"" + captureFileName + "\"");
+    }
+    if (cpuReference)
+    {   // Vulkan output is compared with the same frame traced on CPU
+        std::vector<uint32_t> reference(width * height);
+        if (renderReference(reference))
+        {
+            const std::string captureName = captureFileName.empty() ? name : captureFileName.substr(0, captureFileName.find_last_of('.'));
+            compareWithReference(name + " (CPU reference)", pixels, reference, captureName + "-cpu-diff.png");
+        }
+        else
+            std::cout << name << ": no CPU reference, skipped" << std::endl;
+    }
+    if (referenceFileName.empty())
+        return;
+    std::vector<uint32_t> reference;
+    uint32_t refWidth = 0, refHeight = 0;
+    if (!loadPixels(referenceFileName, reference, refWidth, refHeight))
+        throw std::runtime_error("failed to load \"" + referenceFileName + "\"");
+    if ((refWidth != width) || (refHeight != height))
+    {
+        std::cerr << name << ": FAILED, reference is " << refWidth << "x" << refHeight << std::endl;
+        exitCode = EXIT_FAILURE;
+        return;
+    }
+    compareWithReference(name, pixels, reference,
+        referenceFileName.substr(0, referenceFileName.find_last_of('.')) + "-diff.png");
+}
+
+void VulkanRayTracingApp::compareWithReference(const std::string& name, const std::vector<uint32_t>& pixels,
+    const std::vector<uint32_t>& reference, const std::string& heatmapFileName)
+{
+    const ImageDiff diff = compareImages(pixels, reference, width, height, diffThreshold);
+    const float failedFraction = diff.failedPixels / static_cast<float>(width * height);
+    const bool passed = (failedFraction <= diffTolerance);
+    std::cout << name << ": " << (passed ? "PASSED" : "FAILED")
+        << ", mean dE " << diff.meanError << ", max dE " << diff.maxError
+        << ", " << diff.failedPixels << " pixels above " << diffThreshold << std::endl;
+    if (!passed)
+    {
+        savePixels(heatmapFileName, diff.heatmap, width, height);
+        exitCode = EXIT_FAILURE;
+    }
+}
+
+void VulkanRayTracingApp::addFrameDependency(const TimelineScheduler::SyncPoint& syncPoint, VkPipelineStageFlags dstStageMask)
+{
+    frameDependencies.push_back(TimelineScheduler::Dependency{syncPoint, dstStageMask});
 }
 
 void VulkanRayTracingApp::submitCommandBuffer(uint32_t bufferIndex)
 {
-    graphicsQueue->submit(commandBuffers[bufferIndex],
+    if (dynamicResolution)
+    {   // GPU has finished this frame, so its command buffer can be recorded again with new launch size
+        float& recordedScale = recordedScales[frameInFlightIndex * swapchainImageViews.size() + bufferIndex];
+        if (recordedScale != dynamicResolution->getScale())
+        {
+            getCommandBuffer(frameInFlightIndex, bufferIndex)->reset();
+            recordCommandBuffer(frameInFlightIndex, bufferIndex);
+            recordedScale = dynamicResolution->getScale();
+        }
+    }
+    frameSyncPoints[frameInFlightIndex] = scheduler->submit(TimelineScheduler::Graphics,
+        getCommandBuffer(frameInFlightIndex, bufferIndex),
+        frameDependencies, // Wait for work submitted to other queues
+        headless ? nullptr : presentFinished[frameInFlightIndex], // Wait for swapchain
         VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
-        presentFinished, // Wait for swapchain
-        renderFinished, // Semaphore to be signaled when command buffer completed execution
-        *waitFence); // Fence to be signaled when command buffer completed execution
+        headless ? nullptr : renderFinished[bufferIndex]); // Semaphore to be signaled when command buffer completed execution
+    // Submissions are not executed in order, so keep waiting until dependency is reached
+    frameDependencies.erase(std::remove_if(frameDependencies.begin(), frameDependencies.end(),
+        [this](const TimelineScheduler::Dependency& dependency)
+        {
+            return scheduler->reached(dependency.syncPoint);
+        }),
+        frameDependencies.end());
+}
+
+TimelineScheduler::SyncPoint VulkanRayTracingApp::submitComputeCommands()
+{
+    return submitComputeCommands(cmdCompute);
+}
+
+TimelineScheduler::SyncPoint VulkanRayTracingApp::submitComputeCommands(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer)
+{   // Graphics queue will wait for compute results without CPU round-trip
+    const TimelineScheduler::SyncPoint syncPoint = scheduler->submit(TimelineScheduler::Compute, cmdBuffer);
+    scratchAllocator->release(syncPoint);
+    addFrameDependency(syncPoint,
+        VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR);
+    return syncPoint;
 }
 
 void VulkanRayTracingApp::submitCopyImageCommands()
 {
-    waitFences[0]->reset();
-    graphicsQueue->submit(cmdImageCopy, 0, nullptr, nullptr, waitFences[0]);
-    waitFences[0]->wait();
-    graphicsQueue->onIdle();
+    scheduler->wait(scheduler->submit(TimelineScheduler::Graphics, cmdImageCopy));
 }
 
 void VulkanRayTracingApp::submitCopyBufferCommands()
 {
-    waitFences[1]->reset();
-    transferQueue->submit(cmdBufferCopy, 0, nullptr, nullptr, waitFences[1]);
-    waitFences[1]->wait();
-    transferQueue->onIdle();
+    scheduler->wait(scheduler->submit(TimelineScheduler::Transfer, cmdBufferCopy));
 }
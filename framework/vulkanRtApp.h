@@ -1,4 +1,5 @@
 #pragma once
+#include <functional>
 
 #ifdef VK_USE_PLATFORM_WIN32_KHR
 #include "winApp.h"
@@ -12,7 +13,20 @@
 #include "rapid/rapid.h"
 #include "shaderReflectionFactory.h"
 #include "rayTracingPipeline.h"
+#include "pipelineCache.h"
+#include "commandLine.h"
 #include "timer.h"
+#include "framePacer.h"
+#include "timelineScheduler.h"
+#include "frameUniformBuffer.h"
+#include "gpuProfiler.h"
+#include "dynamicResolution.h"
+#include "accelerationStructureCache.h"
+#include "lodCache.h"
+#include "scratchAllocator.h"
+#include "buildBatcher.h"
+#include "instanceTracker.h"
+#include "shaderRecordTable.h"
 
 #if !defined(VK_KHR_acceleration_structure) ||\
     !defined(VK_KHR_ray_tracing_pipeline) ||\
@@ -21,6 +35,7 @@
     !defined(VK_KHR_buffer_device_address) ||\
     !defined(VK_KHR_spirv_1_4) ||\
     !defined(VK_KHR_shader_float_controls) ||\
+    !defined(VK_KHR_timeline_semaphore) ||\
     !defined(VK_EXT_descriptor_indexing)
 #error Newer Vulkan SDK is required
 #endif
@@ -37,7 +52,7 @@ class VulkanRayTracingApp : public PlatformApp
 {
 public:
     enum Buffer : uint8_t;
-    enum class PresentationWait : uint8_t;
+    static constexpr uint32_t maxFramesInFlight = 3;
 
     struct View
     {
@@ -46,31 +61,64 @@ public:
         rapid::matrix viewProjInv;
     };
 
-    VulkanRayTracingApp(const AppEntry& entry, const std::tstring& caption, uint32_t width, uint32_t height);
+    struct Accumulation
+    {
+        uint32_t sampleIndex;
+        uint32_t sampleCount;
+        uint32_t frameIndex;
+    };
+
+    VulkanRayTracingApp(const AppEntry& entry, const std::tstring& caption, uint32_t width, uint32_t height,
+        bool accumulation = false);
     ~VulkanRayTracingApp();
     void close() override;
     virtual void render(uint32_t bufferIndex) = 0;
+    virtual void recordCommandBuffer(uint32_t frame, uint32_t bufferIndex) = 0;
     virtual void onIdle() override;
     virtual void onPaint() override;
+    virtual void onMouseMove(int x, int y) override;
 
 protected:
     void createInstance();
     void createLogicalDevice();
+    void createAllocator();
     void createRenderPass();
     void createSwapchain();
+    void createOffscreenImages();
+    void createInternalImage();
     void createFramebuffer();
     void createCommandBuffers();
     void createSyncPrimitives();
     void createDescriptorPool();
     void createDescriptorSets();
     void createUniformBuffers();
+    void createProfiler(bool enabled);
+    void createAccumulationResources();
+    void recordCommandBuffers();
 
+    const std::shared_ptr<magma::CommandBuffer>& getCommandBuffer(uint32_t frame, uint32_t bufferIndex) const noexcept;
     std::shared_ptr<magma::Buffer> allocateScratchBuffer(VkDeviceSize size);
+    magma::Sharing getComputeGraphicsSharing() const;
+    std::vector<uint32_t> readBackbuffer(uint32_t bufferIndex);
+    void traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t bufferIndex,
+        const magma::ShaderBindingTable& shaderBindingTable);
+    void traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t bufferIndex,
+        const ShaderRecordTable& shaderRecordTable);
+    void addFrameDependency(const TimelineScheduler::SyncPoint& syncPoint, VkPipelineStageFlags dstStageMask);
     void submitCommandBuffer(uint32_t bufferIndex);
+    // Samples that can be traced on CPU override this to provide reference of the last frame
+    virtual bool renderReference(std::vector<uint32_t>& /* pixels */) const { return false; }
+    TimelineScheduler::SyncPoint submitComputeCommands();
+    TimelineScheduler::SyncPoint submitComputeCommands(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer);
     void submitCopyImageCommands();
     void submitCopyBufferCommands();
+    void resetAccumulation() noexcept { accumulatedSamples = 0; }
+    // Samples that move something by timer override this to keep rendering every frame
+    virtual bool isAnimated() const noexcept { return false; }
+    bool accumulationConverged() const noexcept;
 
-    std::shared_ptr<magma::IAllocator> allocator;
+    std::shared_ptr<magma::Allocator> allocator;
+    std::shared_ptr<magma::DeviceMemoryAllocator> deviceAllocator;
     std::shared_ptr<magma::Instance> instance;
     std::shared_ptr<magma::DebugReportCallback> debugReportCallback;
     std::shared_ptr<magma::Surface> surface;
@@ -80,6 +128,7 @@ protected:
     std::unique_ptr<magma::InstanceExtensions> instanceExtensions;
     std::unique_ptr<magma::DeviceExtensions> extensions;
     std::vector<std::shared_ptr<magma::ImageView>> swapchainImageViews;
+    std::shared_ptr<magma::ImageView> internalImageView;
     std::shared_ptr<magma::RenderPass> renderPass;
     std::vector<std::shared_ptr<magma::Framebuffer>> framebuffers;
 
@@ -92,41 +141,87 @@ protected:
     std::shared_ptr<magma::Queue> graphicsQueue;
     std::shared_ptr<magma::Queue> computeQueue;
     std::shared_ptr<magma::Queue> transferQueue;
-    std::shared_ptr<magma::Semaphore> presentFinished;
-    std::shared_ptr<magma::Semaphore> renderFinished;
-    std::vector<std::unique_ptr<magma::Fence>> waitFences;
-    const std::unique_ptr<magma::Fence> nullFence;
-    const std::unique_ptr<magma::Fence> *waitFence;
+    std::vector<std::shared_ptr<magma::Semaphore>> presentFinished;
+    std::vector<std::shared_ptr<magma::Semaphore>> renderFinished;
+    std::unique_ptr<TimelineScheduler> scheduler;
+    TimelineScheduler::SyncPoint frameSyncPoints[maxFramesInFlight];
+    std::vector<TimelineScheduler::Dependency> frameDependencies;
 
     std::shared_ptr<magma::DescriptorPool> descriptorPool;
     std::vector<std::shared_ptr<magma::DescriptorSet>> swapchainDescriptorSets;
     std::shared_ptr<magma::UniformBuffer<View>> viewUniforms;
     std::shared_ptr<magma::Buffer> scratchBuffer;
+    std::unique_ptr<ScratchAllocator> scratchAllocator;
+    std::unique_ptr<BuildBatcher> buildBatcher;
+    std::shared_ptr<magma::StorageImage2D> accumulationImage;
+    std::unique_ptr<FrameUniformBuffer<Accumulation>> accumulationUniforms;
+    std::shared_ptr<magma::DescriptorSet> accumulationDescriptorSet;
 
-    std::shared_ptr<magma::PipelineCache> pipelineCache;
+    std::shared_ptr<PipelineCache> pipelineCache;
     std::shared_ptr<ShaderReflectionFactory> shaderReflectionFactory;
+    std::unique_ptr<AccelerationStructureCache> accelerationStructureCache;
+    std::unique_ptr<LodCache> lodCache;
 
     std::unique_ptr<Timer> timer;
+    std::unique_ptr<FramePacer> framePacer;
+    std::unique_ptr<GpuProfiler> profiler;
+    std::unique_ptr<DynamicResolution> dynamicResolution;
     VkSurfaceFormatKHR backbufferFormat;
+    VkImageLayout presentLayout;
     bool vSync;
-    PresentationWait presentWait;
+    uint32_t framesInFlight;
+    uint32_t frameInFlightIndex;
     uint32_t bufferIndex;
     uint32_t frameIndex;
+    const bool accumulation; // Sample binds accumulation descriptor set
 
 private:
+    void printFrameStatistics() const;
+    void printMemoryStatistics() const;
+    void printBuildStatistics() const;
+    void showProfilerCaption();
+    void updateAccumulation();
+    void checkRegression(const std::vector<uint32_t>& pixels);
+    void compareWithReference(const std::string& name, const std::vector<uint32_t>& pixels,
+        const std::vector<uint32_t>& reference, const std::string& heatmapFileName);
+    void traceRays(const std::shared_ptr<magma::CommandBuffer>& cmdBuffer, uint32_t bufferIndex,
+        const std::function<void(uint32_t width, uint32_t height)>& dispatch);
+
+    // Regression mode
+    uint32_t maxFrames;
+    std::string captureFileName;
+    std::string referenceFileName;
+    std::string timingsFileName;
+    bool cpuReference;
+    float diffThreshold;
+    float diffTolerance;
+    // Profiling
+    std::string profileCsvFileName;
+    std::string profileTraceFileName;
+    bool profiling;
+    bool memoryStatistics;
+    bool hostBuild;
+    // Progressive accumulation
+    uint32_t accumulationSamples;
+    uint32_t accumulatedSamples;
+    // Dispatch scale of each command buffer
+    std::vector<float> recordedScales;
+
     struct SwapchainImageTable : magma::DescriptorSetTable
     {
         magma::descriptor::StorageImage output = 0;
         MAGMA_REFLECT(output)
     } swapchainImageTables[3];
+
+    struct AccumulationTable : magma::DescriptorSetTable
+    {
+        magma::descriptor::StorageImage image = 0;
+        magma::descriptor::DynamicUniformBuffer parameters = 1;
+        MAGMA_REFLECT(image, parameters)
+    } accumulationTable;
 };
 
 enum VulkanRayTracingApp::Buffer : uint8_t
 {
     Front, Back
 };
-
-enum class VulkanRayTracingApp::PresentationWait : uint8_t
-{
-    Fence, Queue, Device
-};
@@ -1,4 +1,5 @@
 #include "winApp.h"
+#include "commandLine.h"
 
 Win32App *Win32App::self;
 DebugOutputStream Win32App::dostream;
@@ -9,6 +10,9 @@ Win32App::Win32App(const AppEntry& entry, const std::tstring& caption, uint32_t
     hWnd(NULL)
 {
     Win32App::self = this;
+    headless = CommandLine(entry).hasOption("--headless");
+    if (headless)
+        return;
     HICON icon = (HICON)LoadImage(NULL, TEXT("..\\framework\\resources\\vulkan.ico"),
         IMAGE_ICON, 64, 64, LR_LOADFROMFILE);
 
@@ -42,17 +46,33 @@ Win32App::Win32App(const AppEntry& entry, const std::tstring& caption, uint32_t
 
 Win32App::~Win32App()
 {
+    if (headless)
+        return;
     DestroyWindow(hWnd);
     UnregisterClass(TEXT("demo"), hInstance);
 }
 
 void Win32App::setWindowCaption(const std::tstring& caption)
 {
-    SetWindowText(hWnd, caption.c_str());
+    if (headless)
+        return;
+    SetWindowTextW(hWnd, caption.c_str());
+}
+
+std::string std::to_utf8(const std::tstring& str)
+{
+    if (str.empty())
+        return std::string();
+    const int length = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), static_cast<int>(str.length()), nullptr, 0, nullptr, nullptr);
+    std::string utf8(length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, str.c_str(), static_cast<int>(str.length()), &utf8[0], length, nullptr, nullptr);
+    return utf8;
 }
 
 void Win32App::show() const
 {
+    if (headless)
+        return;
     // Get desktop resolution
     const HWND hDesktopWnd = GetDesktopWindow();
     RECT desktopRect;
@@ -73,6 +93,12 @@ void Win32App::show() const
 
 void Win32App::run()
 {
+    if (headless)
+    {
+        while (!quit)
+            onIdle();
+        return;
+    }
     while (!quit)
     {
         MSG msg;
@@ -2,10 +2,17 @@
 #include <cassert>
 #include <xcb/xcb_icccm.h> // libxcb-icccm4-dev
 #include "xcbApp.h"
+#include "commandLine.h"
 
 XcbApp::XcbApp(const AppEntry& entry, const std::tstring& caption, uint32_t width, uint32_t height):
     BaseApp(caption, width, height)
 {
+    headless = CommandLine(entry).hasOption("--headless");
+    if (headless)
+    {   // Doesn't require X server
+        std::cout << "Platform: headless" << std::endl;
+        return;
+    }
     std::cout << "Platform: XCB" << std::endl;
     connection = xcb_connect(nullptr, nullptr);
     if (xcb_connection_has_error(connection))
@@ -53,6 +60,8 @@ XcbApp::XcbApp(const AppEntry& entry, const std::tstring& caption, uint32_t widt
 
 XcbApp::~XcbApp()
 {
+    if (headless)
+        return;
     free(deleteWindow);
     xcb_destroy_window(connection, window);
     xcb_disconnect(connection);
@@ -60,6 +69,8 @@ XcbApp::~XcbApp()
 
 void XcbApp::setWindowCaption(const std::tstring& caption)
 {
+    if (headless)
+        return;
     xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window,
         XCB_ATOM_WM_NAME, XCB_ATOM_STRING,
         sizeof(char) * 8, caption.length(), caption.c_str());
@@ -67,6 +78,8 @@ void XcbApp::setWindowCaption(const std::tstring& caption)
 
 void XcbApp::show() const
 {
+    if (headless)
+        return;
     uint32_t coords[2] = {0, 0};
     if (width < screen->width_in_pixels &&
         height < screen->height_in_pixels)
@@ -81,6 +94,12 @@ void XcbApp::show() const
 
 void XcbApp::run()
 {
+    if (headless)
+    {
+        while (!quit)
+            onIdle();
+        return;
+    }
     xcb_flush(connection);
     while (!quit)
     {
@@ -1,8 +1,15 @@
 #include "xlibApp.h"
+#include "commandLine.h"
 
 XlibApp::XlibApp(const AppEntry& entry, const std::tstring& caption, uint32_t width, uint32_t height):
     BaseApp(caption, width, height)
 {
+    headless = CommandLine(entry).hasOption("--headless");
+    if (headless)
+    {   // Doesn't require X server
+        std::cout << "Platform: headless" << std::endl;
+        return;
+    }
     std::cout << "Platform: Xlib" << std::endl;
     XInitThreads();
     dpy = XOpenDisplay(NULL);
@@ -61,17 +68,23 @@ XlibApp::XlibApp(const AppEntry& entry, const std::tstring& caption, uint32_t wi
 
 XlibApp::~XlibApp()
 {
+    if (headless)
+        return;
     XDestroyWindow(dpy, window);
     XCloseDisplay(dpy);
 }
 
 void XlibApp::setWindowCaption(const std::tstring& caption)
 {
+    if (headless)
+        return;
     XStoreName(dpy, window, caption.c_str());
 }
 
 void XlibApp::show() const
 {
+    if (headless)
+        return;
     const Screen *screen = DefaultScreenOfDisplay(dpy);
     XWindowChanges changes = {};
     changes.x = 0;
@@ -88,6 +101,12 @@ void XlibApp::show() const
 
 void XlibApp::run()
 {
+    if (headless)
+    {
+        while (!quit)
+            onIdle();
+        return;
+    }
     while (!quit)
     {
         while (XPending(dpy))